@@ -3,24 +3,34 @@
 #include "assert.hh"
 #include "buffer_manager.hh"
 #include "client.hh"
+#include "client_manager.hh"
+#include "compression.hh"
 #include "containers.hh"
 #include "context.hh"
+#include "debug.hh"
+#include "diff.hh"
+#include "face_registry.hh"
 #include "file.hh"
+#include "file_watcher.hh"
 #include "shared_string.hh"
+#include "unordered_map.hh"
 #include "utils.hh"
 #include "window.hh"
 
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
 
 namespace Kakoune
 {
 
-Buffer::Buffer(String name, Flags flags, BufferLines lines,
+Buffer::Buffer(String name, Flags flags, LineList lines,
                time_t fs_timestamp)
     : Scope(GlobalScope::instance()),
       m_name(flags & Flags::File ? real_path(parse_filename(name)) : std::move(name)),
       m_flags(flags | Flags::NoUndo),
-      m_history(), m_history_cursor(m_history.begin()),
       m_last_save_undo_index(0),
       m_fs_timestamp(fs_timestamp)
 {
@@ -28,18 +38,21 @@ Buffer::Buffer(String name, Flags flags, BufferLines lines,
     options().register_watcher(*this);
 
     if (lines.empty())
-        lines.emplace_back(StringStorage::create("\n"));
+        lines.assign({ StringStorage::create("\n") });
 
-    for (auto& line : lines)
+    for (auto line : lines)
     {
-        kak_assert(not line->length == 0 and line->data()[line->length-1] == '\n');
+        kak_assert(not line.empty() and line.back() == '\n');
     }
-    static_cast<BufferLines&>(m_lines) = std::move(lines);
+    m_lines = std::move(lines);
 
     m_changes.push_back({ Change::Insert, true, {0,0}, line_count() });
 
     if (flags & Flags::File)
     {
+        if (FileWatcher::has_instance())
+            FileWatcher::instance().watch(m_name);
+
         if (flags & Flags::New)
             run_hook_in_own_context("BufNew", m_name);
         else
@@ -65,6 +78,14 @@ Buffer::~Buffer()
     options().unregister_watcher(*this);
     BufferManager::instance().unregister_buffer(*this);
     m_values.clear();
+    for (auto reader : m_change_readers)
+        reader->m_buffer = nullptr;
+
+    if ((m_flags & Flags::File) and FileWatcher::has_instance())
+        FileWatcher::instance().unwatch(m_name);
+
+    if (m_spill_fd >= 0)
+        close(m_spill_fd);
 }
 
 String Buffer::display_name() const
@@ -80,7 +101,21 @@ bool Buffer::set_name(String name)
     if (other == nullptr or other == this)
     {
         if (m_flags & Flags::File)
+        {
+            if (FileWatcher::has_instance())
+            {
+                FileWatcher::instance().unwatch(m_name);
+                FileWatcher::instance().watch(real_path(name));
+            }
             m_name = real_path(name);
+            // the edits journal applies to the previous file
+            if (m_journal.enabled())
+            {
+                m_journal.disable();
+                m_journal.enable(m_name);
+                m_journal.suspend();
+            }
+        }
         else
             m_name = std::move(name);
         return true;
@@ -156,11 +191,128 @@ struct Buffer::Modification
     }
 };
 
-void Buffer::reload(BufferLines lines, time_t fs_timestamp)
+// An undo group of the history, groups away from the history cursor are
+// packed in compressed form, which can be moved to the spill file.
+struct Buffer::HistoryEntry
 {
-    m_changes.push_back({ Change::Erase, true, {0,0}, line_count() });
+    HistoryEntry(UndoGroup group) : group(std::move(group)) {}
+
+    // empty when the entry is packed
+    UndoGroup group;
+    // packed data, when held in memory, shared with history snapshots
+    ref_ptr<StringStorage> packed;
+    // location of the packed data in the spill file, kept when the
+    // entry gets unpacked so that packing it again is free.
+    ssize_t spill_offset = -1;
+    size_t  spill_size = 0;
+
+    size_t packed_size() const { return packed ? packed->length : 0; }
+    // packed data can be read back without being held in memory
+    bool stored() const { return spill_offset >= 0; }
+};
+
+static size_t zigzag(int value) { return ((size_t)value << 1) ^ (size_t)(value >> 31); }
+static int unzigzag(size_t value) { return (int)(value >> 1) ^ -(int)(value & 1); }
+
+// Undo groups are packed as their modification types and coordinates,
+// delta encoded, followed by their contents, and compressed.
+template<typename Group>
+static String pack_undo_group(const Group& group)
+{
+    String data;
+    write_varint(data, group.size());
+    ByteCoord coord;
+    for (auto& modification : group)
+    {
+        write_varint(data, (size_t)modification.type);
+        write_varint(data, zigzag((int)(modification.coord.line - coord.line)));
+        write_varint(data, zigzag((int)(modification.coord.column - coord.column)));
+        write_varint(data, (int)modification.content.length());
+        coord = modification.coord;
+    }
+    for (auto& modification : group)
+        data += modification.content;
+    return compress(data);
+}
+
+template<typename Group>
+static Group unpack_undo_group(StringView packed)
+{
+    const String data = decompress(packed);
+    const char* pos = data.data();
+    const char* end = data.data() + (int)data.length();
+
+    using Type = typename Group::value_type::Type;
+    struct Header { size_t type; ByteCoord coord; size_t length; };
+    // packed groups can come from an undo file, check them
+    const size_t count = read_varint(pos, end);
+    if (count == 0 or count > (size_t)(end - pos) / 4)
+        throw runtime_error("invalid packed undo group size");
+    Vector<Header, MemoryDomain::BufferMeta> headers(count);
+    ByteCoord coord;
+    for (auto& header : headers)
+    {
+        header.type = read_varint(pos, end);
+        coord.line += unzigzag(read_varint(pos, end));
+        coord.column += unzigzag(read_varint(pos, end));
+        header.coord = coord;
+        header.length = read_varint(pos, end);
+        if (header.type > (size_t)Type::Erase or coord.line < 0 or coord.column < 0)
+            throw runtime_error("invalid packed undo group modification");
+    }
+
+    Group group;
+    group.reserve(headers.size());
+    for (auto& header : headers)
+    {
+        if (header.length > (size_t)(end - pos))
+            throw runtime_error("invalid packed undo group");
+        group.emplace_back((Type)header.type, header.coord,
+                           SharedString{StringView{pos, pos + header.length}});
+        pos += header.length;
+    }
+    return group;
+}
+
+void Buffer::reload(LineList lines, time_t fs_timestamp)
+{
+    if (lines.empty())
+        lines.assign({ StringStorage::create("\n") });
+
+    for (auto line : lines)
+    {
+        kak_assert(not line.empty() and line.back() == '\n');
+    }
 
     commit_undo_group();
+
+    // lazily loaded lines might point into a file that got truncated,
+    // they cannot be compared with the new ones.
+    if (m_lines.lazy_byte_count() != 0)
+        replace_all_lines(std::move(lines));
+    else
+        apply_line_diff(lines);
+
+    commit_undo_group();
+
+    m_last_save_undo_index = m_history_cursor;
+    m_fs_timestamp = fs_timestamp;
+    // the buffer matches its file again
+    journal_saved(m_journal.position());
+}
+
+void Buffer::set_evicted_lines(LineList lines)
+{
+    kak_assert(lines.size() == m_lines.size() and
+               lines.byte_count() == m_lines.byte_count());
+    m_lines = std::move(lines);
+    m_evicted_timestamp = timestamp();
+}
+
+void Buffer::replace_all_lines(LineList lines)
+{
+    m_changes.push_back({ Change::Erase, true, {0,0}, line_count() });
+
     if (not (m_flags & Flags::NoUndo))
     {
         for (auto line = line_count()-1; line >= 0; --line)
@@ -168,25 +320,477 @@ void Buffer::reload(BufferLines lines, time_t fs_timestamp)
                 Modification::Erase, line, m_lines[line]);
     }
 
-    if (lines.empty())
-        lines.emplace_back(StringStorage::create("\n"));
-
-    for (size_t l = 0; l < lines.size(); ++l)
+    m_lines = std::move(lines);
+    if (not (m_flags & Flags::NoUndo))
     {
-        auto& line = lines[l];
-        kak_assert(not line->length == 0 and line->data()[line->length-1] == '\n');
-        if (not (m_flags & Flags::NoUndo))
+        for (auto line = 0_line; line < line_count(); ++line)
             m_current_undo_group.emplace_back(
-                Modification::Insert, LineCount{(int)l}, SharedString{line});
+                Modification::Insert, line, SharedString{m_lines.get_storage(line)});
     }
-    static_cast<BufferLines&>(m_lines) = std::move(lines);
 
-    commit_undo_group();
+    m_changes.push_back({ Change::Insert, true, {0,0}, line_count() });
+}
 
-    m_last_save_undo_index = m_history_cursor - m_history.begin();
-    m_fs_timestamp = fs_timestamp;
+// replace the lines that differ from the given ones, recording line
+// based changes and modifications for each differing hunk, so that
+// selections, undo history and change consumers stay incremental.
+void Buffer::apply_line_diff(const LineList& lines)
+{
+    const int old_count = (int)line_count();
+    const int new_count = (int)lines.size();
 
-    m_changes.push_back({ Change::Insert, true, {0,0}, line_count() });
+    int prefix = 0;
+    while (prefix < old_count and prefix < new_count and
+           m_lines[prefix] == lines[prefix])
+        ++prefix;
+
+    int suffix = 0;
+    while (suffix < old_count - prefix and suffix < new_count - prefix and
+           m_lines[old_count - 1 - suffix] == lines[new_count - 1 - suffix])
+        ++suffix;
+
+    if (prefix == old_count and prefix == new_count)
+        return;
+
+    // diff lines through ids so that content is hashed only once
+    UnorderedMap<StringView, int, MemoryDomain::BufferMeta> line_ids;
+    auto get_ids = [&](const LineList& list, int count) {
+        Vector<int, MemoryDomain::BufferMeta> ids;
+        ids.reserve(count - prefix - suffix);
+        for (int line = prefix; line < count - suffix; ++line)
+            ids.push_back(line_ids.emplace(list[line], (int)line_ids.size()).first->second);
+        return ids;
+    };
+    const auto old_ids = get_ids(m_lines, old_count);
+    const auto new_ids = get_ids(lines, new_count);
+
+    // keep diffing time bounded on big files, parts of the hunks
+    // needing more edits are just replaced.
+    const int max_cost = std::max(256, 64 * 1024 * 1024 / (int)(old_ids.size() + new_ids.size()));
+    auto diffs = find_diff(old_ids.begin(), (int)old_ids.size(),
+                           new_ids.begin(), (int)new_ids.size(), max_cost);
+
+    const bool undo = not (m_flags & Flags::NoUndo);
+    LineCount pos = prefix;
+    for (auto it = diffs.begin(); it != diffs.end(); )
+    {
+        if (it->mode == Diff::Keep)
+        {
+            pos += (it++)->len;
+            continue;
+        }
+
+        // consecutive adds and removes replace a contiguous range of lines,
+        // insert the new ones first so that the buffer never gets empty.
+        int removed = 0;
+        BufferLines added;
+        for (; it != diffs.end() and it->mode != Diff::Keep; ++it)
+        {
+            if (it->mode == Diff::Remove)
+                removed += it->len;
+            else for (int i = 0; i < it->len; ++i)
+                added.push_back(lines.get_storage(prefix + it->posB + i));
+        }
+
+        if (not added.empty())
+        {
+            const bool at_end = pos == line_count();
+            if (undo)
+            {
+                for (int i = 0; i < (int)added.size(); ++i)
+                    m_current_undo_group.emplace_back(
+                        Modification::Insert, pos + i, SharedString{added[i]});
+            }
+            const LineCount count = (int)added.size();
+            m_lines.replace(pos, pos, std::move(added));
+            m_changes.push_back({ Change::Insert, at_end, pos, pos + count });
+            pos += count;
+        }
+
+        if (removed != 0)
+        {
+            if (undo)
+            {
+                for (int i = 0; i < removed; ++i)
+                    m_current_undo_group.emplace_back(
+                        Modification::Erase, pos,
+                        SharedString{m_lines.get_storage(pos + i)});
+            }
+            m_lines.replace(pos, pos + removed, {});
+            m_changes.push_back({ Change::Erase, is_end(pos), pos, pos + removed });
+        }
+    }
+}
+
+// Users of changes_since register their ChangeTimestamp, only the changes
+// before the oldest one are dropped. Timestamps that were already behind
+// the change log start need a full recompute anyway and are ignored.
+void Buffer::compact_changes()
+{
+    constexpr size_t max_changes = 16384;
+    if (m_changes.size() <= max_changes)
+        return;
+
+    size_t oldest = timestamp();
+    for (auto reader : m_change_readers)
+    {
+        if (reader->m_timestamp >= m_changes_offset)
+            oldest = std::min(oldest, reader->m_timestamp);
+    }
+
+    const size_t dropped = oldest - m_changes_offset;
+    m_changes.erase(m_changes.begin(), m_changes.begin() + dropped);
+    m_changes_offset += dropped;
+}
+
+String Buffer::packed_data(const HistoryEntry& entry) const
+{
+    if (entry.spill_offset < 0)
+        return entry.packed->strview().str();
+
+    String data;
+    data.stdstr().resize(entry.spill_size);
+    size_t pos = 0;
+    while (pos != entry.spill_size)
+    {
+        ssize_t count = pread(m_spill_fd, &data.stdstr()[pos], entry.spill_size - pos,
+                              entry.spill_offset + pos);
+        if (count <= 0)
+            throw runtime_error("unable to read undo history: "_str +
+                                (count < 0 ? strerror(errno) : "truncated file"));
+        pos += count;
+    }
+    return data;
+}
+
+const Buffer::UndoGroup& Buffer::unpacked_group(size_t index)
+{
+    auto& entry = m_history[index];
+    if (entry.group.empty())
+    {
+        entry.group = unpack_undo_group<UndoGroup>(packed_data(entry));
+        m_packed_size -= entry.packed_size();
+        entry.packed = ref_ptr<StringStorage>{};
+    }
+    m_unpacked_begin = std::min(m_unpacked_begin, index);
+    m_unpacked_end = std::max(m_unpacked_end, index + 1);
+    return entry.group;
+}
+
+void Buffer::pack_entry(HistoryEntry& entry)
+{
+    if (entry.group.empty())
+        return;
+    if (not entry.stored())
+    {
+        entry.packed = StringStorage::create(pack_undo_group(entry.group));
+        m_packed_size += entry.packed_size();
+    }
+    entry.group = UndoGroup{};
+}
+
+static int create_spill_file()
+{
+    String pattern = tmp_file_path("kak-undo.XXXXXX");
+    int fd = mkstemp(&pattern.stdstr()[0]);
+    // the file lives as long as its descriptor
+    if (fd >= 0)
+        unlink(pattern.c_str());
+    return fd;
+}
+
+// copy the spilled entries still in the history to a new spill file,
+// or just close it if there are none.
+void Buffer::compact_spill_file()
+{
+    int fd = -1;
+    if (m_spill_live_size != 0 and (fd = create_spill_file()) < 0)
+        return;
+
+    Vector<ssize_t, MemoryDomain::BufferMeta> offsets;
+    size_t size = 0;
+    for (auto& entry : m_history)
+    {
+        if (entry.spill_offset < 0)
+            continue;
+        try
+        {
+            const String data = packed_data(entry);
+            if (pwrite(fd, data.data(), (int)data.length(), size) != (ssize_t)entry.spill_size)
+                throw runtime_error(strerror(errno));
+        }
+        catch (runtime_error&)
+        {
+            close(fd);
+            return;
+        }
+        offsets.push_back(size);
+        size += entry.spill_size;
+    }
+    kak_assert(size == m_spill_live_size);
+
+    auto offset = offsets.begin();
+    for (auto& entry : m_history)
+    {
+        if (entry.spill_offset >= 0)
+            entry.spill_offset = *offset++;
+    }
+    close(m_spill_fd);
+    m_spill_fd = fd;
+    m_spill_file_size = size;
+}
+
+bool Buffer::compact_history(size_t spill_size)
+{
+    // undo groups near the cursor are likely to be needed soon
+    constexpr size_t kept_unpacked = 16;
+    // restored groups are never unpacked
+    const size_t cursor = m_history_cursor > m_restored.count ?
+                          m_history_cursor - m_restored.count : 0;
+    const size_t begin = cursor > kept_unpacked ? cursor - kept_unpacked : 0;
+    const size_t end = std::min(cursor + kept_unpacked, m_history.size());
+
+    bool compacted = false;
+    for (size_t i = m_unpacked_begin; i < std::min(begin, m_unpacked_end); ++i)
+    {
+        pack_entry(m_history[i]);
+        compacted = true;
+    }
+    for (size_t i = std::max(end, m_unpacked_begin); i < m_unpacked_end; ++i)
+    {
+        pack_entry(m_history[i]);
+        compacted = true;
+    }
+    m_unpacked_begin = std::max(m_unpacked_begin, begin);
+    m_unpacked_end = std::max(m_unpacked_begin, std::min(m_unpacked_end, end));
+
+    // entries dropped from the history leave dead data in the spill file
+    if (m_spill_file_size - m_spill_live_size > m_spill_live_size)
+        compact_spill_file();
+
+    if (spill_size == 0 or m_packed_size <= spill_size)
+        return compacted;
+
+    if (m_spill_fd < 0 and (m_spill_fd = create_spill_file()) < 0)
+        return compacted;
+
+    // write the oldest packed entries first, they are the least likely
+    // to be needed again.
+    bool all_spilled = true;
+    for (size_t i = m_spill_scan; i < m_history.size() and m_packed_size > spill_size; ++i)
+    {
+        auto& entry = m_history[i];
+        if (not entry.stored() and entry.packed)
+        {
+            StringView data = entry.packed->strview();
+            if (pwrite(m_spill_fd, data.data(), (int)data.length(),
+                       m_spill_file_size) != (ssize_t)(int)data.length())
+                return compacted;
+            entry.spill_offset = m_spill_file_size;
+            entry.spill_size = (int)data.length();
+            m_spill_file_size += entry.spill_size;
+            m_spill_live_size += entry.spill_size;
+            m_packed_size -= entry.spill_size;
+            entry.packed = ref_ptr<StringStorage>{};
+            compacted = true;
+        }
+        all_spilled = all_spilled and entry.stored();
+        if (all_spilled)
+            m_spill_scan = i + 1;
+    }
+    return compacted;
+}
+
+static uint64_t content_hash(const LineList& lines)
+{
+    uint64_t hash = lines.byte_count();
+    for (auto line : lines)
+        hash = (hash ^ hash_data(line.data(), (int)line.length())) * 0x100000001b3;
+    return hash;
+}
+
+uint64_t Buffer::content_hash() const
+{
+    return Kakoune::content_hash(m_lines);
+}
+
+// Serialized histories start with a magic string, followed by the content
+// hash, the group count and the history cursor, then the offset and size
+// of each packed group in the data that follows. Integers are stored as
+// native 64 bits values.
+static constexpr StringView history_magic = { "KAKUNDO1", 8 };
+
+Buffer::HistorySnapshot Buffer::history_snapshot() const
+{
+    HistorySnapshot snapshot;
+    snapshot.m_restored = m_restored;
+    snapshot.m_cursor = m_history_cursor;
+    snapshot.m_groups.reserve(m_history.size());
+    for (auto& entry : m_history)
+    {
+        if (entry.stored())
+            snapshot.m_groups.push_back({{}, entry.spill_offset, entry.spill_size});
+        else if (entry.packed)
+            snapshot.m_groups.push_back({entry.packed, -1, 0});
+        else // only the groups near the cursor are unpacked
+            snapshot.m_groups.push_back({StringStorage::create(pack_undo_group(entry.group)), -1, 0});
+    }
+    if (m_spill_fd >= 0)
+        snapshot.m_spill_fd = dup(m_spill_fd);
+    return snapshot;
+}
+
+String Buffer::serialize_history() const
+{
+    String res;
+    history_snapshot().serialize(m_lines, [&](StringView data) {
+        res += data;
+        return 0;
+    });
+    return res;
+}
+
+Buffer::HistorySnapshot::HistorySnapshot(HistorySnapshot&& other)
+    : m_restored(std::move(other.m_restored)),
+      m_groups(std::move(other.m_groups)),
+      m_cursor(other.m_cursor),
+      m_spill_fd(other.m_spill_fd)
+{
+    other.m_spill_fd = -1;
+}
+
+Buffer::HistorySnapshot& Buffer::HistorySnapshot::operator=(HistorySnapshot&& other)
+{
+    if (m_spill_fd >= 0)
+        close(m_spill_fd);
+    m_restored = std::move(other.m_restored);
+    m_groups = std::move(other.m_groups);
+    m_cursor = other.m_cursor;
+    m_spill_fd = other.m_spill_fd;
+    other.m_spill_fd = -1;
+    return *this;
+}
+
+Buffer::HistorySnapshot::~HistorySnapshot()
+{
+    if (m_spill_fd >= 0)
+        close(m_spill_fd);
+}
+
+// The restored groups are written back as they were read, with their part
+// of the serialized data, so that only the groups of the session get
+// written from their own location.
+int Buffer::HistorySnapshot::serialize(const LineList& lines,
+                                       const std::function<int (StringView)>& write) const
+{
+    int error = 0;
+    auto write_data = [&](StringView data) {
+        if (error == 0 and not data.empty())
+            error = write(data);
+    };
+    auto write_value = [&](uint64_t value) {
+        write_data({reinterpret_cast<const char*>(&value), (int)sizeof(value)});
+    };
+
+    // restored groups are laid out in order, the ones dropped from the
+    // history come after them.
+    const size_t restored_groups_size = (int)m_restored.groups.length();
+    size_t restored_size = 0;
+    for (size_t i = 0; i < m_restored.count; ++i)
+    {
+        uint64_t location[2];
+        memcpy(location, m_restored.index + i * sizeof(location), sizeof(location));
+        if (location[0] <= restored_groups_size and
+            location[1] <= restored_groups_size - location[0])
+            restored_size = std::max<size_t>(restored_size, location[0] + location[1]);
+    }
+
+    write_data(history_magic);
+    write_value(Kakoune::content_hash(lines));
+    write_value(m_restored.count + m_groups.size());
+    write_value(m_cursor);
+    write_data({m_restored.index, (int)(m_restored.count * 2 * sizeof(uint64_t))});
+    size_t offset = restored_size;
+    for (auto& group : m_groups)
+    {
+        const size_t size = group.packed ? group.packed->length : group.spill_size;
+        write_value(offset);
+        write_value(size);
+        offset += size;
+    }
+
+    write_data({m_restored.groups.begin(), m_restored.groups.begin() + restored_size});
+    for (auto& group : m_groups)
+    {
+        if (group.packed)
+        {
+            write_data(group.packed->strview());
+            continue;
+        }
+        char buffer[16384];
+        for (size_t pos = 0; error == 0 and pos != group.spill_size;)
+        {
+            ssize_t count = pread(m_spill_fd, buffer, std::min(sizeof(buffer), group.spill_size - pos),
+                                  group.spill_offset + pos);
+            if (count <= 0)
+                return count < 0 ? errno : EIO;
+            write_data({buffer, (int)count});
+            pos += count;
+        }
+    }
+    return error;
+}
+
+bool Buffer::restore_history(ref_ptr<LineData> data, StringView serialized)
+{
+    kak_assert(history_size() == 0);
+
+    const char* pos = serialized.begin();
+    const char* end = serialized.end();
+    auto read_value = [&](uint64_t& value) {
+        if (end - pos < (ptrdiff_t)sizeof(value))
+            return false;
+        memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    };
+
+    if (serialized.substr(0, history_magic.length()) != history_magic)
+        return false;
+    pos += (int)history_magic.length();
+
+    uint64_t hash, count, cursor;
+    if (not read_value(hash) or not read_value(count) or not read_value(cursor) or
+        cursor > count or count > (size_t)(end - pos) / (2 * sizeof(uint64_t)) or
+        hash != content_hash())
+        return false;
+
+    // groups, and their location, are only read when they get applied so
+    // that restoring does not depend on the history size.
+    m_restored.data = std::move(data);
+    m_restored.index = pos;
+    m_restored.groups = { pos + count * 2 * sizeof(uint64_t), end };
+    m_restored.count = count;
+    m_history_cursor = cursor;
+    m_last_save_undo_index = cursor;
+    return true;
+}
+
+size_t Buffer::history_size() const
+{
+    return m_restored.count + m_history.size();
+}
+
+StringView Buffer::restored_group(size_t index) const
+{
+    kak_assert(index < m_restored.count);
+    uint64_t location[2];
+    memcpy(location, m_restored.index + index * sizeof(location), sizeof(location));
+    const size_t groups_size = (int)m_restored.groups.length();
+    if (location[1] == 0 or location[0] > groups_size or location[1] > groups_size - location[0])
+        throw runtime_error("invalid undo group location");
+    const char* group = m_restored.groups.begin() + location[0];
+    return { group, group + location[1] };
 }
 
 void Buffer::commit_undo_group()
@@ -197,13 +801,30 @@ void Buffer::commit_undo_group()
     if (m_current_undo_group.empty())
         return;
 
-    m_history.erase(m_history_cursor, m_history.end());
+    // the dropped redo branch can start in the restored groups
+    if (m_history_cursor < m_restored.count)
+        m_restored.count = m_history_cursor;
+    if (m_restored.count == 0)
+        m_restored = RestoredHistory{};
 
-    m_history.push_back(std::move(m_current_undo_group));
+    const size_t cursor = m_history_cursor - m_restored.count;
+    for (auto it = m_history.begin() + cursor; it != m_history.end(); ++it)
+    {
+        m_packed_size -= it->packed_size();
+        if (it->spill_offset >= 0)
+            m_spill_live_size -= it->spill_size;
+    }
+    m_history.erase(m_history.begin() + cursor, m_history.end());
+
+    m_history.emplace_back(std::move(m_current_undo_group));
     m_current_undo_group.clear();
-    m_history_cursor = m_history.end();
+    m_history_cursor = history_size();
+
+    m_unpacked_begin = std::min(m_unpacked_begin, cursor);
+    m_unpacked_end = m_history.size();
+    m_spill_scan = std::min(m_spill_scan, cursor);
 
-    if (m_history.size() < m_last_save_undo_index)
+    if (history_size() < m_last_save_undo_index)
         m_last_save_undo_index = -1;
 }
 
@@ -211,38 +832,127 @@ bool Buffer::undo()
 {
     commit_undo_group();
 
-    if (m_history_cursor == m_history.begin())
+    if (m_history_cursor == 0)
         return false;
 
+    const size_t index = m_history_cursor - 1;
+    if (index < m_restored.count)
+    {
+        apply_restored_group(index, true);
+        return true;
+    }
+
+    auto& group = unpacked_group(index - m_restored.count);
     --m_history_cursor;
 
-    for (const Modification& modification : reversed(*m_history_cursor))
+    for (const Modification& modification : reversed(group))
         apply_modification(modification.inverse());
     return true;
 }
 
 bool Buffer::redo()
 {
-    if (m_history_cursor == m_history.end())
+    if (m_history_cursor == history_size())
         return false;
 
     kak_assert(m_current_undo_group.empty());
 
-    for (const Modification& modification : *m_history_cursor)
+    const size_t index = m_history_cursor;
+    if (index < m_restored.count)
+    {
+        apply_restored_group(index, false);
+        return true;
+    }
+
+    for (const Modification& modification : unpacked_group(index - m_restored.count))
         apply_modification(modification);
 
     ++m_history_cursor;
     return true;
 }
 
+bool Buffer::modification_applies(const Modification& modification) const
+{
+    const ByteCoord coord = modification.coord;
+    if (not is_valid(coord) or
+        (coord != ByteCoord{0,0} and coord == ByteCoord(line_count()-1, m_lines.back().length())))
+        return false;
+
+    StringView content = modification.content;
+    if (modification.type == Modification::Insert)
+        return coord.line != line_count() or content.empty() or content.back() == '\n';
+
+    // erased content must be the buffer one
+    for (auto pos = coord; not content.empty(); pos = {pos.line+1, 0})
+    {
+        if (pos.line >= line_count())
+            return false;
+        StringView line = m_lines[pos.line].substr(pos.column);
+        StringView expected = content.substr(0, line.length());
+        if (line.substr(0, expected.length()) != expected)
+            return false;
+        content = content.substr(expected.length());
+    }
+    return true;
+}
+
+// Restored groups come from an undo file which could be corrupted, they are
+// checked against the buffer content and the history is discarded if they
+// do not match.
+void Buffer::apply_restored_group(size_t index, bool undo)
+{
+    UndoGroup modifications;
+    try
+    {
+        for (auto& modification : unpack_undo_group<UndoGroup>(restored_group(index)))
+            modifications.push_back(undo ? modification.inverse() : modification);
+    }
+    catch (runtime_error& error)
+    {
+        discard_history();
+        throw runtime_error("discarded restored undo history: "_str + error.what());
+    }
+    if (undo)
+        std::reverse(modifications.begin(), modifications.end());
+
+    size_t applied = 0;
+    while (applied != modifications.size() and
+           modification_applies(modifications[applied]))
+        apply_modification(modifications[applied++]);
+
+    if (applied != modifications.size())
+    {
+        while (applied != 0)
+            apply_modification(modifications[--applied].inverse());
+        discard_history();
+        throw runtime_error("discarded restored undo history: it does not match buffer content");
+    }
+
+    m_history_cursor = undo ? index : index + 1;
+}
+
+void Buffer::discard_history()
+{
+    const bool modified = is_modified();
+    m_history.clear();
+    m_restored = RestoredHistory{};
+    m_history_cursor = 0;
+    m_unpacked_begin = m_unpacked_end = 0;
+    m_packed_size = 0;
+    m_spill_scan = 0;
+    m_spill_live_size = 0;
+    m_last_save_undo_index = modified ? -1 : 0;
+}
+
 void Buffer::check_invariant() const
 {
 #ifdef KAK_DEBUG
     kak_assert(not m_lines.empty());
-    for (auto& line : m_lines)
+    m_lines.check_invariant();
+    for (auto line : m_lines)
     {
-        kak_assert(line->strview().length() > 0);
-        kak_assert(line->strview().back() == '\n');
+        kak_assert(line.length() > 0);
+        kak_assert(line.back() == '\n');
     }
 #endif
 }
@@ -261,17 +971,20 @@ ByteCoord Buffer::do_insert(ByteCoord pos, StringView content)
     // line without inserting a '\n'
     if (is_end(pos))
     {
+        BufferLines new_lines;
         ByteCount start = 0;
         for (ByteCount i = 0; i < content.length(); ++i)
         {
             if (content[i] == '\n')
             {
-                m_lines.push_back(StringStorage::create(content.substr(start, i + 1 - start)));
+                new_lines.push_back(StringStorage::create(content.substr(start, i + 1 - start)));
                 start = i + 1;
             }
         }
         if (start != content.length())
-            m_lines.push_back(StringStorage::create(content.substr(start)));
+            new_lines.push_back(StringStorage::create(content.substr(start)));
+
+        m_lines.replace(line_count(), line_count(), std::move(new_lines));
 
         begin = pos.column == 0 ? pos : ByteCoord{ pos.line + 1, 0 };
         end = ByteCoord{ line_count(), 0 };
@@ -282,7 +995,7 @@ ByteCoord Buffer::do_insert(ByteCoord pos, StringView content)
         StringView prefix = m_lines[pos.line].substr(0, pos.column);
         StringView suffix = m_lines[pos.line].substr(pos.column);
 
-        LineList new_lines;
+        BufferLines new_lines;
 
         ByteCount start = 0;
         for (ByteCount i = 0; i < content.length(); ++i)
@@ -304,11 +1017,7 @@ ByteCoord Buffer::do_insert(ByteCoord pos, StringView content)
 
         LineCount last_line = pos.line + new_lines.size() - 1;
 
-        auto line_it = m_lines.begin() + (int)pos.line;
-        *line_it = std::move(*new_lines.begin());
-
-        m_lines.insert(line_it+1, std::make_move_iterator(new_lines.begin() + 1),
-                       std::make_move_iterator(new_lines.end()));
+        m_lines.replace(pos.line, pos.line+1, std::move(new_lines));
 
         begin = pos;
         end = ByteCoord{ last_line, m_lines[last_line].length() - suffix.length() };
@@ -329,13 +1038,12 @@ ByteCoord Buffer::do_erase(ByteCoord begin, ByteCoord end)
     ByteCoord next;
     if (new_line.length() != 0)
     {
-        m_lines.erase(m_lines.begin() + (int)begin.line, m_lines.begin() + (int)end.line);
-        m_lines.get_storage(begin.line) = StringStorage::create(new_line);
+        m_lines.replace(begin.line, end.line+1, { StringStorage::create(new_line) });
         next = begin;
     }
     else
     {
-        m_lines.erase(m_lines.begin() + (int)begin.line, m_lines.begin() + (int)end.line + 1);
+        m_lines.replace(begin.line, end.line+1, {});
         next = is_end(begin) ? end_coord() : ByteCoord{begin.line, 0};
     }
 
@@ -348,6 +1056,14 @@ void Buffer::apply_modification(const Modification& modification)
     StringView content = modification.content;
     ByteCoord coord = modification.coord;
 
+    if (m_journal.enabled())
+    {
+        if (modification.type == Modification::Insert)
+            m_journal.insert(coord, content);
+        else
+            m_journal.erase(coord, content.length());
+    }
+
     kak_assert(is_valid(coord));
     // in modifications, end coords should be {line_count(), 0}
     kak_assert((m_lines.empty() and coord == ByteCoord{0,0} ) or
@@ -390,6 +1106,8 @@ BufferIterator Buffer::insert(const BufferIterator& pos, StringView content)
     auto coord = pos == end() ? ByteCoord{line_count()} : pos.coord();
     if (not (m_flags & Flags::NoUndo))
         m_current_undo_group.emplace_back(Modification::Insert, coord, real_content);
+    if (m_journal.enabled())
+        m_journal.insert(coord, real_content);
     return {*this, do_insert(pos.coord(), real_content)};
 }
 
@@ -405,13 +1123,194 @@ BufferIterator Buffer::erase(BufferIterator begin, BufferIterator end)
     if (not (m_flags & Flags::NoUndo))
         m_current_undo_group.emplace_back(Modification::Erase, begin.coord(),
                                           intern(string(begin.coord(), end.coord())));
+    if (m_journal.enabled())
+        m_journal.erase(begin.coord(), (int)(end - begin));
     return {*this, do_erase(begin.coord(), end.coord())};
 }
 
+BufferIterator Buffer::append(ref_ptr<LineData> data, StringView content)
+{
+    // packing fewer lines would leave undersized blocks in the line list
+    constexpr int min_packed_lines = 256;
+
+    const char* first_eol = (const char*)memchr(content.data(), '\n', (int)content.length());
+    const char* last_eol = first_eol ? (const char*)memrchr(content.data(), '\n', (int)content.length())
+                                     : nullptr;
+    if (not (m_flags & Flags::NoUndo) or m_journal.enabled() or
+        first_eol == last_eol or std::count(first_eol + 1, last_eol, '\n') < min_packed_lines)
+        return insert(iterator_at(back_coord()), content);
+
+    const LineCount last_line = line_count() - 1;
+    const StringView prefix = m_lines[last_line].substr(0, m_lines[last_line].length() - 1);
+    const StringView suffix{last_eol + 1, content.end()};
+    const ByteCoord begin{last_line, prefix.length()};
+
+    m_lines.set(last_line, StringStorage::create(prefix + StringView{content.begin(), first_eol + 1}));
+    BufferLines tail;
+    tail.emplace_back(StringStorage::create(suffix, '\n'));
+    m_lines.append_packed(std::move(data), {first_eol + 1, last_eol + 1}, std::move(tail));
+
+    m_changes.push_back({ Change::Insert, false, begin, { line_count() - 1, suffix.length() } });
+    return {*this, begin};
+}
+
+Vector<std::pair<ByteCoord, ByteCoord>> Buffer::apply_batch(ArrayView<Edit> edits)
+{
+    Vector<std::pair<ByteCoord, ByteCoord>> res;
+    res.reserve(edits.size());
+
+    // an edit of original coordinates after old_pos is at the same place
+    // relative to cur_pos once the preceding edits are applied.
+    ByteCoord old_pos, cur_pos;
+    auto new_coord = [&](ByteCoord coord) {
+        if (coord.line == old_pos.line)
+            coord.column += cur_pos.column - old_pos.column;
+        coord.line += cur_pos.line - old_pos.line;
+        return coord;
+    };
+
+    // original lines are accessed with the line delta of the already
+    // replaced clusters of edits.
+    LineCount line_delta = 0;
+    const bool undo = not (m_flags & Flags::NoUndo);
+
+    // Edits are processed in clusters of edits on close lines, the lines of
+    // a cluster being rebuilt and replaced at once. Edits touching the end
+    // of the buffer are applied through erase and insert, which handle its
+    // special cases.
+    const ByteCoord end_coord = this->end_coord();
+#ifdef KAK_DEBUG
+    // lines move once a cluster is replaced, check against the original ones
+    for (auto& edit : edits)
+        kak_assert(is_valid(edit.begin) and is_valid(edit.end));
+#endif
+    size_t index = 0;
+    while (index < edits.size() and edits[index].end < end_coord)
+    {
+        constexpr int max_gap = 32;
+        const LineCount first_line = edits[index].begin.line;
+        size_t cluster_end = index + 1;
+        while (cluster_end < edits.size() and edits[cluster_end].end < end_coord and
+               edits[cluster_end].begin.line <= edits[cluster_end-1].end.line + max_gap)
+            ++cluster_end;
+        const LineCount last_line = edits[cluster_end-1].end.line;
+
+        BufferLines new_lines;
+        String line;
+        auto add_content = [&](StringView content) {
+            while (not content.empty())
+            {
+                auto eol = std::find(content.begin(), content.end(), '\n');
+                if (eol == content.end())
+                {
+                    line += content;
+                    return;
+                }
+                line += StringView{content.begin(), eol+1};
+                new_lines.push_back(StringStorage::create(line));
+                line = String{};
+                content = StringView{eol+1, content.end()};
+            }
+        };
+        auto add_original = [&](ByteCoord begin, ByteCoord end) {
+            for (auto l = begin.line; l <= end.line and l <= last_line; ++l)
+            {
+                StringView content = m_lines[l + line_delta];
+                const ByteCount from = l == begin.line ? begin.column : 0;
+                const ByteCount to = l == end.line ? end.column : content.length();
+                if (from == 0 and to == content.length() and line.empty())
+                    new_lines.push_back(m_lines.get_storage(l + line_delta));
+                else
+                    add_content(content.substr(from, to - from));
+            }
+        };
+        auto original_string = [&](ByteCoord begin, ByteCoord end) {
+            String res;
+            for (auto l = begin.line; l <= end.line; ++l)
+            {
+                StringView content = m_lines[l + line_delta];
+                const ByteCount from = l == begin.line ? begin.column : 0;
+                const ByteCount to = l == end.line ? end.column : content.length();
+                res += content.substr(from, to - from);
+            }
+            return res;
+        };
+
+        ByteCoord pos = first_line;
+        for (; index < cluster_end; ++index)
+        {
+            const Edit& edit = edits[index];
+            kak_assert(pos <= edit.begin and edit.begin <= edit.end);
+            add_original(pos, edit.begin);
+            add_content(edit.content);
+            pos = edit.end;
+
+            // record changes and modifications as erase then insert would
+            const ByteCoord begin = new_coord(edit.begin);
+            if (edit.begin != edit.end)
+            {
+                if (undo or m_journal.enabled())
+                {
+                    String erased = original_string(edit.begin, edit.end);
+                    if (m_journal.enabled())
+                        m_journal.erase(begin, erased.length());
+                    if (undo)
+                        m_current_undo_group.emplace_back(
+                            Modification::Erase, begin, intern(erased));
+                }
+                m_changes.push_back({ Change::Erase, false, begin, new_coord(edit.end) });
+            }
+
+            ByteCoord end = begin;
+            for (auto c : edit.content)
+            {
+                if (c == '\n')
+                    end = ByteCoord{ end.line + 1, 0 };
+                else
+                    ++end.column;
+            }
+            if (not edit.content.empty())
+            {
+                if (undo)
+                    m_current_undo_group.emplace_back(
+                        Modification::Insert, begin, intern(edit.content));
+                if (m_journal.enabled())
+                    m_journal.insert(begin, edit.content);
+                m_changes.push_back({ Change::Insert, false, begin, end });
+            }
+
+            res.emplace_back(begin, end);
+            old_pos = edit.end;
+            cur_pos = end;
+        }
+        add_original(pos, last_line + 1);
+        kak_assert(line.empty());
+
+        const LineCount count = (int)new_lines.size();
+        m_lines.replace(first_line + line_delta, last_line + line_delta + 1,
+                        std::move(new_lines));
+        line_delta += count - (last_line - first_line + 1);
+    }
+
+    for (; index < edits.size(); ++index)
+    {
+        const Edit& edit = edits[index];
+        auto pos = iterator_at(new_coord(edit.begin));
+        if (edit.begin != edit.end)
+            pos = erase(pos, iterator_at(new_coord(edit.end)));
+        const ByteCoord begin = insert(pos, edit.content).coord();
+        const ByteCoord end = edit.content.empty() ? begin : m_changes.back().end;
+        res.emplace_back(begin, end);
+        old_pos = edit.end;
+        cur_pos = end;
+    }
+
+    return res;
+}
+
 bool Buffer::is_modified() const
 {
-    size_t history_cursor_index = m_history_cursor - m_history.begin();
-    return m_last_save_undo_index != history_cursor_index
+    return m_last_save_undo_index != m_history_cursor
            or not m_current_undo_group.empty();
 }
 
@@ -419,41 +1318,111 @@ void Buffer::notify_saved()
 {
     if (not m_current_undo_group.empty())
         commit_undo_group();
+    notify_saved(save_point());
+}
 
+Buffer::SavePoint Buffer::save_point() const
+{
+    return { m_history_cursor, m_journal.position() };
+}
+
+void Buffer::notify_saved(SavePoint save_point)
+{
     m_flags &= ~Flags::New;
-    size_t history_cursor_index = m_history_cursor - m_history.begin();
-    if (m_last_save_undo_index != history_cursor_index)
-        m_last_save_undo_index = history_cursor_index;
+    m_last_save_undo_index = save_point.history_index;
     m_fs_timestamp = get_fs_timestamp(m_name);
+    journal_saved(save_point.journal_position);
 }
 
-ByteCoord Buffer::advance(ByteCoord coord, ByteCount count) const
+void Buffer::journal_saved(size_t position)
 {
-    if (count > 0)
+    const bool stale_journal = m_journal.stale();
+    m_journal.saved(position);
+    if (stale_journal and not m_journal.stale())
     {
-        auto line = coord.line;
-        count += coord.column;
-        while (count >= m_lines[line].length())
-        {
-            count -= m_lines[line++].length();
-            if (line == line_count())
-                return end_coord();
-        }
-        return { line, count };
+        const String message = "unrecovered journal of " + m_name +
+                               " moved to " + m_journal.stale_path();
+        write_debug(message);
+        if (ClientManager::has_instance())
+            ClientManager::instance().print_status(*this, { message, get_face("Information") });
     }
-    else if (count < 0)
+}
+
+std::pair<size_t, size_t> Buffer::recover_journal()
+{
+    if (not m_journal.stale())
+        throw runtime_error("no journal to recover");
+    if (is_modified())
+        throw runtime_error("buffer is modified");
+
+    String data;
+    const auto records = m_journal.read_stale(data);
+
+    // records are checked so that invalid ones cannot break the buffer
+    // invariants, they come from an interrupted session.
+    size_t count = 0;
+    size_t offset = 0;
+    for (auto& record : records)
     {
-        auto line = coord.line;
-        count += coord.column;
-        while (count < 0)
+        const ByteCoord coord = record.coord;
+        if (not is_valid(coord) or record.length <= 0 or
+            coord == ByteCoord{line_count() - 1, m_lines.back().length()})
+            break;
+
+        Modification modification{Modification::Insert, coord, {}};
+        if (record.type == Journal::Record::Insert)
+        {
+            if (coord.line == line_count() and record.content.back() != '\n')
+                break;
+            modification.content = intern(record.content);
+        }
+        else
         {
-            count += m_lines[--line].length();
-            if (line < 0)
-                return {0, 0};
+            // erasing the last end of line is only valid with its whole line
+            const size_t end_offset = offset_of(coord) + (int)record.length;
+            if (end_offset > m_lines.byte_count() or
+                (end_offset == m_lines.byte_count() and
+                 (coord.column != 0 or coord == ByteCoord{})))
+                break;
+            modification.type = Modification::Erase;
+            modification.content = intern(string(coord, coord_at(end_offset)));
         }
-        return { line, count };
+        apply_modification(modification);
+        if (not (m_flags & Flags::NoUndo))
+            m_current_undo_group.push_back(std::move(modification));
+        ++count;
+        offset = record.end;
     }
-    return coord;
+    commit_undo_group();
+    m_journal.resume(offset);
+    return { count, records.size() };
+}
+
+ByteCoord Buffer::advance(ByteCoord coord, ByteCount count) const
+{
+    if (count == 0)
+        return coord;
+
+    // fast path when staying on the same line
+    const ByteCount column = coord.column + count;
+    if (column >= 0 and coord.line < line_count() and
+        column < m_lines[coord.line].length())
+        return { coord.line, column };
+
+    const ptrdiff_t offset = (ptrdiff_t)offset_of(coord) + (int)count;
+    if (offset < 0)
+        return {0, 0};
+    return coord_at(offset);
+}
+
+ByteCoord Buffer::coord_at(size_t offset) const
+{
+    if (offset >= m_lines.byte_count())
+        return end_coord();
+
+    size_t line_offset = 0;
+    const LineCount line = m_lines.line_at(offset, line_offset);
+    return { line, (int)(offset - line_offset) };
 }
 
 ByteCoord Buffer::char_next(ByteCoord coord) const
@@ -511,6 +1480,23 @@ void Buffer::set_fs_timestamp(time_t ts)
 
 void Buffer::on_option_changed(const Option& option)
 {
+    if (option.name() == "journal" and (m_flags & Flags::File))
+    {
+        if (not option.get<bool>())
+            m_journal.disable();
+        else if (not m_journal.enabled())
+        {
+            m_journal.enable(m_name);
+            if (m_journal.stale())
+            {
+                write_debug("found an edit journal for " + m_name +
+                            ", use the recover command to replay it");
+                if (ClientManager::has_instance())
+                    ClientManager::instance().notify_stale_journal(*this);
+            }
+        }
+    }
+
     run_hook_in_own_context("BufSetOption",
                             option.name() + "=" + option.get_as_string());
 }
@@ -524,8 +1510,15 @@ void Buffer::run_hook_in_own_context(const String& hook_name, StringView param)
 ByteCoord Buffer::last_modification_coord() const
 {
     if (m_history.empty())
-        return {};
-    return m_history.back().back().coord;
+    {
+        if (m_restored.count == 0)
+            return {};
+        return unpack_undo_group<UndoGroup>(restored_group(m_restored.count-1)).back().coord;
+    }
+    auto& entry = m_history.back();
+    if (not entry.group.empty())
+        return entry.group.back().coord;
+    return unpack_undo_group<UndoGroup>(packed_data(entry)).back().coord;
 }
 
 String Buffer::debug_description() const
@@ -543,17 +1536,26 @@ String Buffer::debug_description() const
         res += "NoUndo ";
     res += "\n";
 
-    size_t content_size = 0;
-    for (auto& line : m_lines)
-        content_size += (int)line->strview().length();
+    const size_t content_size = m_lines.byte_count();
+    const size_t lazy_size = m_lines.lazy_byte_count();
 
     size_t additional_size = 0;
-    for (auto& undo_group : m_history)
-        additional_size += undo_group.size() * sizeof(Modification);
+    size_t spilled_size = 0;
+    for (auto& entry : m_history)
+    {
+        additional_size += entry.group.size() * sizeof(Modification);
+        if (entry.group.empty() and entry.spill_offset >= 0)
+            spilled_size += entry.spill_size;
+    }
+    additional_size += m_packed_size;
     additional_size += m_changes.size() * sizeof(Change);
 
     res += "  Used mem: content=" + to_string(content_size) +
            " additional=" + to_string(additional_size) + "\n";
+    if (lazy_size != 0)
+        res += "  Lazily loaded: " + to_string(lazy_size) + "\n";
+    if (spilled_size != 0)
+        res += "  Spilled undo history: " + to_string(spilled_size) + "\n";
     return res;
 }
 
@@ -3,16 +3,21 @@
 
 #include "coord.hh"
 #include "flags.hh"
+#include "journal.hh"
+#include "line_list.hh"
 #include "safe_ptr.hh"
 #include "scope.hh"
 #include "shared_string.hh"
 #include "value.hh"
 #include "vector.hh"
 
+#include <functional>
+
 namespace Kakoune
 {
 
 class Buffer;
+class ChangeTimestamp;
 
 constexpr time_t InvalidTime = 0;
 
@@ -59,8 +64,6 @@ private:
     ByteCoord m_coord;
 };
 
-using BufferLines = Vector<ref_ptr<StringStorage>, MemoryDomain::BufferContent>;
-
 // A Buffer is a in-memory representation of a file
 //
 // The Buffer class permits to read and mutate this file
@@ -78,7 +81,7 @@ public:
         NoUndo = 8,
     };
 
-    Buffer(String name, Flags flags, BufferLines lines = {},
+    Buffer(String name, Flags flags, LineList lines = {},
            time_t fs_timestamp = InvalidTime);
     Buffer(const Buffer&) = delete;
     Buffer& operator= (const Buffer&) = delete;
@@ -92,6 +95,23 @@ public:
     BufferIterator insert(const BufferIterator& pos, StringView content);
     BufferIterator erase(BufferIterator begin, BufferIterator end);
 
+    struct Edit
+    {
+        ByteCoord begin;
+        ByteCoord end;
+        StringView content;
+    };
+    // replace the [begin, end) range of each edit with its content, as if
+    // erase then insert were called for each edit in order, but with
+    // coordinates relative to the buffer before any edit. Edits must be
+    // sorted and not overlap. Returns the range of each inserted content.
+    Vector<std::pair<ByteCoord, ByteCoord>> apply_batch(ArrayView<Edit> edits);
+
+    // insert content before the final end of line, like insert(end()-1, content).
+    // When undo and journaling are disabled, content complete lines are kept
+    // as packed lines pointing into data, which must contain content.
+    BufferIterator append(ref_ptr<LineData> data, StringView content);
+
     size_t         timestamp() const;
     time_t         fs_timestamp() const;
     void           set_fs_timestamp(time_t ts);
@@ -108,6 +128,10 @@ public:
     ByteCoord      next(ByteCoord coord) const;
     ByteCoord      prev(ByteCoord coord) const;
 
+    // number of bytes preceding coord in the buffer, and its reverse
+    size_t         offset_of(ByteCoord coord) const;
+    ByteCoord      coord_at(size_t offset) const;
+
     ByteCoord      char_next(ByteCoord coord) const;
     ByteCoord      char_prev(ByteCoord coord) const;
 
@@ -145,14 +169,49 @@ public:
     // the last time it was saved
     bool is_modified() const;
 
+    // state of the buffer, as positions in the undo history and in the
+    // journal, the current undo group being expected to be committed
+    struct SavePoint
+    {
+        size_t history_index;
+        size_t journal_position;
+    };
+    SavePoint save_point() const;
+
     // notify the buffer that it was saved in the current state
     void notify_saved();
+    // notify the buffer that it was saved in the state it had when
+    // save_point() returned the given save point
+    void notify_saved(SavePoint save_point);
 
     ValueMap& values() const { return m_values; }
 
     void run_hook_in_own_context(const String& hook_name, StringView param);
 
-    void reload(BufferLines lines, time_t fs_timestamp = InvalidTime);
+    void reload(LineList lines, time_t fs_timestamp = InvalidTime);
+
+    // copy lazily loaded lines to their own storage, so that the
+    // file they were loaded from can be modified.
+    void load_lazy_lines() { m_lines.load_all(); }
+    void load_truncated_lines() { m_lines.load_truncated(); }
+
+    const LineList& lines() const { return m_lines; }
+
+    // replace the lines with ones holding the same content, which is how
+    // the lines of an idle buffer are moved out of memory.
+    void set_evicted_lines(LineList lines);
+    // true if the lines were not modified since set_evicted_lines
+    bool lines_evicted() const { return m_evicted_timestamp == timestamp(); }
+
+    // true when unsaved edits are recorded in the buffer journal
+    bool is_journaled() const { return m_journal.recording(); }
+    // a journal left by a previous session waits to be recovered
+    bool has_stale_journal() const { return m_journal.stale(); }
+    void flush_journal() { m_journal.flush(); }
+    // replay the edits of the journal left by a previous session as a
+    // single undo group. Returns the number of replayed edits and of
+    // journaled ones, replaying stops at the first invalid edit.
+    std::pair<size_t, size_t> recover_journal();
 
     void check_invariant() const;
 
@@ -165,34 +224,43 @@ public:
         ByteCoord end;
     };
     ArrayView<Change> changes_since(size_t timestamp) const;
+    // false when the changes since timestamp were dropped from the change
+    // log, state depending on them then needs to be fully recomputed.
+    bool changes_available_since(size_t timestamp) const;
+    // drop the changes that every registered ChangeTimestamp is past
+    void compact_changes();
+    // pack undo groups away from the history cursor, and write packed
+    // groups to a temporary file when they take more than spill_size
+    // bytes, 0 meaning they are always kept in memory. Returns true if
+    // groups were packed or written to the temporary file.
+    bool compact_history(size_t spill_size);
+    size_t spill_file_size() const { return m_spill_file_size; }
+    // pack lines that were not modified since the previous call
+    void compact_lines() { m_lines.pack(); }
+
+    class HistorySnapshot;
+    // snapshot of the committed undo history, to be serialized along
+    // with a hash of the buffer content it applies to.
+    HistorySnapshot history_snapshot() const;
+    String serialize_history() const;
+    // restore an undo history from serialized data, that is referenced
+    // until the history gets unpacked, data keeps it alive. Returns false
+    // if the history does not apply to the current buffer content.
+    bool restore_history(ref_ptr<LineData> data, StringView serialized);
 
     String debug_description() const;
 private:
 
     void on_option_changed(const Option& option) override;
 
-    struct LineList : BufferLines
-    {
-        [[gnu::always_inline]]
-        ref_ptr<StringStorage>& get_storage(LineCount line)
-        { return BufferLines::operator[]((int)line); }
-
-        [[gnu::always_inline]]
-        const ref_ptr<StringStorage>& get_storage(LineCount line) const
-        { return BufferLines::operator[]((int)line); }
-
-        [[gnu::always_inline]]
-        StringView operator[](LineCount line) const
-        { return get_storage(line)->strview(); }
-
-        StringView front() const { return BufferLines::front()->strview(); }
-        StringView back() const { return BufferLines::back()->strview(); }
-    };
     LineList m_lines;
 
     ByteCoord do_insert(ByteCoord pos, StringView content);
     ByteCoord do_erase(ByteCoord begin, ByteCoord end);
 
+    void replace_all_lines(LineList lines);
+    void apply_line_diff(const LineList& lines);
+
     String  m_name;
     Flags   m_flags;
 
@@ -200,17 +268,67 @@ private:
     using  UndoGroup = Vector<Modification, MemoryDomain::BufferMeta>;
     friend class UndoGroupOptimizer;
 
-    using History = Vector<UndoGroup, MemoryDomain::BufferMeta>;
+    struct HistoryEntry;
+    using History = Vector<HistoryEntry, MemoryDomain::BufferMeta>;
     History           m_history;
-    History::iterator m_history_cursor;
+    // index of the next group to redo, counting the restored groups
+    size_t            m_history_cursor = 0;
     UndoGroup         m_current_undo_group;
 
+    // groups of a serialized history, that precede the ones of m_history
+    // and are only read from it when they get applied.
+    struct RestoredHistory
+    {
+        // keeps the serialized data alive
+        ref_ptr<LineData> data;
+        // offset and size of each group in groups
+        const char* index = nullptr;
+        StringView groups;
+        size_t count = 0;
+    };
+    RestoredHistory m_restored;
+    StringView restored_group(size_t index) const;
+
+    size_t history_size() const;
+
+    // history entries out of [m_unpacked_begin, m_unpacked_end) are packed
+    size_t m_unpacked_begin = 0;
+    size_t m_unpacked_end = 0;
+    // bytes of packed entries held in memory
+    size_t m_packed_size = 0;
+    // entries before that one were all written to the spill file
+    size_t m_spill_scan = 0;
+    int    m_spill_fd = -1;
+    size_t m_spill_file_size = 0;
+    // bytes of the spill file used by entries still in the history
+    size_t m_spill_live_size = 0;
+
+    uint64_t content_hash() const;
+
+    const UndoGroup& unpacked_group(size_t index);
+    void pack_entry(HistoryEntry& entry);
+    String packed_data(const HistoryEntry& entry) const;
+    void compact_spill_file();
+
     void apply_modification(const Modification& modification);
     void revert_modification(const Modification& modification);
 
+    bool modification_applies(const Modification& modification) const;
+    void apply_restored_group(size_t index, bool undo);
+    void discard_history();
+
     size_t m_last_save_undo_index;
 
+    Journal m_journal;
+    void journal_saved(size_t position);
+
+    size_t m_evicted_timestamp = (size_t)-1;
+
     Vector<Change, MemoryDomain::BufferMeta> m_changes;
+    // timestamp of the first change in m_changes
+    size_t m_changes_offset = 0;
+    friend class ChangeTimestamp;
+    mutable Vector<ChangeTimestamp*, MemoryDomain::BufferMeta> m_change_readers;
 
     time_t m_fs_timestamp;
 
@@ -221,6 +339,67 @@ private:
 
 template<> struct WithBitOps<Buffer::Flags> : std::true_type {};
 
+// Timestamp up to which a user of changes_since has read the change log
+// of a buffer, the changes it still needs are kept by compact_changes.
+class ChangeTimestamp
+{
+public:
+    ChangeTimestamp() = default;
+    ChangeTimestamp(const Buffer& buffer, size_t timestamp);
+    ChangeTimestamp(const ChangeTimestamp& other);
+    ChangeTimestamp& operator=(const ChangeTimestamp& other);
+    ~ChangeTimestamp() { unregister(); }
+
+    void reset(const Buffer& buffer, size_t timestamp);
+    ChangeTimestamp& operator=(size_t timestamp) { m_timestamp = timestamp; return *this; }
+    operator size_t() const { return m_timestamp; }
+
+private:
+    friend class Buffer;
+    void unregister();
+
+    const Buffer* m_buffer = nullptr;
+    // position in the buffer m_change_readers
+    size_t m_index = 0;
+    size_t m_timestamp = 0;
+};
+
+// Committed undo history of a buffer that can be serialized from another
+// thread. It refers to the packed groups instead of copying them and
+// keeps the data they live in alive, it must be created and destroyed on
+// the main thread.
+class Buffer::HistorySnapshot
+{
+public:
+    HistorySnapshot() = default;
+    HistorySnapshot(HistorySnapshot&& other);
+    HistorySnapshot& operator=(HistorySnapshot&& other);
+    ~HistorySnapshot();
+
+    // pass the serialized history for a buffer content to write, without
+    // using tracked memory. Returns 0, or the first non zero value
+    // returned by write, or an errno value if reading the history failed.
+    int serialize(const LineList& lines,
+                  const std::function<int (StringView)>& write) const;
+
+private:
+    friend class Buffer;
+
+    // packed data of a group, held in memory or in the spill file
+    struct Group
+    {
+        ref_ptr<StringStorage> packed;
+        ssize_t spill_offset;
+        size_t spill_size;
+    };
+
+    RestoredHistory m_restored;
+    Vector<Group, MemoryDomain::BufferMeta> m_groups;
+    size_t m_cursor = 0;
+    // duplicate of the buffer spill file descriptor, which can get replaced
+    int m_spill_fd = -1;
+};
+
 }
 
 #include "buffer.inl.hh"
@@ -41,19 +41,14 @@ inline ByteCoord Buffer::prev(ByteCoord coord) const
 
 inline ByteCount Buffer::distance(ByteCoord begin, ByteCoord end) const
 {
-    if (begin > end)
-        return -distance(end, begin);
-    ByteCount res = 0;
-    for (LineCount l = begin.line; l <= end.line; ++l)
-    {
-        ByteCount len = m_lines[l].length();
-        res += len;
-        if (l == begin.line)
-            res -= begin.column;
-        if (l == end.line)
-            res -= len - end.column;
-    }
-    return res;
+    if (begin.line == end.line)
+        return end.column - begin.column;
+    return (int)((ptrdiff_t)offset_of(end) - (ptrdiff_t)offset_of(begin));
+}
+
+inline size_t Buffer::offset_of(ByteCoord coord) const
+{
+    return m_lines.offset_of(coord.line) + (int)coord.column;
 }
 
 inline bool Buffer::is_valid(ByteCoord c) const
@@ -89,15 +84,68 @@ inline LineCount Buffer::line_count() const
 
 inline size_t Buffer::timestamp() const
 {
-    return m_changes.size();
+    return m_changes_offset + m_changes.size();
 }
 
 inline ArrayView<Buffer::Change> Buffer::changes_since(size_t timestamp) const
 {
-    return { m_changes.data() + timestamp,
+    kak_assert(changes_available_since(timestamp) and timestamp <= this->timestamp());
+    return { m_changes.data() + (timestamp - m_changes_offset),
              m_changes.data() + m_changes.size() };
 }
 
+inline bool Buffer::changes_available_since(size_t timestamp) const
+{
+    return timestamp >= m_changes_offset;
+}
+
+inline ChangeTimestamp::ChangeTimestamp(const Buffer& buffer, size_t timestamp)
+{
+    reset(buffer, timestamp);
+}
+
+inline ChangeTimestamp::ChangeTimestamp(const ChangeTimestamp& other)
+    : m_timestamp{other.m_timestamp}
+{
+    if (other.m_buffer)
+        reset(*other.m_buffer, other.m_timestamp);
+}
+
+inline ChangeTimestamp& ChangeTimestamp::operator=(const ChangeTimestamp& other)
+{
+    if (other.m_buffer)
+        reset(*other.m_buffer, other.m_timestamp);
+    else
+    {
+        unregister();
+        m_timestamp = other.m_timestamp;
+    }
+    return *this;
+}
+
+inline void ChangeTimestamp::reset(const Buffer& buffer, size_t timestamp)
+{
+    m_timestamp = timestamp;
+    if (m_buffer == &buffer)
+        return;
+    unregister();
+    m_buffer = &buffer;
+    m_index = buffer.m_change_readers.size();
+    buffer.m_change_readers.push_back(this);
+}
+
+inline void ChangeTimestamp::unregister()
+{
+    if (not m_buffer)
+        return;
+    auto& readers = m_buffer->m_change_readers;
+    kak_assert(readers[m_index] == this);
+    readers[m_index] = readers.back();
+    readers[m_index]->m_index = m_index;
+    readers.pop_back();
+    m_buffer = nullptr;
+}
+
 inline ByteCoord Buffer::back_coord() const
 {
     return { line_count() - 1, m_lines.back().length() - 1 };
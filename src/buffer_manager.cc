@@ -6,8 +6,14 @@
 #include "containers.hh"
 #include "exception.hh"
 #include "file.hh"
+#include "memory.hh"
+#include "scope.hh"
 #include "string.hh"
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
 namespace Kakoune
 {
 
@@ -108,11 +114,70 @@ void BufferManager::backup_modified_buffers()
 {
     for (auto& buf : m_buffers)
     {
-        if ((buf->flags() & Buffer::Flags::File) and buf->is_modified())
+        if (not (buf->flags() & Buffer::Flags::File) or not buf->is_modified())
+            continue;
+        // journaled edits only need to reach the journal
+        if (buf->is_journaled())
+            buf->flush_journal();
+        else
             write_buffer_to_backup_file(*buf);
     }
 }
 
+// memory used by buffer lines, undo histories and cached values
+static size_t buffers_memory()
+{
+    size_t res = 0;
+    for (auto domain : { MemoryDomain::BufferContent, MemoryDomain::SharedString,
+                         MemoryDomain::History, MemoryDomain::Values,
+                         MemoryDomain::Highlight, MemoryDomain::WordDB })
+        res += domain_allocated_bytes[(int)domain];
+    return res;
+}
+
+// Called from the main loop. Change logs only drop the changes that all
+// the registered readers, like selections or word databases, are past.
+void BufferManager::compact_buffers()
+{
+    for (auto& buf : m_buffers)
+    {
+        buf->compact_changes();
+        buf->compact_lines();
+        buf->compact_history(buf->options()["undo_spill_size"].get<int>());
+    }
+
+    const size_t budget = GlobalScope::instance().options()["buffer_memory_budget"].get<int>();
+    if (budget == 0 or buffers_memory() <= budget)
+        return;
+
+    // evict the least recently used buffers first, buffers are moved
+    // to the front of the list when used.
+    bool evicted = false;
+    for (auto it = m_buffers.rbegin(); it != m_buffers.rend() and buffers_memory() > budget; ++it)
+    {
+        Buffer& buffer = **it;
+        if ((buffer.flags() & Buffer::Flags::Fifo) or
+            (buffer.lines_evicted() and buffer.values().empty()) or
+            (ClientManager::has_instance() and ClientManager::instance().displays_buffer(buffer)))
+            continue;
+        // cached values alone are not worth trimming the heap for
+        if (evict_buffer(buffer))
+            evicted = true;
+    }
+
+#if defined(__GLIBC__)
+    // give the freed memory back to the system
+    if (evicted)
+        malloc_trim(0);
+#endif
+}
+
+void BufferManager::flush_journals()
+{
+    for (auto& buf : m_buffers)
+        buf->flush_journal();
+}
+
 void BufferManager::clear_buffer_trash()
 {
     while (not m_buffer_trash.empty())
@@ -33,8 +33,10 @@ public:
     void    set_last_used_buffer(Buffer& buffer);
 
     void backup_modified_buffers();
+    void flush_journals();
 
     void clear_buffer_trash();
+    void compact_buffers();
 private:
     BufferList m_buffers;
     BufferList m_buffer_trash;
@@ -3,9 +3,20 @@
 #include "buffer_manager.hh"
 #include "event_manager.hh"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <vector>
 #include <unistd.h>
 #include <sys/select.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace Kakoune
 {
 
@@ -26,29 +37,135 @@ CharCount get_column(const Buffer& buffer,
     return col;
 }
 
-Buffer* create_buffer_from_data(StringView data, StringView name,
-                                Buffer::Flags flags, time_t fs_timestamp)
+ChunkedBufferRange::ChunkedBufferRange(const Buffer& buffer,
+                                       ByteCoord begin, ByteCoord end)
+    : m_buffer{buffer}, m_offset{buffer.offset_of(begin)}
 {
-    bool bom = false, crlf = false;
+    size_t skip = (int)begin.column;
+    size_t remaining = buffer.offset_of(end) - m_offset;
+    size_t offset = 0;
+    auto add_chunk = [&](StringView chunk) {
+        const char* first = chunk.begin() + std::min(skip, (size_t)(int)chunk.length());
+        skip -= first - chunk.begin();
+        const char* last = first + std::min(remaining, (size_t)(chunk.end() - first));
+        remaining -= last - first;
+        if (first == last)
+            return;
 
-    const char* pos = data.begin();
-    if (data.length() >= 3 and
-       data[0] == '\xEF' and data[1] == '\xBB' and data[2] == '\xBF')
+        // chunks are kept separate even when contiguous, so that
+        // searches can be split at block boundaries
+        m_chunks.push_back({first, last, offset});
+        offset += last - first;
+    };
+    buffer.lines().for_each_chunk(begin.line, std::min(end.line + 1, buffer.line_count()),
+                                  add_chunk);
+    const char* content_end = m_chunks.empty() ? nullptr : m_chunks.back().end;
+    m_chunks.push_back({content_end, content_end, offset});
+}
+
+ChunkedBufferRange::iterator& ChunkedBufferRange::iterator::operator+=(difference_type n)
+{
+    if (n >= 0 ? n < m_chunk->end - m_pos : -n <= m_pos - m_chunk->begin)
     {
-        bom = true;
-        pos = data.begin() + 3;
+        m_pos += n;
+        return *this;
+    }
+    const size_t target = offset() + n;
+    while (target < m_chunk->offset)
+        --m_chunk;
+    // the sentinel chunk is the only empty one
+    while (m_chunk->begin != m_chunk->end and
+           target - m_chunk->offset >= (size_t)(m_chunk->end - m_chunk->begin))
+        ++m_chunk;
+    m_pos = m_chunk->begin + (target - m_chunk->offset);
+    return *this;
+}
+
+ChunkedBufferRange::iterator find_literal(ChunkedBufferRange::iterator begin,
+                                          ChunkedBufferRange::iterator end,
+                                          StringView literal)
+{
+    using iterator = ChunkedBufferRange::iterator;
+    const ptrdiff_t overlap = (int)literal.length() - 1;
+    for (iterator it = begin; it != end; )
+    {
+        const bool last_chunk = it.m_chunk == end.m_chunk;
+        const char* chunk_end = last_chunk ? end.m_pos : it.m_chunk->end;
+        const char* pos = find_literal(it.m_pos, chunk_end, literal);
+        if (pos != chunk_end or last_chunk)
+            return {it.m_chunk, pos};
+
+        // occurrences starting in this chunk and ending in the following ones
+        const iterator next{it.m_chunk+1, (it.m_chunk+1)->begin};
+        if (overlap > 0)
+        {
+            const iterator first = next - it > overlap ? next - overlap : it;
+            const iterator last = end - next > overlap ? next + overlap : end;
+            const iterator res = std::search(first, last, literal.begin(), literal.end());
+            if (res != last)
+                return res;
+        }
+        it = next;
+    }
+    return end;
+}
+
+ByteCoord ChunkedBufferRange::coord(const iterator& pos) const
+{
+    const size_t offset = m_offset + pos.offset();
+    if (offset < m_line_begin or offset >= m_line_end)
+    {
+        const ByteCoord coord = m_buffer.coord_at(offset);
+        m_line = coord.line;
+        m_line_begin = offset - (int)coord.column;
+        m_line_end = m_line_begin + (int)m_buffer[m_line].length();
+        return coord;
     }
+    return { m_line, (int)(offset - m_line_begin) };
+}
 
-    BufferLines lines;
-    while (pos < data.end())
+const char* find_eol(const char* begin, const char* end)
+{
+#if defined(__AVX2__)
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    for (; end - begin >= 32; begin += 32)
     {
-        const char* line_end = pos;
-        while (line_end < data.end() and *line_end != '\r' and *line_end != '\n')
-             ++line_end;
+        const __m256i chunk = _mm256_loadu_si256((const __m256i*)begin);
+        const unsigned mask = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf)));
+        if (mask != 0)
+            return begin + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; end - begin >= 16; begin += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)begin);
+        const unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+        if (mask != 0)
+            return begin + __builtin_ctz(mask);
+    }
+#endif
+    while (begin != end and *begin != '\r' and *begin != '\n')
+        ++begin;
+    return begin;
+}
 
-        lines.emplace_back(StringStorage::create({pos, line_end}, '\n'));
+// copy the lines in [pos, end) to out, with '\n' line endings, including
+// for the last line, and return the end of the copied data.
+static char* copy_lines(const char* pos, const char* end, char* out, bool& crlf)
+{
+    while (pos < end)
+    {
+        const char* line_end = find_eol(pos, end);
+        memcpy(out, pos, line_end - pos);
+        out += line_end - pos;
+        *out++ = '\n';
 
-        if (line_end+1 != data.end() and *line_end == '\r' and *(line_end+1) == '\n')
+        if (line_end+1 < end and *line_end == '\r' and *(line_end+1) == '\n')
         {
             crlf = true;
             pos = line_end + 2;
@@ -56,6 +173,98 @@ Buffer* create_buffer_from_data(StringView data, StringView name,
         else
             pos = line_end + 1;
     }
+    return out;
+}
+
+static const char* next_line_start(const char* pos, const char* end)
+{
+    const char* eol = find_eol(pos, end);
+    if (eol == end)
+        return end;
+    if (*eol == '\r' and eol+1 < end and *(eol+1) == '\n')
+        return eol + 2;
+    return eol + 1;
+}
+
+// Parts are copied at the offset they have in the data, they can only
+// shrink, by dropping '\r's, the following ones are moved down when they did.
+ref_ptr<LineData> pack_lines(StringView lines, StringView& content, bool& crlf,
+                             size_t min_part_size, size_t max_threads)
+{
+    const char* pos = lines.begin();
+    const char* end = lines.end();
+    const size_t size = end - pos;
+    const size_t part_count = std::max<size_t>(
+        1, std::min<size_t>(max_threads, size / min_part_size));
+
+    PackedLines* packed = new PackedLines{size + 1};
+    ref_ptr<LineData> data = packed;
+
+    std::vector<const char*> starts{pos};
+    for (size_t i = 1; i < part_count; ++i)
+        starts.push_back(next_line_start(std::max(starts.back(), pos + size * i / part_count), end));
+    starts.push_back(end);
+
+    std::vector<char*> ends(part_count);
+    // not a vector<bool>, workers set their own element
+    std::vector<char> part_crlf(part_count, false);
+    auto copy_part = [&](size_t i) {
+        bool found_crlf = false;
+        ends[i] = copy_lines(starts[i], starts[i+1], packed->data + (starts[i] - pos), found_crlf);
+        part_crlf[i] = found_crlf;
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < part_count; ++i)
+        workers.emplace_back(copy_part, i);
+    copy_part(0);
+    for (auto& worker : workers)
+        worker.join();
+
+    char* out = ends[0];
+    crlf = crlf or part_crlf[0];
+    for (size_t i = 1; i < part_count; ++i)
+    {
+        char* part = packed->data + (starts[i] - pos);
+        if (out != part)
+            memmove(out, part, ends[i] - part);
+        out += ends[i] - part;
+        crlf = crlf or part_crlf[i];
+    }
+    content = StringView{packed->data, out};
+    return data;
+}
+
+Buffer* create_buffer_from_data(StringView data, StringView name,
+                                Buffer::Flags flags, time_t fs_timestamp,
+                                ref_ptr<LineData> lazy_data)
+{
+    bool bom = false, crlf = false;
+
+    const char* pos = data.begin();
+    if (data.length() >= 3 and
+       data[0] == '\xEF' and data[1] == '\xBB' and data[2] == '\xBF')
+    {
+        bom = true;
+        pos = data.begin() + 3;
+    }
+
+    LineList lines;
+    // lines can be views into data only if they all end with a plain '\n'
+    if (lazy_data and memchr(pos, '\r', data.end() - pos) == nullptr)
+    {
+        const char* lazy_end = data.end();
+        while (lazy_end != pos and *(lazy_end-1) != '\n')
+            --lazy_end;
+        lines.append_packed(std::move(lazy_data), {pos, lazy_end});
+        pos = lazy_end;
+    }
+
+    if (pos != data.end())
+    {
+        StringView content;
+        auto packed = pack_lines({pos, data.end()}, content, crlf);
+        lines.append_packed(std::move(packed), content);
+    }
 
     Buffer* buffer = BufferManager::instance().get_buffer_ifp(name);
     if (buffer)
@@ -70,6 +279,45 @@ Buffer* create_buffer_from_data(StringView data, StringView name,
     return buffer;
 }
 
+// fifo content is read in chunks that packed buffer lines can point into,
+// and appended once per event loop iteration. The number of bytes read per
+// iteration adapts so that handling them takes about fifo_iteration_target,
+// in order to keep processing input while the fifo is flooded.
+static constexpr size_t fifo_min_read = 4096;
+static constexpr size_t fifo_min_budget = 64 * 1024;
+static constexpr size_t fifo_max_budget = 8 * 1024 * 1024;
+static constexpr auto fifo_iteration_target = std::chrono::milliseconds{10};
+
+static void append_fifo_content(Buffer& buffer, ref_ptr<LineData> data,
+                                StringView content, bool scroll)
+{
+    if (content.empty())
+        return;
+
+    // inserting before the end of line of an empty buffer would move
+    // cursors at its start to the end, insert after it instead.
+    if (not scroll and buffer.begin() == buffer.end()-1)
+    {
+        buffer.insert(buffer.end(), content);
+        buffer.erase(buffer.begin(), buffer.begin()+1);
+        // otherwise, the buffer will have automatically inserted a \n
+        // to guarantee its invariant.
+        if (content.back() == '\n')
+            buffer.insert(buffer.end(), "\n");
+    }
+    else
+        buffer.append(std::move(data), content);
+}
+
+void trim_fifo_lines(Buffer& buffer, LineCount max_lines)
+{
+    // the change log lets selections and highlighter caches shift the
+    // retained lines.
+    if (max_lines > 0 and buffer.line_count() > max_lines)
+        buffer.erase(buffer.begin(),
+                     buffer.iterator_at({buffer.line_count() - max_lines, 0}));
+}
+
 Buffer* create_fifo_buffer(String name, int fd, bool scroll)
 {
     static ValueId s_fifo_watcher_id = ValueId::get_free_id();
@@ -94,48 +342,75 @@ Buffer* create_fifo_buffer(String name, int fd, bool scroll)
     // capture a non static one to silence a warning.
     ValueId fifo_watcher_id = s_fifo_watcher_id;
 
+    struct ReadState
+    {
+        ref_ptr<LineData> chunk;
+        size_t used = 0;
+        size_t budget = fifo_min_budget;
+    } state;
+
     std::unique_ptr<FDWatcher, decltype(watcher_deleter)> watcher(
-        new FDWatcher(fd, [buffer, scroll, fifo_watcher_id](FDWatcher& watcher, EventMode mode) {
+        new FDWatcher(fd, [buffer, scroll, fifo_watcher_id, state]
+                          (FDWatcher& watcher, EventMode mode) mutable {
         if (mode != EventMode::Normal)
             return;
 
-        constexpr size_t buffer_size = 2048;
-        // if we read data slower than it arrives in the fifo, limiting the
-        // iteration number allows us to go back go back to the event loop and
-        // handle other events sources (such as input)
-        size_t loops = 16;
-        char data[buffer_size];
+        const auto start_time = Clock::now();
         const int fifo = watcher.fd();
-        timeval tv{ 0, 0 };
-        fd_set  rfds;
-        ssize_t count = 0;
-        do
+        size_t begin = state.used;
+        size_t read_bytes = 0;
+        bool closed = false;
+        while (true)
         {
-            count = read(fifo, data, buffer_size);
-            auto pos = buffer->end()-1;
-
-            bool prevent_scrolling = pos == buffer->begin() and not scroll;
-            if (prevent_scrolling)
-                ++pos;
-
-            buffer->insert(pos, String(data, data+count));
+            auto* chunk = static_cast<PackedLines*>(state.chunk.get());
+            if (not chunk or chunk->capacity - state.used < fifo_min_read)
+            {
+                if (chunk)
+                    append_fifo_content(*buffer, state.chunk,
+                                        {chunk->data + begin, chunk->data + state.used}, scroll);
+                state.chunk = new PackedLines{state.budget};
+                state.used = begin = 0;
+                continue;
+            }
 
-            if (count > 0 and prevent_scrolling)
+            const size_t size = std::min(chunk->capacity - state.used,
+                                         state.budget - read_bytes);
+            const ssize_t count = read(fifo, chunk->data + state.used, size);
+            if (count <= 0)
             {
-                buffer->erase(buffer->begin(), buffer->begin()+1);
-                // in the other case, the buffer will have automatically
-                // inserted a \n to guarantee its invariant.
-                if (data[count-1] == '\n')
-                    buffer->insert(buffer->end(), "\n");
+                closed = count == 0 or (errno != EAGAIN and errno != EINTR);
+                break;
             }
+            state.used += count;
+            read_bytes += count;
+
+            // a short read means the fifo was drained, when the budget is
+            // exhausted go back to the event loop to handle other events
+            // sources (such as input).
+            if ((size_t)count < size or read_bytes == state.budget)
+                break;
 
+            timeval tv{ 0, 0 };
+            fd_set  rfds;
             FD_ZERO(&rfds);
             FD_SET(fifo, &rfds);
+            if (select(fifo+1, &rfds, nullptr, nullptr, &tv) != 1)
+                break;
         }
-        while (--loops and count > 0 and
-               select(fifo+1, &rfds, nullptr, nullptr, &tv) == 1);
 
-        if (count <= 0)
+        auto* chunk = static_cast<PackedLines*>(state.chunk.get());
+        append_fifo_content(*buffer, state.chunk,
+                            {chunk->data + begin, chunk->data + state.used}, scroll);
+
+        trim_fifo_lines(*buffer, buffer->options()["fifo_max_lines"].get<int>());
+
+        const auto elapsed = Clock::now() - start_time;
+        if (read_bytes == state.budget and elapsed < fifo_iteration_target / 2)
+            state.budget = std::min(state.budget * 2, fifo_max_budget);
+        else if (elapsed > fifo_iteration_target)
+            state.budget = std::max(state.budget / 2, fifo_min_budget);
+
+        if (closed)
             buffer->values().erase(fifo_watcher_id); // will delete this
     }), std::move(watcher_deleter));
 
@@ -4,6 +4,8 @@
 #include "buffer.hh"
 #include "selection.hh"
 
+#include <thread>
+
 namespace Kakoune
 {
 
@@ -27,11 +29,140 @@ inline CharCount char_length(const Buffer& buffer, const Selection& range)
 CharCount get_column(const Buffer& buffer,
                      CharCount tabstop, ByteCoord coord);
 
+// View of the content of a buffer range as the sequence of its contiguous
+// chunks, so that it can be searched through iterators that run on plain
+// pointers inside a chunk instead of BufferIterator. Packed blocks are a
+// single chunk, and nothing is copied. The view is invalidated by buffer
+// modifications.
+class ChunkedBufferRange
+{
+public:
+    struct Chunk
+    {
+        const char* begin;
+        const char* end;
+        // of begin, from the start of the range
+        size_t offset;
+    };
+
+    // Random access iterator over the range content, never at the end of a
+    // chunk except for the range end, which is in an empty sentinel chunk.
+    class iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = char;
+        using difference_type = ptrdiff_t;
+        using pointer = const char*;
+        using reference = const char&;
+
+        iterator() = default;
+        iterator(const Chunk* chunk, const char* pos) : m_chunk{chunk}, m_pos{pos} {}
+
+        const char& operator*() const { return *m_pos; }
+        const char& operator[](difference_type n) const { return *(*this + n); }
+
+        iterator& operator++()
+        {
+            if (++m_pos == m_chunk->end)
+            {
+                ++m_chunk;
+                m_pos = m_chunk->begin;
+            }
+            return *this;
+        }
+
+        iterator& operator--()
+        {
+            if (m_pos == m_chunk->begin)
+            {
+                --m_chunk;
+                m_pos = m_chunk->end;
+            }
+            --m_pos;
+            return *this;
+        }
+
+        iterator operator++(int) { iterator res = *this; ++*this; return res; }
+        iterator operator--(int) { iterator res = *this; --*this; return res; }
+
+        iterator& operator+=(difference_type n);
+        iterator& operator-=(difference_type n) { return *this += -n; }
+        iterator operator+(difference_type n) const { iterator res = *this; return res += n; }
+        iterator operator-(difference_type n) const { iterator res = *this; return res += -n; }
+        difference_type operator-(const iterator& other) const
+        { return (difference_type)(offset() - other.offset()); }
+
+        bool operator==(const iterator& other) const
+        { return m_pos == other.m_pos and m_chunk == other.m_chunk; }
+        bool operator!=(const iterator& other) const { return not (*this == other); }
+        bool operator<(const iterator& other) const
+        { return m_chunk < other.m_chunk or (m_chunk == other.m_chunk and m_pos < other.m_pos); }
+        bool operator>(const iterator& other) const { return other < *this; }
+        bool operator<=(const iterator& other) const { return not (other < *this); }
+        bool operator>=(const iterator& other) const { return not (*this < other); }
+
+        size_t offset() const { return m_chunk->offset + (m_pos - m_chunk->begin); }
+
+        // memmem inside chunks, the regex_find front-end finds it through ADL
+        friend iterator find_literal(iterator begin, iterator end, StringView literal);
+
+    private:
+        const Chunk* m_chunk = nullptr;
+        const char* m_pos = nullptr;
+    };
+
+    ChunkedBufferRange(const Buffer& buffer, ByteCoord begin, ByteCoord end);
+
+    iterator begin() const { return {m_chunks.data(), m_chunks.front().begin}; }
+    iterator end() const { return {&m_chunks.back(), m_chunks.back().begin}; }
+
+    // chunks of the range, made of whole lines except at the range ends
+    ArrayView<Chunk> chunks() const { return {m_chunks.data(), m_chunks.size() - 1}; }
+    // iterator at pos, which is inside chunk or at its end
+    static iterator iterator_in(const Chunk& chunk, const char* pos)
+    { return pos == chunk.end ? iterator{&chunk+1, (&chunk+1)->begin} : iterator{&chunk, pos}; }
+
+    iterator iterator_at(ByteCoord coord) const
+    { return begin() + (ptrdiff_t)(m_buffer.offset_of(coord) - m_offset); }
+    ByteCoord coord(const iterator& pos) const;
+    BufferIterator buffer_iterator(const iterator& pos) const
+    { return m_buffer.iterator_at(coord(pos)); }
+
+private:
+    const Buffer& m_buffer;
+    size_t m_offset;
+    Vector<Chunk, MemoryDomain::BufferMeta> m_chunks;
+
+    // line containing the last converted position
+    mutable LineCount m_line = -1;
+    mutable size_t m_line_begin = 0;
+    mutable size_t m_line_end = 0;
+};
+
+// returns a pointer to the first '\r' or '\n' in [begin, end), or end
+const char* find_eol(const char* begin, const char* end);
+
+// copy lines to a packed line data, with '\n' line endings including for
+// the last line, content is set to the copied lines. Data bigger than
+// twice min_part_size is split in parts starting on line boundaries,
+// copied in parallel on up to max_threads threads.
+ref_ptr<LineData> pack_lines(StringView lines, StringView& content, bool& crlf,
+                             size_t min_part_size = 4 * 1024 * 1024,
+                             size_t max_threads = std::thread::hardware_concurrency());
+
 Buffer* create_fifo_buffer(String name, int fd, bool scroll = false);
 
+// drop the oldest lines of a fifo buffer so that it keeps at most
+// max_lines lines, a max_lines of 0 meaning no limit.
+void trim_fifo_lines(Buffer& buffer, LineCount max_lines);
+
+// if lazy_data is given, it should own data, and lines may be lazily
+// loaded from it instead of being copied.
 Buffer* create_buffer_from_data(StringView data, StringView name,
                                 Buffer::Flags flags,
-                                time_t fs_timestamp = InvalidTime);
+                                time_t fs_timestamp = InvalidTime,
+                                ref_ptr<LineData> lazy_data = {});
 
 }
 
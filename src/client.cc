@@ -8,6 +8,7 @@
 #include "remote.hh"
 #include "client_manager.hh"
 #include "event_manager.hh"
+#include "file_watcher.hh"
 #include "window.hh"
 
 #include <signal.h>
@@ -16,6 +17,10 @@
 namespace Kakoune
 {
 
+static constexpr std::chrono::milliseconds fs_check_timeout{500};
+// let writes to the file complete before checking it
+static constexpr std::chrono::milliseconds fs_change_delay{50};
+
 Client::Client(std::unique_ptr<UserInterface>&& ui,
                std::unique_ptr<Window>&& window,
                SelectionList selections,
@@ -24,13 +29,19 @@ Client::Client(std::unique_ptr<UserInterface>&& ui,
     : m_ui{std::move(ui)}, m_window{std::move(window)},
       m_input_handler{std::move(selections), Context::Flags::None,
                       std::move(name)},
-      m_env_vars(env_vars)
+      m_env_vars(env_vars),
+      m_fs_check_timer{Clock::now() + fs_check_timeout, [this](Timer& timer) {
+          check_buffer_fs_timestamp();
+          if (not FileWatcher::has_instance() or not FileWatcher::instance().active())
+              timer.set_next_date(Clock::now() + fs_check_timeout);
+      }}
 {
     context().set_client(*this);
     context().set_window(*m_window);
 
     m_window->options().register_watcher(*this);
     m_ui->set_ui_options(m_window->options()["ui_options"].get<UserInterface::Options>());
+    check_stale_journal();
 }
 
 Client::~Client()
@@ -111,6 +122,8 @@ DisplayLine Client::generate_mode_line() const
         status.push_back({ "[recording ("_str + StringView{m_input_handler.recording_reg()} + ")]", info_face });
     if (context().buffer().flags() & Buffer::Flags::New)
         status.push_back({ "[new file]", info_face });
+    if (context().buffer().has_stale_journal())
+        status.push_back({ "[journal]", info_face });
     if (context().user_hooks_support().is_disabled())
         status.push_back({ "[no-hooks]", info_face });
     if (context().buffer().flags() & Buffer::Flags::Fifo)
@@ -140,6 +153,16 @@ void Client::change_buffer(Buffer& buffer)
     m_window->set_dimensions(ui().dimensions());
 
     m_window->hooks().run_hook("WinDisplay", buffer.name(), context());
+    schedule_fs_check();
+    check_stale_journal();
+}
+
+void Client::check_stale_journal()
+{
+    const Buffer& buffer = context().buffer();
+    if (buffer.has_stale_journal())
+        print_status({ "'" + buffer.display_name() + "' has unsaved edits from a crashed "
+                       "session, use :recover to replay them", get_face("Information") });
 }
 
 void Client::redraw_ifn()
@@ -189,7 +212,8 @@ void Client::check_buffer_fs_timestamp()
 
     const String& filename = buffer.name();
     time_t ts = get_fs_timestamp(filename);
-    if (ts == InvalidTime or ts == buffer.fs_timestamp())
+    if (ts == InvalidTime or ts == buffer.fs_timestamp() or
+        async_write_pending(filename))
         return;
     if (reload == Ask)
     {
@@ -228,6 +252,19 @@ void Client::check_buffer_fs_timestamp()
         reload_buffer(context(), filename);
 }
 
+void Client::schedule_fs_check()
+{
+    const auto date = Clock::now() + fs_change_delay;
+    if (date < m_fs_check_timer.next_date())
+        m_fs_check_timer.set_next_date(date);
+}
+
+void Client::postpone_fs_check()
+{
+    if (m_fs_check_timer.next_date() != TimePoint::max())
+        m_fs_check_timer.set_next_date(Clock::now() + fs_check_timeout);
+}
+
 StringView Client::get_env_var(const String& name) const
 {
     auto it = m_env_vars.find(name);
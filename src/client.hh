@@ -3,6 +3,7 @@
 
 #include "display_buffer.hh"
 #include "env_vars.hh"
+#include "event_manager.hh"
 #include "input_handler.hh"
 #include "safe_ptr.hh"
 #include "utils.hh"
@@ -41,6 +42,12 @@ public:
     Window& window() const { return *m_window; }
 
     void check_buffer_fs_timestamp();
+    // check the buffer file timestamp shortly
+    void schedule_fs_check();
+    // delay a pending buffer file timestamp check
+    void postpone_fs_check();
+    // tell the user about a journal left by a crashed session
+    void check_stale_journal();
 
     Context& context() { return m_input_handler.context(); }
     const Context& context() const { return m_input_handler.context(); }
@@ -71,6 +78,9 @@ private:
     DisplayLine m_mode_line;
 
     Vector<Key, MemoryDomain::Client> m_pending_keys;
+
+    // checks are requested by the file watcher, or periodic without it
+    Timer m_fs_check_timer;
 };
 
 }
@@ -58,6 +58,43 @@ Client* ClientManager::create_client(std::unique_ptr<UserInterface>&& ui,
     return client;
 }
 
+void ClientManager::schedule_fs_check(StringView filename) const
+{
+    for (auto& client : m_clients)
+    {
+        if (client->context().buffer().name() == filename)
+            client->schedule_fs_check();
+    }
+}
+
+bool ClientManager::displays_buffer(const Buffer& buffer) const
+{
+    for (auto& client : m_clients)
+    {
+        if (&client->context().buffer() == &buffer)
+            return true;
+    }
+    return false;
+}
+
+void ClientManager::print_status(const Buffer& buffer, const DisplayLine& status) const
+{
+    for (auto& client : m_clients)
+    {
+        if (&client->context().buffer() == &buffer)
+            client->print_status(status);
+    }
+}
+
+void ClientManager::notify_stale_journal(const Buffer& buffer) const
+{
+    for (auto& client : m_clients)
+    {
+        if (&client->context().buffer() == &buffer)
+            client->check_stale_journal();
+    }
+}
+
 void ClientManager::handle_pending_inputs() const
 {
     for (auto& client : m_clients)
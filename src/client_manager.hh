@@ -36,6 +36,12 @@ public:
     void redraw_clients() const;
     void clear_mode_trashes() const;
     void handle_pending_inputs() const;
+    // schedule a timestamp check in clients displaying that file buffer
+    void schedule_fs_check(StringView filename) const;
+    bool displays_buffer(const Buffer& buffer) const;
+    // print status in clients displaying that buffer
+    void print_status(const Buffer& buffer, const DisplayLine& status) const;
+    void notify_stale_journal(const Buffer& buffer) const;
 
     Client*  get_client_ifp(StringView name);
     Client&  get_client(StringView name);
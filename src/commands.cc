@@ -216,7 +216,7 @@ const CommandDesc force_edit_cmd = {
     edit<true>
 };
 
-void write_buffer(const ParametersParser& parser, Context& context)
+void write_buffer(const ParametersParser& parser, Context& context, bool async)
 {
     Buffer& buffer = context.buffer();
 
@@ -226,7 +226,7 @@ void write_buffer(const ParametersParser& parser, Context& context)
     String filename = parser.positional_count() == 0 ? buffer.name()
                                      : parse_filename(parser[0]);
 
-    write_buffer_to_file(buffer, filename);
+    write_buffer_to_file(buffer, filename, async);
 }
 
 const CommandDesc write_cmd = {
@@ -236,15 +236,18 @@ const CommandDesc write_cmd = {
     single_optional_name_param,
     CommandFlags::None,
     filename_completer,
-    write_buffer,
+    [](const ParametersParser& parser, Context& context)
+    {
+        write_buffer(parser, context, true);
+    }
 };
 
-void write_all_buffers()
+void write_all_buffers(bool async)
 {
     for (auto& buffer : BufferManager::instance())
     {
         if ((buffer->flags() & Buffer::Flags::File) and buffer->is_modified())
-            write_buffer_to_file(*buffer, buffer->name());
+            write_buffer_to_file(*buffer, buffer->name(), async);
     }
 }
 
@@ -255,12 +258,14 @@ const CommandDesc writeall_cmd = {
     no_params,
     CommandFlags::None,
     CommandCompleter{},
-    [](const ParametersParser&, Context&){ write_all_buffers(); }
+    [](const ParametersParser&, Context&){ write_all_buffers(true); }
 };
 
 template<bool force>
 void quit()
 {
+    // buffers being written are modified until the write completes
+    wait_for_async_writes();
     if (not force and ClientManager::instance().count() == 1)
     {
         Vector<String> names;
@@ -316,7 +321,7 @@ const CommandDesc write_quit_cmd = {
     CommandCompleter{},
     [](const ParametersParser& parser, Context& context)
     {
-        write_buffer(parser, context);
+        write_buffer(parser, context, false);
         quit<false>();
     }
 };
@@ -330,7 +335,7 @@ const CommandDesc force_write_quit_cmd = {
     CommandCompleter{},
     [](const ParametersParser& parser, Context& context)
     {
-        write_buffer(parser, context);
+        write_buffer(parser, context, false);
         quit<true>();
     }
 };
@@ -344,7 +349,7 @@ const CommandDesc writeall_quit_cmd = {
     CommandCompleter{},
     [](const ParametersParser& parser, Context& context)
     {
-        write_all_buffers();
+        write_all_buffers(false);
         quit<false>();
     }
 };
@@ -417,6 +422,23 @@ const CommandDesc namebuf_cmd = {
     }
 };
 
+const CommandDesc recover_cmd = {
+    "recover",
+    nullptr,
+    "recover: replay the unsaved edits journaled by a previous session on the current buffer",
+    no_params,
+    CommandFlags::None,
+    CommandCompleter{},
+    [](const ParametersParser& parser, Context& context)
+    {
+        auto count = context.buffer().recover_journal();
+        String message = "recovered " + to_string(count.first) + " edits";
+        if (count.first != count.second)
+            message += ", " + to_string(count.second - count.first) + " could not be applied";
+        context.print_status({ std::move(message), get_face("Information") });
+    }
+};
+
 Completions complete_highlighter(const Context& context,
                                  StringView arg, ByteCount pos_in_token, bool only_group)
 {
@@ -565,7 +587,7 @@ const CommandDesc add_hook_cmd = {
     [](const ParametersParser& parser, Context& context)
     {
         // copy so that the lambda gets a copy as well
-        Regex regex(parser[2].begin(), parser[2].end());
+        Regex regex = cached_regex(parser[2]);
         String command = parser[3];
         auto hook_func = [=](StringView param, Context& context) {
             if (context.user_hooks_support().is_disabled())
@@ -797,13 +819,13 @@ const CommandDesc debug_cmd = {
     "debug",
     nullptr,
     "debug <command>: write some debug informations in the debug buffer\n"
-    "    existing commands: info, buffers",
+    "    existing commands: info, buffers, options, memory, shared-strings, regex-cache",
     ParameterDesc{ SwitchMap{}, ParameterDesc::Flags::SwitchesOnlyAtStart, 1 },
     CommandFlags::None,
     PerArgumentCommandCompleter({
         [](const Context& context, CompletionFlags flags,
            const String& prefix, ByteCount cursor_pos) -> Completions {
-               auto c = {"info", "buffers", "options", "memory", "shared-strings"};
+               auto c = {"info", "buffers", "options", "memory", "shared-strings", "regex-cache"};
                return { 0_byte, cursor_pos, complete(prefix, cursor_pos, c) };
     } }),
     [](const ParametersParser& parser, Context& context)
@@ -836,6 +858,9 @@ const CommandDesc debug_cmd = {
                 write_debug("  "_sv + domain_name((MemoryDomain)domain) + ": " + to_string(count));
             }
             write_debug("  Total: " + to_string(total));
+            const size_t slabs = StringStorage::allocator().slab_count();
+            write_debug("  Slabs: " + to_string(slabs) + " (" +
+                        to_string(slabs * SlabAllocator::slab_size) + " bytes)");
             #if defined(__GLIBC__) || defined(__CYGWIN__)
             write_debug("  Malloced: " + to_string(mallinfo().uordblks));
             #endif
@@ -844,6 +869,10 @@ const CommandDesc debug_cmd = {
         {
             StringRegistry::instance().debug_stats();
         }
+        else if (parser[0] == "regex-cache")
+        {
+            RegexCache::instance().debug_stats();
+        }
         else
             throw runtime_error("unknown debug command '" + parser[0] + "'");
     }
@@ -1464,6 +1493,7 @@ void register_commands()
     register_command(cm, delbuf_cmd);
     register_command(cm, force_delbuf_cmd);
     register_command(cm, namebuf_cmd);
+    register_command(cm, recover_cmd);
     register_command(cm, add_highlighter_cmd);
     register_command(cm, rm_highlighter_cmd);
     register_command(cm, add_hook_cmd);
@@ -0,0 +1,127 @@
+#include "compression.hh"
+
+#include "exception.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace Kakoune
+{
+
+void write_varint(String& str, size_t value)
+{
+    while (value >= 0x80)
+    {
+        str += (char)(value | 0x80);
+        value >>= 7;
+    }
+    str += (char)value;
+}
+
+size_t read_varint(const char*& pos, const char* end)
+{
+    size_t value = 0;
+    for (int shift = 0; pos != end and shift < 64; shift += 7)
+    {
+        const unsigned char c = *pos++;
+        value |= (size_t)(c & 0x7F) << shift;
+        if (not (c & 0x80))
+            return value;
+    }
+    throw runtime_error("invalid varint in compressed data");
+}
+
+// The compressed data is the uncompressed length followed by a sequence of
+// (literal count, literals, match offset, match length) entries, the last
+// entry stopping after its literals. Matches are found through a hash table
+// of the last position of each 4 bytes sequence.
+String compress(StringView data)
+{
+    constexpr int min_match = 4;
+    constexpr int hash_bits = 14;
+
+    const char* begin = data.begin();
+    const char* end = data.end();
+
+    String res;
+    res.reserve((int)data.length() / 2 + 16);
+    write_varint(res, (int)data.length());
+
+    int table[1 << hash_bits];
+    std::fill(std::begin(table), std::end(table), -1);
+
+    const char* anchor = begin;
+    const char* pos = begin;
+    while (end - pos >= min_match)
+    {
+        uint32_t sequence;
+        memcpy(&sequence, pos, sizeof(sequence));
+        const uint32_t hash = (sequence * 2654435761u) >> (32 - hash_bits);
+        const int candidate = table[hash];
+        table[hash] = (int)(pos - begin);
+
+        if (candidate < 0 or memcmp(begin + candidate, pos, min_match) != 0)
+        {
+            ++pos;
+            continue;
+        }
+
+        const char* match = begin + candidate;
+        const char* match_end = pos + min_match;
+        while (match_end != end and *match_end == match[match_end - pos])
+            ++match_end;
+
+        write_varint(res, pos - anchor);
+        res.stdstr().append(anchor, pos);
+        write_varint(res, pos - match);
+        write_varint(res, match_end - pos - min_match);
+        pos = anchor = match_end;
+    }
+    write_varint(res, end - anchor);
+    res.stdstr().append(anchor, end);
+    return res;
+}
+
+String decompress(StringView data)
+{
+    constexpr int min_match = 4;
+
+    const char* pos = data.begin();
+    const char* end = data.end();
+    const size_t length = read_varint(pos, end);
+    if (length > (size_t)std::numeric_limits<int>::max())
+        throw runtime_error("invalid length in compressed data");
+
+    // the length can come from corrupted data, do not trust it for allocation
+    String res;
+    res.reserve((int)std::min(length, (size_t)(end - pos) * 4));
+    while (true)
+    {
+        const size_t literals = read_varint(pos, end);
+        if (literals > (size_t)(end - pos) or res.stdstr().size() + literals > length)
+            throw runtime_error("invalid literals in compressed data");
+        res.stdstr().append(pos, literals);
+        pos += literals;
+        if (res.stdstr().size() == length)
+            return res;
+
+        const size_t offset = read_varint(pos, end);
+        const size_t count = read_varint(pos, end) + min_match;
+        const size_t size = res.stdstr().size();
+        if (offset == 0 or offset > size or size + count > length)
+            throw runtime_error("invalid match in compressed data");
+        res.stdstr().resize(size + count);
+        char* dest = &res.stdstr()[size];
+        if (offset >= count)
+            memcpy(dest, dest - offset, count);
+        else // the match overlaps the bytes it produces
+        {
+            for (size_t i = 0; i < count; ++i)
+                dest[i] = dest[i - offset];
+        }
+    }
+}
+
+}
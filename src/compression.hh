@@ -0,0 +1,22 @@
+#ifndef compression_hh_INCLUDED
+#define compression_hh_INCLUDED
+
+#include "string.hh"
+
+namespace Kakoune
+{
+
+// LZ77 style compression, favoring speed over compression ratio, meant
+// for data that is kept around but seldom accessed.
+String compress(StringView data);
+// decompress data returned by compress
+String decompress(StringView data);
+
+// variable length integer encoding, 7 bits per byte
+void write_varint(String& str, size_t value);
+// reads a varint at pos and advances it, throws if it goes past end
+size_t read_varint(const char*& pos, const char* end);
+
+}
+
+#endif // compression_hh_INCLUDED
@@ -0,0 +1,157 @@
+#ifndef diff_hh_INCLUDED
+#define diff_hh_INCLUDED
+
+#include "vector.hh"
+
+#include <algorithm>
+#include <limits>
+
+namespace Kakoune
+{
+
+struct Diff
+{
+    enum Mode { Keep, Add, Remove };
+    Mode mode;
+    int len;
+    int posB; // for Add, position of the added elements in b
+};
+
+namespace DiffDetail
+{
+
+struct Snake { int x, y, u, v; };
+
+// Find the middle snake of the shortest edit script between a and b,
+// as described in "An O(ND) Difference Algorithm and Its Variations",
+// E. Myers, 1986. Returns false if it needs more than max_cost edits.
+template<typename IteratorA, typename IteratorB>
+bool find_middle_snake(IteratorA a, int len_a, IteratorB b, int len_b,
+                       int* forward, int* backward, int max_cost, Snake& snake)
+{
+    const int delta = len_a - len_b;
+    const bool odd = delta & 1;
+    const int max_d = std::min((len_a + len_b + 1) / 2, max_cost);
+
+    // forward and backward are indexed by diagonal, backward diagonals
+    // being those of the reversed sequences.
+    forward[1] = 0;
+    backward[1] = 0;
+    for (int d = 0; d <= max_d; ++d)
+    {
+        for (int k = -d; k <= d; k += 2)
+        {
+            int x = (k == -d or (k != d and forward[k-1] < forward[k+1])) ?
+                forward[k+1] : forward[k-1] + 1;
+            int y = x - k;
+            const int x0 = x, y0 = y;
+            while (x < len_a and y < len_b and a[x] == b[y])
+                ++x, ++y;
+            forward[k] = x;
+
+            const int rk = delta - k;
+            if (odd and rk >= -(d-1) and rk <= d-1 and x + backward[rk] >= len_a)
+            {
+                snake = { x0, y0, x, y };
+                return true;
+            }
+        }
+
+        for (int k = -d; k <= d; k += 2)
+        {
+            int x = (k == -d or (k != d and backward[k-1] < backward[k+1])) ?
+                backward[k+1] : backward[k-1] + 1;
+            int y = x - k;
+            const int x0 = x, y0 = y;
+            while (x < len_a and y < len_b and a[len_a-1-x] == b[len_b-1-y])
+                ++x, ++y;
+            backward[k] = x;
+
+            const int fk = delta - k;
+            if (not odd and fk >= -d and fk <= d and x + forward[fk] >= len_a)
+            {
+                snake = { len_a - x, len_b - y, len_a - x0, len_b - y0 };
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline void append_diff(Vector<Diff>& diffs, Diff::Mode mode, int len, int posB)
+{
+    if (len == 0)
+        return;
+    if (not diffs.empty() and diffs.back().mode == mode and
+        (mode != Diff::Add or diffs.back().posB + diffs.back().len == posB))
+        diffs.back().len += len;
+    else
+        diffs.push_back({ mode, len, posB });
+}
+
+template<typename IteratorA, typename IteratorB>
+void find_diff_rec(IteratorA a, int begin_a, int end_a,
+                   IteratorB b, int begin_b, int end_b,
+                   int* forward, int* backward, int max_cost,
+                   Vector<Diff>& diffs)
+{
+    int prefix = 0;
+    while (begin_a + prefix < end_a and begin_b + prefix < end_b and
+           a[begin_a + prefix] == b[begin_b + prefix])
+        ++prefix;
+    append_diff(diffs, Diff::Keep, prefix, 0);
+    begin_a += prefix;
+    begin_b += prefix;
+
+    int suffix = 0;
+    while (end_a - suffix > begin_a and end_b - suffix > begin_b and
+           a[end_a - suffix - 1] == b[end_b - suffix - 1])
+        ++suffix;
+    end_a -= suffix;
+    end_b -= suffix;
+
+    Snake snake;
+    if (begin_a == end_a or begin_b == end_b or
+        not find_middle_snake(a + begin_a, end_a - begin_a,
+                              b + begin_b, end_b - begin_b,
+                              forward, backward, max_cost, snake))
+    {
+        // too costly to refine, replace the whole range
+        append_diff(diffs, Diff::Add, end_b - begin_b, begin_b);
+        append_diff(diffs, Diff::Remove, end_a - begin_a, 0);
+    }
+    else
+    {
+        find_diff_rec(a, begin_a, begin_a + snake.x, b, begin_b, begin_b + snake.y,
+                      forward, backward, max_cost, diffs);
+        append_diff(diffs, Diff::Keep, snake.u - snake.x, 0);
+        find_diff_rec(a, begin_a + snake.u, end_a, b, begin_b + snake.v, end_b,
+                      forward, backward, max_cost, diffs);
+    }
+
+    append_diff(diffs, Diff::Keep, suffix, 0);
+}
+
+}
+
+// Compute a list of Keep/Add/Remove operations transforming a into b,
+// parts of the sequences that would need more than max_cost edits to be
+// diffed precisely are reported as replaced.
+template<typename IteratorA, typename IteratorB>
+Vector<Diff> find_diff(IteratorA a, int len_a, IteratorB b, int len_b,
+                       int max_cost = std::numeric_limits<int>::max() / 2)
+{
+    const int max_d = std::min((len_a + len_b + 1) / 2, max_cost) + 1;
+    Vector<int> data(4 * max_d + 2);
+    int* forward = data.data() + max_d;
+    int* backward = data.data() + 3 * max_d + 1;
+
+    Vector<Diff> diffs;
+    DiffDetail::find_diff_rec(a, 0, len_a, b, 0, len_b,
+                              forward, backward, max_cost, diffs);
+    return diffs;
+}
+
+}
+
+#endif // diff_hh_INCLUDED
@@ -4,15 +4,27 @@
 #include "buffer.hh"
 #include "buffer_manager.hh"
 #include "buffer_utils.hh"
+#include "client_manager.hh"
 #include "debug.hh"
+#include "event_manager.hh"
+#include "face_registry.hh"
 #include "unicode.hh"
 #include "regex.hh"
+#include "scope.hh"
 #include "string.hh"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
 #include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -131,6 +143,153 @@ String read_file(StringView filename)
     return read_fd(fd);
 }
 
+// Reading a page past the end of a mapped file that got truncated raises
+// SIGBUS. Live mappings are linked together so that the SIGBUS handler
+// can replace their missing pages with zeroed ones, the buffer content
+// is lost anyway, and the external modification will be reported.
+//
+// The handler can run on an async write worker while the main thread
+// creates or destroys mappings, so the list is guarded by a spin lock,
+// which is never held while reading mapped data. Lines of a truncated
+// mapping do not end with '\n' anymore, they get copied with restored
+// end of lines by load_truncated_lines.
+struct MappedFile : LineData
+{
+    MappedFile(const char* data, size_t size) : data(data), size(size)
+    {
+        static bool handler_installed = install_sigbus_handler();
+        (void)handler_installed;
+
+        ListLock lock;
+        next = first;
+        if (first)
+            first->prev = this;
+        first = this;
+    }
+
+    ~MappedFile()
+    {
+        {
+            ListLock lock;
+            (prev ? prev->next : first) = next;
+            if (next)
+                next->prev = prev;
+        }
+        munmap((void*)data, size);
+    }
+
+    bool truncated() const override { return lost; }
+
+    const char* data;
+    size_t size;
+    std::atomic<bool> lost{false};
+
+    MappedFile* prev = nullptr;
+    MappedFile* next = nullptr;
+    static MappedFile* first;
+
+    static std::atomic_flag list_lock;
+    static uintptr_t page_mask;
+    // set when a mapping got truncated, until load_truncated_lines runs
+    static std::atomic<bool> some_lost;
+
+    struct ListLock
+    {
+        ListLock() { while (list_lock.test_and_set(std::memory_order_acquire)) {} }
+        ~ListLock() { list_lock.clear(std::memory_order_release); }
+    };
+
+    // only uses async-signal-safe calls, mmap being a plain system call
+    static void on_sigbus(int, siginfo_t* info, void*)
+    {
+        const char* addr = (const char*)info->si_addr;
+        ListLock lock;
+        for (MappedFile* file = first; file; file = file->next)
+        {
+            if (addr < file->data or addr >= file->data + file->size)
+                continue;
+            char* page = (char*)((uintptr_t)addr & ~page_mask);
+            if (mmap(page, file->data + file->size - page, PROT_READ,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+                break;
+            file->lost = true;
+            some_lost = true;
+            return;
+        }
+        // not a mapped file, the faulting access is retried and kills us
+        signal(SIGBUS, SIG_DFL);
+    }
+
+    static bool install_sigbus_handler()
+    {
+        page_mask = sysconf(_SC_PAGESIZE) - 1;
+        struct sigaction action = {};
+        action.sa_sigaction = on_sigbus;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        return sigaction(SIGBUS, &action, nullptr) == 0;
+    }
+};
+
+MappedFile* MappedFile::first = nullptr;
+std::atomic_flag MappedFile::list_lock = ATOMIC_FLAG_INIT;
+uintptr_t MappedFile::page_mask = 0;
+std::atomic<bool> MappedFile::some_lost{false};
+
+void load_truncated_lines()
+{
+    if (not MappedFile::some_lost.exchange(false))
+        return;
+    for (auto& buffer : BufferManager::instance())
+        buffer->load_truncated_lines();
+}
+
+// Lines moved to an unlinked temporary file, that nothing else can modify,
+// so unlike other mappings they are considered owned.
+struct SpilledLines : MappedFile
+{
+    using MappedFile::MappedFile;
+    bool owned() const override { return true; }
+};
+
+String hidden_file_path(StringView filename, StringView suffix)
+{
+    ByteCount dir_end = -1;
+    for (ByteCount i = 0; i < filename.length(); ++i)
+    {
+        if (filename[i] == '/')
+            dir_end = i;
+    }
+    return filename.substr(0, dir_end + 1) + "." +
+           filename.substr(dir_end + 1) + suffix;
+}
+
+String tmp_file_path(StringView filename)
+{
+    const char* tmpdir = getenv("TMPDIR");
+    return (tmpdir and *tmpdir ? tmpdir : "/tmp") + "/"_str + filename;
+}
+
+static void restore_undo_file(Buffer& buffer)
+{
+    const String filename = hidden_file_path(buffer.name(), ".kak.undo");
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    auto close_fd = on_scope_end([fd]{ close(fd); });
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 or st.st_size == 0)
+        return;
+
+    const char* data = (const char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return;
+    ref_ptr<LineData> mapping = new MappedFile{data, (size_t)st.st_size};
+    if (not buffer.restore_history(mapping, {data, data + st.st_size}))
+        write_debug("ignoring undo file " + filename + ": it does not match buffer content");
+}
+
 Buffer* create_buffer_from_file(StringView filename)
 {
     String real_filename = real_path(parse_filename(filename));
@@ -151,71 +310,553 @@ Buffer* create_buffer_from_file(StringView filename)
         throw file_access_error(real_filename, "is a directory");
 
     const char* data = (const char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    auto unmap = on_scope_end([&]{ munmap((void*)data, st.st_size); });
+    ref_ptr<LineData> mapping = new MappedFile{data, (size_t)st.st_size};
+
+    const int lazy_load_size = GlobalScope::instance().options()["lazy_load_size"].get<int>();
+    const bool lazy = lazy_load_size > 0 and st.st_size >= lazy_load_size;
 
-    return create_buffer_from_data({data, data + st.st_size}, real_filename,
-                                   Buffer::Flags::File, st.st_mtime);
+    // a reloaded buffer keeps its live history
+    const bool reload = BufferManager::instance().get_buffer_ifp(real_filename) != nullptr;
+    Buffer* buffer = create_buffer_from_data({data, data + st.st_size}, real_filename,
+                                             Buffer::Flags::File, st.st_mtime,
+                                             lazy ? mapping : ref_ptr<LineData>{});
+    if (not reload and buffer->options()["persistent_undo"].get<bool>())
+        restore_undo_file(*buffer);
+    return buffer;
 }
 
-static void write(int fd, StringView data)
+// Destination of a file write, either the file itself, or a temporary
+// file in the same directory renamed over it once complete, so that a
+// crash or a full disk never leaves it truncated, and buffers still
+// mapping the previous file are unaffected. A replaced file keeps its
+// owner and group, when they cannot be given to the temporary file the
+// target is returned with an fd of -1, and should be written in place.
+struct WriteTarget
 {
-    const char* ptr = data.data();
-    ssize_t count   = (int)data.length();
+    String filename;
+    String tmp_filename;
+    int fd;
+};
+
+static WriteTarget open_write_target(StringView filename, bool replace,
+                                     bool keep_owner = true)
+{
+    if (not replace)
+    {
+        int fd = open(filename.zstr(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd == -1)
+            throw file_access_error(filename, strerror(errno));
+        return { filename.str(), {}, fd };
+    }
+
+    ByteCount dir_end = -1;
+    for (ByteCount i = 0; i < filename.length(); ++i)
+    {
+        if (filename[i] == '/')
+            dir_end = i;
+    }
+    String tmp_filename = filename.substr(0, dir_end + 1) + "." +
+                          filename.substr(dir_end + 1) + ".kak.XXXXXX";
+    int fd = mkstemp(&tmp_filename.stdstr()[0]);
+    if (fd == -1)
+        throw file_access_error(filename, strerror(errno));
+
+    // keep the owner and permissions of the replaced file, changing the
+    // owner clears the setuid and setgid bits so it is done first.
+    struct stat st;
+    mode_t mode;
+    if (stat(filename.zstr(), &st) == 0)
+    {
+        mode = st.st_mode & 07777;
+        struct stat tmp_st;
+        if (keep_owner and fstat(fd, &tmp_st) == 0 and
+            (tmp_st.st_uid != st.st_uid or tmp_st.st_gid != st.st_gid) and
+            fchown(fd, st.st_uid, st.st_gid) != 0)
+        {
+            close(fd);
+            unlink(tmp_filename.c_str());
+            return { filename.str(), {}, -1 };
+        }
+    }
+    else
+    {
+        const mode_t mask = umask(0);
+        umask(mask);
+        mode = 0644 & ~mask;
+    }
+    if (fchmod(fd, mode) != 0)
+    {
+        const int error = errno;
+        close(fd);
+        unlink(tmp_filename.c_str());
+        throw file_access_error(filename, strerror(error));
+    }
+    return { filename.str(), std::move(tmp_filename), fd };
+}
+
+// complete a write whose content writing returned error, 0 or an errno
+// value, the target fd being already closed.
+static void commit_write_target(const WriteTarget& target, int error)
+{
+    if (error == 0 and not target.tmp_filename.empty() and
+        rename(target.tmp_filename.c_str(), target.filename.c_str()) != 0)
+        error = errno;
+    if (error != 0)
+    {
+        if (not target.tmp_filename.empty())
+            unlink(target.tmp_filename.c_str());
+        throw file_access_error(target.filename, strerror(error));
+    }
+}
+
+static WriteTarget open_undo_file(StringView filename)
+{
+    // undo files are only read back by us, their owner does not matter
+    return open_write_target(hidden_file_path(filename, ".kak.undo"), true, false);
+}
+
+// serialize history for lines to fd and close it, returns 0 or an errno
+// value. Does not allocate tracked memory, so can run on a worker thread.
+static int write_undo_file_and_close(int fd, const Buffer::HistorySnapshot& history,
+                                     const LineList& lines, bool sync)
+{
+    int error = history.serialize(lines, [fd](StringView data) {
+        const char* ptr = data.data();
+        ssize_t count = (int)data.length();
+        while (count)
+        {
+            ssize_t written = ::write(fd, ptr, count);
+            if (written == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                return errno;
+            }
+            ptr += written;
+            count -= written;
+        }
+        return 0;
+    });
+    if (error == 0 and sync and fdatasync(fd) != 0)
+        error = errno;
+    if (close(fd) != 0 and error == 0)
+        error = errno;
+    return error;
+}
+
+// Gathers views of data to write with as few writev calls as possible,
+// merging views that are contiguous in memory, such as consecutive
+// packed lines. Views must stay valid until flushed. Errors are kept in
+// error, as writes can happen on a worker thread. Non blocking fds, such
+// as a stdout pipe in filter mode, are waited on until writable.
+struct VectoredWriter
+{
+    VectoredWriter(int fd) : fd(fd) {}
+
+    void add(StringView data)
+    {
+        if (data.empty())
+            return;
+        if (count != 0 and (const char*)iov[count-1].iov_base + iov[count-1].iov_len == data.data())
+        {
+            iov[count-1].iov_len += (int)data.length();
+            return;
+        }
+        if (count == max_count)
+            flush();
+        iov[count++] = iovec{const_cast<char*>(data.data()), (size_t)(int)data.length()};
+    }
 
-    while (count)
+    void flush()
     {
-        ssize_t written = ::write(fd, ptr, count);
-        ptr += written;
-        count -= written;
+        iovec* pending = iov;
+        int remaining = error == 0 ? count : 0;
+        while (remaining != 0)
+        {
+            ssize_t written = ::writev(fd, pending, remaining);
+            if (written == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN or errno == EWOULDBLOCK)
+                {
+                    pollfd pfd{fd, POLLOUT, 0};
+                    if (poll(&pfd, 1, -1) != -1 or errno == EINTR)
+                        continue;
+                }
+                error = errno;
+                break;
+            }
+            // skip what was written, which can end in the middle of an iovec
+            while (remaining != 0 and (size_t)written >= pending->iov_len)
+            {
+                written -= pending->iov_len;
+                ++pending;
+                --remaining;
+            }
+            if (remaining != 0)
+            {
+                pending->iov_base = (char*)pending->iov_base + written;
+                pending->iov_len -= written;
+            }
+        }
+        count = 0;
+    }
+
+    static constexpr int max_count = 1024;
+
+    int fd;
+    iovec iov[max_count];
+    int count = 0;
+    int error = 0;
+};
+
+// end of lines are written according to eolformat but always stored as \n
+static StringView eol_data(const Buffer& buffer)
+{
+    return buffer.options()["eolformat"].get<String>() == "crlf" ? "\r\n" : "\n";
+}
+
+static bool has_bom(const Buffer& buffer)
+{
+    return buffer.options()["BOM"].get<String>() == "utf-8";
+}
+
+// Neither allocates nor throws, so that it can run on a worker thread,
+// returns 0 or the errno value of the failure.
+int write_lines(int fd, const LineList& lines, StringView eoldata, bool bom)
+{
+    VectoredWriter writer{fd};
+    if (bom)
+        writer.add("\xEF\xBB\xBF");
 
-        if (written == -1)
-            throw file_access_error("fd: " + to_string(fd), strerror(errno));
+    const bool lf = eoldata == "\n";
+    for (auto line : lines)
+    {
+        if (lf)
+            writer.add(line);
+        else
+        {
+            writer.add(line.substr(0, line.length()-1));
+            writer.add(eoldata);
+        }
     }
+    writer.flush();
+    return writer.error;
+}
+
+static int write_lines_and_close(int fd, const LineList& lines, StringView eoldata,
+                                 bool bom, bool sync)
+{
+    int error = write_lines(fd, lines, eoldata, bom);
+    if (error == 0 and sync and fdatasync(fd) != 0)
+        error = errno;
+    if (close(fd) != 0 and error == 0)
+        error = errno;
+    return error;
 }
 
 void write_buffer_to_fd(Buffer& buffer, int fd)
 {
-    const String& eolformat = buffer.options()["eolformat"].get<String>();
+    if (int error = write_lines(fd, buffer.lines(), eol_data(buffer), has_bom(buffer)))
+        throw file_access_error("fd: " + to_string(fd), strerror(error));
+}
+
+// A write running on a worker thread, from a snapshot of the buffer
+// lines and undo history. The worker only serializes, writes and closes
+// the files, then signals its completion through a pipe, the rest
+// happens on the main thread.
+struct AsyncWrite
+{
+    String buffer_name;
+    // real path of the written file
+    String path;
+    WriteTarget target;
+    LineList lines;
     StringView eoldata;
-    if (eolformat == "crlf")
-        eoldata = "\r\n";
-    else
-        eoldata = "\n";
+    bool bom;
+    bool sync;
+    bool saving_buffer_file;
+    Buffer::SavePoint save_point;
+    // undo history written along with the lines when it is persistent
+    bool persistent_undo = false;
+    Buffer::HistorySnapshot history;
+    WriteTarget history_target = { {}, {}, -1 };
+    int history_error = 0;
+    // error message when the undo file could not be created
+    String history_failure;
+
+    int done_pipe[2];
+    std::thread worker;
+    std::unique_ptr<FDWatcher> watcher;
+    int error = 0;
+    bool finished = false;
+    // error message when the write failed
+    String failure;
+};
+
+static Vector<std::unique_ptr<AsyncWrite>>& async_writes()
+{
+    static Vector<std::unique_ptr<AsyncWrite>> writes;
+    return writes;
+}
+
+static void complete_async_write(AsyncWrite& job)
+{
+    job.worker.join();
+    job.watcher->close_fd();
+    close(job.done_pipe[1]);
+    job.lines = LineList{};
+    job.history = Buffer::HistorySnapshot{};
+
+    Buffer* buffer = BufferManager::instance().get_buffer_ifp(job.buffer_name);
+    // the undo file is only kept along with the file it applies to
+    const bool keep_history = job.persistent_undo and job.error == 0 and buffer;
+    if (not keep_history and not job.history_target.tmp_filename.empty())
+        unlink(job.history_target.tmp_filename.c_str());
+
+    commit_write_target(job.target, job.error);
+    if (not buffer)
+        return;
+
+    if (job.saving_buffer_file)
+        buffer->notify_saved(job.save_point);
+    if (keep_history)
+    {
+        if (not job.history_failure.empty())
+            throw runtime_error(job.history_failure);
+        commit_write_target(job.history_target, job.history_error);
+    }
+    buffer->run_hook_in_own_context("BufWritePost", buffer->name());
+}
+
+// The synchronous write throws errors to the user, async ones are shown
+// in the clients displaying the buffer and kept in the job.
+static void finish_async_write(AsyncWrite& job)
+{
+    if (job.finished)
+        return;
+    job.finished = true;
+    try
+    {
+        complete_async_write(job);
+    }
+    catch (runtime_error& error)
+    {
+        job.failure = error.what();
+        write_debug(job.failure);
+        Buffer* buffer = BufferManager::instance().get_buffer_ifp(job.buffer_name);
+        if (buffer and ClientManager::has_instance())
+            ClientManager::instance().print_status(*buffer, { job.failure, get_face("Error") });
+    }
+}
+
+// returns the errors of the writes that got finished
+static Vector<String> finish_async_writes(std::function<bool (const AsyncWrite&)> filter)
+{
+    Vector<String> failures;
+    auto& writes = async_writes();
+    for (auto& job : writes)
+    {
+        if (job->finished or not filter(*job))
+            continue;
+        finish_async_write(*job);
+        if (not job->failure.empty())
+            failures.push_back(job->failure);
+    }
+    writes.erase(std::remove_if(writes.begin(), writes.end(),
+                                [](const std::unique_ptr<AsyncWrite>& job) { return job->finished; }),
+                 writes.end());
+    return failures;
+}
 
-    if (buffer.options()["BOM"].get<String>() == "utf-8")
-        ::write(fd, "\xEF\xBB\xBF", 3);
+void wait_for_async_writes()
+{
+    auto failures = finish_async_writes([](const AsyncWrite&) { return true; });
+    if (failures.empty())
+        return;
+
+    String message = "could not write: ";
+    for (auto it = failures.begin(); it != failures.end(); ++it)
+    {
+        if (it != failures.begin())
+            message += ", ";
+        message += *it;
+    }
+    throw runtime_error(message);
+}
+
+bool async_write_pending(StringView buffer_name)
+{
+    for (auto& job : async_writes())
+    {
+        if (not job->finished and job->saving_buffer_file and job->buffer_name == buffer_name)
+            return true;
+    }
+    return false;
+}
 
-    for (LineCount i = 0; i < buffer.line_count(); ++i)
+static void start_async_write(std::unique_ptr<AsyncWrite> job)
+{
+    if (pipe(job->done_pipe) != 0)
     {
-        // end of lines are written according to eolformat but always
-        // stored as \n
-        StringView linedata = buffer[i];
-        write(fd, linedata.substr(0, linedata.length()-1));
-        write(fd, eoldata);
+        if (job->history_target.fd != -1)
+        {
+            close(job->history_target.fd);
+            unlink(job->history_target.tmp_filename.c_str());
+        }
+        close(job->target.fd);
+        commit_write_target(job->target, errno);
     }
+
+    AsyncWrite* ptr = job.get();
+    job->watcher.reset(new FDWatcher{job->done_pipe[0], [ptr](FDWatcher&, EventMode mode) {
+        if (mode == EventMode::Normal)
+            finish_async_write(*ptr);
+    }});
+    job->worker = std::thread([ptr] {
+        ptr->error = write_lines_and_close(ptr->target.fd, ptr->lines, ptr->eoldata,
+                                           ptr->bom, ptr->sync);
+        if (ptr->history_target.fd != -1)
+        {
+            if (ptr->error == 0)
+                ptr->history_error = write_undo_file_and_close(
+                    ptr->history_target.fd, ptr->history, ptr->lines, ptr->sync);
+            else
+                close(ptr->history_target.fd);
+        }
+        const char done = 0;
+        while (::write(ptr->done_pipe[1], &done, 1) == -1 and errno == EINTR)
+            ;
+    });
+    async_writes().push_back(std::move(job));
 }
 
-void write_buffer_to_file(Buffer& buffer, StringView filename)
+void write_buffer_to_file(Buffer& buffer, StringView filename, bool async)
 {
     buffer.run_hook_in_own_context("BufWritePre", buffer.name());
 
+    bool replace = buffer.options()["write_method"].get<String>() == "replace";
+    const bool sync = buffer.options()["write_sync"].get<bool>();
+    async = async and buffer.options()["write_async"].get<bool>();
+    const String path = replace ? real_path(parse_filename(filename))
+                                : parse_filename(filename);
+    const String written_path = real_path(path);
+
+    // writes to a same file happen in order
+    finish_async_writes([&](const AsyncWrite& job) {
+        return job.path == written_path;
+    });
+
+    WriteTarget target;
+    if (replace)
     {
-        int fd = open(parse_filename(filename).c_str(),
-                      O_CREAT | O_WRONLY | O_TRUNC, 0644);
-        if (fd == -1)
-            throw file_access_error(filename, strerror(errno));
-        auto close_fd = on_scope_end([fd]{ close(fd); });
+        target = open_write_target(path, true);
+        replace = target.fd != -1;
+    }
 
-        write_buffer_to_fd(buffer, fd);
+    // pending writes and lazily loaded buffers might read from the
+    // mapping of the file that is about to be truncated when overwriting it.
+    if (not replace)
+    {
+        finish_async_writes([](const AsyncWrite& job) {
+            return job.lines.lazy_byte_count() != 0;
+        });
+        if (Buffer* mapped = BufferManager::instance().get_buffer_ifp(written_path))
+            mapped->load_lazy_lines();
+        target = open_write_target(path, false);
     }
 
-    if ((buffer.flags() & Buffer::Flags::File) and
-        real_path(filename) == real_path(buffer.name()))
-        buffer.notify_saved();
+    const bool saving_buffer_file = (buffer.flags() & Buffer::Flags::File) and
+        real_path(filename) == real_path(buffer.name());
+    const bool persistent_undo = saving_buffer_file and
+        buffer.options()["persistent_undo"].get<bool>();
+    // the saved state, and the persisted history, are the committed ones
+    buffer.commit_undo_group();
+    const Buffer::SavePoint save_point = buffer.save_point();
+
+    if (async)
+    {
+        std::unique_ptr<AsyncWrite> job{new AsyncWrite};
+        job->buffer_name = buffer.name();
+        job->path = written_path;
+        job->target = std::move(target);
+        job->lines = buffer.lines();
+        job->eoldata = eol_data(buffer);
+        job->bom = has_bom(buffer);
+        job->sync = sync;
+        job->saving_buffer_file = saving_buffer_file;
+        job->save_point = save_point;
+        job->persistent_undo = persistent_undo;
+        if (persistent_undo)
+        {
+            job->history = buffer.history_snapshot();
+            try
+            {
+                job->history_target = open_undo_file(buffer.name());
+            }
+            catch (runtime_error& error)
+            {
+                job->history_failure = error.what();
+            }
+        }
+        return start_async_write(std::move(job));
+    }
+
+    commit_write_target(target, write_lines_and_close(target.fd, buffer.lines(),
+                                                      eol_data(buffer), has_bom(buffer), sync));
+
+    if (saving_buffer_file)
+        buffer.notify_saved(save_point);
+    if (persistent_undo)
+    {
+        WriteTarget history_target = open_undo_file(buffer.name());
+        commit_write_target(history_target, write_undo_file_and_close(
+            history_target.fd, buffer.history_snapshot(), buffer.lines(), sync));
+    }
 
     buffer.run_hook_in_own_context("BufWritePost", buffer.name());
 }
 
+// move the lines to an unlinked temporary file they are mapped from
+static bool spill_lines(Buffer& buffer)
+{
+    String pattern = tmp_file_path("kak-lines.XXXXXX");
+    int fd = mkstemp(&pattern.stdstr()[0]);
+    if (fd == -1)
+        return false;
+    // the file lives as long as its mapping
+    unlink(pattern.c_str());
+    auto close_fd = on_scope_end([fd]{ close(fd); });
+
+    const size_t size = buffer.lines().byte_count();
+    if (write_lines(fd, buffer.lines(), "\n", false) != 0)
+        return false;
+    const char* data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return false;
+
+    LineList lines;
+    lines.append_packed(new SpilledLines{data, size}, {data, data + size});
+    buffer.set_evicted_lines(std::move(lines));
+    // finding the line starts read the whole mapping, pages are read
+    // back from the file when needed.
+    madvise((void*)data, size, MADV_DONTNEED);
+    return true;
+}
+
+bool evict_buffer(Buffer& buffer)
+{
+    buffer.values().clear();
+    const bool history_released = buffer.compact_history(1);
+    if (buffer.lines_evicted())
+        return history_released;
+
+    // the file of a buffer is not mapped, even when unmodified, as it can
+    // be rewritten in place behind our back.
+    return spill_lines(buffer) or history_released;
+}
+
 void write_buffer_to_backup_file(Buffer& buffer)
 {
     char pattern[PATH_MAX+1];
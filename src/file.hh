@@ -23,6 +23,7 @@ struct file_not_found : file_access_error
 };
 
 class Buffer;
+class LineList;
 template<typename T> class ArrayView;
 class String;
 class StringView;
@@ -32,6 +33,13 @@ String parse_filename(StringView filename);
 String real_path(StringView filename);
 String compact_path(StringView filename);
 
+// path of a hidden file next to filename, such as the persisted undo
+// history: filename with a leading dot, followed by suffix
+String hidden_file_path(StringView filename, StringView suffix);
+
+// path of filename in the temporary files directory, $TMPDIR or /tmp
+String tmp_file_path(StringView filename);
+
 String get_kak_binary_path();
 
 String read_fd(int fd);
@@ -39,10 +47,30 @@ String read_file(StringView filename);
 
 Buffer* create_buffer_from_file(StringView filename);
 
-void write_buffer_to_file(Buffer& buffer, StringView filename);
+// when async is true and the write_async option is set, the buffer lines
+// are written from a worker thread, and the buffer is notified as saved
+// and BufWritePost is run once the write completes.
+void write_buffer_to_file(Buffer& buffer, StringView filename, bool async = false);
+// throws the errors of the async writes that were pending
+void wait_for_async_writes();
+// true if the buffer is being written to its file by an async write
+bool async_write_pending(StringView buffer_name);
 void write_buffer_to_fd(Buffer& buffer, int fd);
+// write lines with eoldata as end of line, after an utf-8 BOM if bom is
+// set. Returns 0 or the errno value of the failure.
+int write_lines(int fd, const LineList& lines, StringView eoldata, bool bom);
 void write_buffer_to_backup_file(Buffer& buffer);
 
+// lines of lazily loaded files that got truncated read as NUL bytes, and
+// have lost their end of lines. Copy them with restored end of lines until
+// their buffers get reloaded.
+void load_truncated_lines();
+
+// drop the cached values of an idle buffer, spill its undo history, and
+// move its lines to a temporary file they are read back from. Returns
+// true if lines or undo history were released.
+bool evict_buffer(Buffer& buffer);
+
 String find_file(StringView filename, ArrayView<String> paths);
 
 time_t get_fs_timestamp(StringView filename);
@@ -0,0 +1,161 @@
+#include "file_watcher.hh"
+
+#include "client_manager.hh"
+#include "containers.hh"
+
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+namespace Kakoune
+{
+
+static int create_inotify_fd()
+{
+#if defined(__linux__)
+    return inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    return -1;
+#endif
+}
+
+FileWatcher::FileWatcher()
+    : m_watcher{create_inotify_fd(), [this](FDWatcher&, EventMode) { read_events(); }}
+{}
+
+FileWatcher::~FileWatcher()
+{
+    if (m_watcher.fd() != -1)
+        m_watcher.close_fd();
+}
+
+// directory paths keep their trailing slash
+static std::pair<StringView, StringView> split_path(StringView filename)
+{
+    ByteCount name_begin = 0;
+    for (ByteCount i = 0; i < filename.length(); ++i)
+    {
+        if (filename[i] == '/')
+            name_begin = i + 1;
+    }
+    return { filename.substr(0, name_begin), filename.substr(name_begin) };
+}
+
+template<typename Files>
+static auto find_file(Files& files, StringView name) -> decltype(files.begin())
+{
+    return find_if(files, [&](const std::pair<String, int>& file) { return file.first == name; });
+}
+
+void FileWatcher::watch(StringView filename)
+{
+    if (not active())
+        return;
+
+    auto path = split_path(filename);
+    auto dir = find_if(m_directories, [&](const Directory& d) { return d.path == path.first; });
+    if (dir == m_directories.end())
+    {
+#if defined(__linux__)
+        const int wd = inotify_add_watch(
+            m_watcher.fd(), path.first.zstr(),
+            IN_ONLYDIR | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+#else
+        const int wd = -1;
+#endif
+        // directory does not exist (yet), new files are not followed
+        if (wd == -1)
+            return;
+        m_directories.push_back({wd, path.first.str(), {}});
+        dir = m_directories.end() - 1;
+    }
+
+    auto file = find_file(dir->files, path.second);
+    if (file == dir->files.end())
+        dir->files.emplace_back(path.second.str(), 1);
+    else
+        ++file->second;
+}
+
+void FileWatcher::unwatch(StringView filename)
+{
+    auto path = split_path(filename);
+    auto dir = find_if(m_directories, [&](const Directory& d) { return d.path == path.first; });
+    if (dir == m_directories.end())
+        return;
+
+    auto file = find_file(dir->files, path.second);
+    if (file == dir->files.end() or --file->second > 0)
+        return;
+
+    dir->files.erase(file);
+    if (dir->files.empty())
+    {
+#if defined(__linux__)
+        if (dir->wd != -1)
+            inotify_rm_watch(m_watcher.fd(), dir->wd);
+#endif
+        m_directories.erase(dir);
+    }
+}
+
+Vector<String> FileWatcher::read_changes()
+{
+    Vector<String> changed;
+#if defined(__linux__)
+    auto add_changed = [&](const Directory& dir, StringView name) {
+        String filename = dir.path + name;
+        if (not contains(changed, filename))
+            changed.push_back(std::move(filename));
+    };
+
+    alignas(inotify_event) char buffer[4096];
+    ssize_t size;
+    while ((size = read(m_watcher.fd(), buffer, sizeof(buffer))) > 0)
+    {
+        for (char* pos = buffer; pos < buffer + size; )
+        {
+            const auto& event = *reinterpret_cast<inotify_event*>(pos);
+            pos += sizeof(inotify_event) + event.len;
+
+            // events were lost, any file might have changed
+            if (event.mask & IN_Q_OVERFLOW)
+            {
+                for (auto& dir : m_directories)
+                    for (auto& file : dir.files)
+                        add_changed(dir, file.first);
+                continue;
+            }
+
+            auto dir = find_if(m_directories, [&](const Directory& d) { return d.wd == event.wd; });
+            if (dir == m_directories.end())
+                continue;
+            // the directory was removed, along with its watch
+            if (event.mask & IN_IGNORED)
+                dir->wd = -1;
+            else if (event.len != 0)
+            {
+                StringView name = event.name;
+                if (find_file(dir->files, name) != dir->files.end())
+                    add_changed(*dir, name);
+            }
+        }
+    }
+#endif
+    return changed;
+}
+
+void FileWatcher::read_events()
+{
+    auto changed = read_changes();
+    if (ClientManager::has_instance())
+    {
+        for (auto& filename : changed)
+            ClientManager::instance().schedule_fs_check(filename);
+    }
+}
+
+}
@@ -0,0 +1,54 @@
+#ifndef file_watcher_hh_INCLUDED
+#define file_watcher_hh_INCLUDED
+
+#include "event_manager.hh"
+#include "string.hh"
+#include "utils.hh"
+#include "vector.hh"
+
+namespace Kakoune
+{
+
+// Watches buffer files for external modifications with inotify, clients
+// displaying a modified file are asked to check it right away.
+//
+// Directories are watched rather than files, with a single watch for all
+// the files of a directory. That way a file replaced by a rename, or
+// deleted and created again, is still followed.
+//
+// Where inotify is not available, the watcher is inactive and clients
+// periodically check the timestamp of their buffer file instead.
+class FileWatcher : public Singleton<FileWatcher>
+{
+public:
+    FileWatcher();
+    ~FileWatcher();
+
+    bool active() const { return m_watcher.fd() != -1; }
+
+    // files are reference counted, so that watching is per buffer
+    void watch(StringView filename);
+    void unwatch(StringView filename);
+
+    size_t directory_count() const { return m_directories.size(); }
+
+    // consumes the pending events, returns the watched files they concern
+    Vector<String> read_changes();
+
+private:
+    void read_events();
+
+    struct Directory
+    {
+        int wd;
+        String path;
+        // names of the watched files, with their watch count
+        Vector<std::pair<String, int>> files;
+    };
+    Vector<Directory> m_directories;
+    FDWatcher m_watcher;
+};
+
+}
+
+#endif // file_watcher_hh_INCLUDED
@@ -15,6 +15,7 @@
 #include "utf8.hh"
 #include "utf8_iterator.hh"
 
+#include <bitset>
 #include <sstream>
 #include <locale>
 
@@ -301,16 +302,18 @@ private:
 
         cache.m_matches.clear();
 
-        using RegexIt = RegexIterator<BufferIterator>;
-        RegexIt re_it{buffer.iterator_at(cache.m_range.first),
-                      buffer.iterator_at(cache.m_range.second+1), m_regex};
+        ChunkedBufferRange content{
+            buffer, buffer.iterator_at(cache.m_range.first).coord(),
+            buffer.iterator_at(cache.m_range.second+1).coord()};
+        using RegexIt = RegexIterator<ChunkedBufferRange::iterator>;
+        RegexIt re_it{content.begin(), content.end(), m_regex};
         RegexIt re_end;
         for (; re_it != re_end; ++re_it)
         {
             cache.m_matches.emplace_back();
             auto& match = cache.m_matches.back();
             for (auto& sub : *re_it)
-                match.emplace_back(sub.first.coord(), sub.second.coord());
+                match.emplace_back(content.coord(sub.first), content.coord(sub.second));
         }
         return cache;
     }
@@ -373,7 +376,7 @@ HighlighterAndId create_search_highlighter(HighlighterParameters params)
             auto s = Context().main_sel_register_value("/");
             try
             {
-                return s.empty() ? Regex{} : Regex{s.begin(), s.end()};
+                return s.empty() ? Regex{} : cached_regex(s);
             }
             catch (RegexError& err)
             {
@@ -718,80 +721,117 @@ struct RegexMatch
 };
 using RegexMatchList = Vector<RegexMatch, MemoryDomain::Highlight>;
 
-void find_matches(const Buffer& buffer, RegexMatchList& matches, const Regex& regex)
+// Distinct regexes used by the regions, each line is searched for them
+// in turn. A line is only searched for a regex if it contains all the
+// bytes required by it.
+struct RegionPatterns
 {
-    const size_t buf_timestamp = buffer.timestamp();
-    for (auto line = 0_line, end = buffer.line_count(); line < end; ++line)
+    Vector<Regex, MemoryDomain::Highlight> regexes;
+    Vector<String, MemoryDomain::Highlight> required;
+
+    size_t add(Regex regex)
     {
-        auto l = buffer[line];
-        for (RegexIterator<const char*> it{l.begin(), l.end(), regex}, end{}; it != end; ++it)
-        {
-            ByteCount b = (int)((*it)[0].first - l.begin());
-            ByteCount e = (int)((*it)[0].second - l.begin());
-            matches.push_back({ buf_timestamp, line, b, e });
-        }
+        auto it = find(regexes, regex);
+        if (it != regexes.end())
+            return it - regexes.begin();
+
+        required.push_back(required_bytes(regex));
+        regexes.push_back(std::move(regex));
+        return regexes.size() - 1;
     }
-}
 
-void update_matches(const Buffer& buffer, ArrayView<LineModification> modifs,
-                    RegexMatchList& matches, const Regex& regex)
-{
-    const size_t buf_timestamp = buffer.timestamp();
-    // remove out of date matches and update line for others
-    auto ins_pos = matches.begin();
-    for (auto it = ins_pos; it != matches.end(); ++it)
+    void find_line_matches(const Buffer& buffer, LineCount line,
+                           Vector<RegexMatchList, MemoryDomain::Highlight>& matches) const
     {
-        auto modif_it = std::upper_bound(modifs.begin(), modifs.end(), it->line,
-                                         [](const LineCount& l, const LineModification& c)
-                                         { return l < c.old_line; });
+        const size_t buf_timestamp = buffer.timestamp();
+        auto l = buffer[line];
 
-        if (modif_it != modifs.begin())
+        std::bitset<256> present;
+        for (auto c : l)
+            present.set((unsigned char)c);
+
+        for (size_t i = 0; i < regexes.size(); ++i)
         {
-            auto& prev = *(modif_it-1);
-            if (it->line < prev.old_line + prev.num_removed)
-                continue; // match removed
+            if (not std::all_of(required[i].begin(), required[i].end(),
+                                [&](char c) { return present[(unsigned char)c]; }))
+                continue;
 
-            it->line += prev.diff();
+            for (RegexIterator<const char*> it{l.begin(), l.end(), regexes[i]}, end{}; it != end; ++it)
+            {
+                ByteCount b = (int)((*it)[0].first - l.begin());
+                ByteCount e = (int)((*it)[0].second - l.begin());
+                matches[i].push_back({ buf_timestamp, line, b, e });
+            }
         }
+    }
 
-        it->timestamp = buf_timestamp;
-        kak_assert(buffer.is_valid(it->begin_coord()) or
-                   buffer[it->line].length() == it->begin);
-        kak_assert(buffer.is_valid(it->end_coord()) or
-                   buffer[it->line].length() == it->end);
-
-        if (ins_pos != it)
-            *ins_pos = std::move(*it);
-        ++ins_pos;
+    void find_matches(const Buffer& buffer,
+                      Vector<RegexMatchList, MemoryDomain::Highlight>& matches) const
+    {
+        matches.clear();
+        matches.resize(regexes.size());
+        for (auto line = 0_line, end = buffer.line_count(); line < end; ++line)
+            find_line_matches(buffer, line, matches);
     }
-    matches.erase(ins_pos, matches.end());
-    size_t pivot = matches.size();
 
-    // try to find new matches in each updated lines
-    for (auto& modif : modifs)
+    void update_matches(const Buffer& buffer, ArrayView<LineModification> modifs,
+                        Vector<RegexMatchList, MemoryDomain::Highlight>& matches) const
     {
-        for (auto line = modif.new_line; line < modif.new_line + modif.num_added; ++line)
+        const size_t buf_timestamp = buffer.timestamp();
+        Vector<size_t, MemoryDomain::Highlight> pivots;
+        for (auto& list : matches)
         {
-            auto l = buffer[line];
-            for (RegexIterator<const char*> it{l.begin(), l.end(), regex}, end{}; it != end; ++it)
+            // remove out of date matches and update line for others
+            auto ins_pos = list.begin();
+            for (auto it = ins_pos; it != list.end(); ++it)
             {
-                ByteCount b = (int)((*it)[0].first - l.begin());
-                ByteCount e = (int)((*it)[0].second - l.begin());
-                matches.push_back({ buf_timestamp, line, b, e });
+                auto modif_it = std::upper_bound(modifs.begin(), modifs.end(), it->line,
+                                                 [](const LineCount& l, const LineModification& c)
+                                                 { return l < c.old_line; });
+
+                if (modif_it != modifs.begin())
+                {
+                    auto& prev = *(modif_it-1);
+                    if (it->line < prev.old_line + prev.num_removed)
+                        continue; // match removed
+
+                    it->line += prev.diff();
+                }
+
+                it->timestamp = buf_timestamp;
+                kak_assert(buffer.is_valid(it->begin_coord()) or
+                           buffer[it->line].length() == it->begin);
+                kak_assert(buffer.is_valid(it->end_coord()) or
+                           buffer[it->line].length() == it->end);
+
+                if (ins_pos != it)
+                    *ins_pos = std::move(*it);
+                ++ins_pos;
             }
+            list.erase(ins_pos, list.end());
+            pivots.push_back(list.size());
         }
+
+        // try to find new matches in each updated lines
+        for (auto& modif : modifs)
+        {
+            for (auto line = modif.new_line; line < modif.new_line + modif.num_added; ++line)
+                find_line_matches(buffer, line, matches);
+        }
+
+        for (size_t i = 0; i < matches.size(); ++i)
+            std::inplace_merge(matches[i].begin(), matches[i].begin() + pivots[i], matches[i].end(),
+                               [](const RegexMatch& lhs, const RegexMatch& rhs) {
+                                   return lhs.begin_coord() < rhs.begin_coord();
+                               });
     }
-    std::inplace_merge(matches.begin(), matches.begin() + pivot, matches.end(),
-                       [](const RegexMatch& lhs, const RegexMatch& rhs) {
-                           return lhs.begin_coord() < rhs.begin_coord();
-                       });
-}
+};
 
 struct RegionMatches
 {
-    RegexMatchList begin_matches;
-    RegexMatchList end_matches;
-    RegexMatchList recurse_matches;
+    const RegexMatchList& begin_matches;
+    const RegexMatchList& end_matches;
+    const RegexMatchList& recurse_matches;
 
     static bool compare_to_begin(const RegexMatch& lhs, ByteCoord rhs)
     {
@@ -835,50 +875,39 @@ struct RegionMatches
     }
 };
 
+// Indices of the region regexes in the highlighter RegionPatterns
 struct RegionDesc
 {
-    Regex m_begin;
-    Regex m_end;
-    Regex m_recurse;
+    static constexpr size_t no_recurse = (size_t)-1;
 
-    RegionMatches find_matches(const Buffer& buffer) const
-    {
-        RegionMatches res;
-        Kakoune::find_matches(buffer, res.begin_matches, m_begin);
-        Kakoune::find_matches(buffer, res.end_matches, m_end);
-        if (not m_recurse.empty())
-            Kakoune::find_matches(buffer, res.recurse_matches, m_recurse);
-        return res;
-    }
+    size_t m_begin;
+    size_t m_end;
+    size_t m_recurse;
 
-    void update_matches(const Buffer& buffer,
-                        ArrayView<LineModification> modifs,
-                        RegionMatches& matches) const
+    RegionMatches matches(const Vector<RegexMatchList, MemoryDomain::Highlight>& pattern_matches) const
     {
-        Kakoune::update_matches(buffer, modifs, matches.begin_matches, m_begin);
-        Kakoune::update_matches(buffer, modifs, matches.end_matches, m_end);
-        if (not m_recurse.empty())
-            Kakoune::update_matches(buffer, modifs, matches.recurse_matches, m_recurse);
+        static const RegexMatchList no_matches;
+        return { pattern_matches[m_begin], pattern_matches[m_end],
+                 m_recurse != no_recurse ? pattern_matches[m_recurse] : no_matches };
     }
 };
+constexpr size_t RegionDesc::no_recurse;
 
 struct RegionsHighlighter : public Highlighter
 {
 public:
     using NamedRegionDescList = Vector<std::pair<String, RegionDesc>, MemoryDomain::Highlight>;
 
-    RegionsHighlighter(NamedRegionDescList regions, String default_group)
-        : m_regions{std::move(regions)}, m_default_group{std::move(default_group)}
+    RegionsHighlighter(NamedRegionDescList regions, RegionPatterns patterns,
+                       String default_group)
+        : m_regions{std::move(regions)}, m_patterns{std::move(patterns)},
+          m_default_group{std::move(default_group)}
     {
         if (m_regions.empty())
             throw runtime_error("at least one region must be defined");
 
         for (auto& region : m_regions)
-        {
             m_groups.append({region.first, HighlighterGroup{}});
-            if (region.second.m_begin.empty() or region.second.m_end.empty())
-                throw runtime_error("invalid regex for region highlighter");
-        }
         if (not m_default_group.empty())
             m_groups.append({m_default_group, HighlighterGroup{}});
     }
@@ -971,6 +1000,7 @@ public:
                 throw runtime_error("wrong parameter count, expect <id> (<group name> <begin> <end> <recurse>)+");
 
             RegionsHighlighter::NamedRegionDescList regions;
+            RegionPatterns patterns;
             for (size_t i = 1; i < parser.positional_count(); i += 4)
             {
                 if (parser[i].empty() or parser[i+1].empty() or parser[i+2].empty())
@@ -982,13 +1012,21 @@ public:
                 if (not parser[i+3].empty())
                     recurse = Regex{parser[i+3], Regex::nosubs | Regex::optimize };
 
-                regions.push_back({ parser[i], {std::move(begin), std::move(end), std::move(recurse)} });
+                if (begin.empty() or end.empty())
+                    throw runtime_error("invalid regex for region highlighter");
+
+                RegionDesc desc{ patterns.add(std::move(begin)),
+                                 patterns.add(std::move(end)),
+                                 recurse.empty() ? RegionDesc::no_recurse
+                                                 : patterns.add(std::move(recurse)) };
+                regions.push_back({ parser[i], desc });
             }
             String default_group;
             if (parser.has_option("default"))
                 default_group = parser.option_value("default");
 
             return {parser[0], make_unique<RegionsHighlighter>(std::move(regions),
+                                                               std::move(patterns),
                                                                std::move(default_group))};
         }
         catch (RegexError& err)
@@ -999,6 +1037,7 @@ public:
 
 private:
     const NamedRegionDescList m_regions;
+    const RegionPatterns m_patterns;
     const String m_default_group;
     IdMap<HighlighterGroup, MemoryDomain::Highlight> m_groups;
 
@@ -1012,24 +1051,29 @@ private:
 
     struct Cache
     {
-        size_t timestamp = 0;
-        Vector<RegionMatches, MemoryDomain::Highlight> matches;
+        ChangeTimestamp timestamp;
+        Vector<RegexMatchList, MemoryDomain::Highlight> matches;
         UnorderedMap<BufferRange, RegionList, MemoryDomain::Highlight> regions;
     };
     BufferSideCache<Cache> m_cache;
 
     using RegionAndMatch = std::pair<size_t, RegexMatchList::const_iterator>;
 
+    RegionMatches region_matches(const Cache& cache, size_t index) const
+    {
+        return m_regions[index].second.matches(cache.matches);
+    }
+
     // find the begin closest to pos in all matches
     RegionAndMatch find_next_begin(const Cache& cache, ByteCoord pos) const
     {
-        RegionAndMatch res{0, cache.matches[0].find_next_begin(pos)};
-        for (size_t i = 1; i < cache.matches.size(); ++i)
+        RegionAndMatch res{0, region_matches(cache, 0).find_next_begin(pos)};
+        for (size_t i = 1; i < m_regions.size(); ++i)
         {
-            const auto& matches = cache.matches[i];
+            auto matches = region_matches(cache, i);
             auto it = matches.find_next_begin(pos);
             if (it != matches.begin_matches.end() and
-                (res.second == cache.matches[res.first].begin_matches.end() or
+                (res.second == region_matches(cache, res.first).begin_matches.end() or
                  it->begin_coord() < res.second->begin_coord()))
                 res = RegionAndMatch{i, it};
         }
@@ -1042,17 +1086,13 @@ private:
         const size_t buf_timestamp = buffer.timestamp();
         if (cache.timestamp != buf_timestamp)
         {
-            if (cache.timestamp == 0)
-            {
-                cache.matches.resize(m_regions.size());
-                for (size_t i = 0; i < m_regions.size(); ++i)
-                    cache.matches[i] = m_regions[i].second.find_matches(buffer);
-            }
+            if (cache.timestamp == 0 or
+                not buffer.changes_available_since(cache.timestamp))
+                m_patterns.find_matches(buffer, cache.matches);
             else
             {
                 auto modifs = compute_line_modifications(buffer, cache.timestamp);
-                for (size_t i = 0; i < m_regions.size(); ++i)
-                    m_regions[i].second.update_matches(buffer, modifs, cache.matches[i]);
+                m_patterns.update_matches(buffer, modifs, cache.matches);
             }
 
             cache.regions.clear();
@@ -1065,10 +1105,10 @@ private:
         RegionList& regions = cache.regions[range];
 
         for (auto begin = find_next_begin(cache, range.first),
-                  end = RegionAndMatch{ 0, cache.matches[0].begin_matches.end() };
+                  end = RegionAndMatch{ 0, region_matches(cache, 0).begin_matches.end() };
              begin != end; )
         {
-            const RegionMatches& matches = cache.matches[begin.first];
+            auto matches = region_matches(cache, begin.first);
             auto& named_region = m_regions[begin.first];
             auto beg_it = begin.second;
             auto end_it = matches.find_matching_end(beg_it->end_coord());
@@ -1099,7 +1139,7 @@ private:
                 begin = find_next_begin(cache, end_coord);
             }
         }
-        cache.timestamp = buf_timestamp;
+        cache.timestamp.reset(buffer, buf_timestamp);
         return regions;
     }
 };
@@ -47,7 +47,6 @@ namespace InputModes
 {
 
 static constexpr std::chrono::milliseconds idle_timeout{50};
-static constexpr std::chrono::milliseconds fs_check_timeout{500};
 
 class Normal : public InputMode
 {
@@ -58,14 +57,6 @@ public:
                        context().flags() & Context::Flags::Transient ?
                            Timer::Callback() : Timer::Callback([this](Timer& timer) {
               context().hooks().run_hook("NormalIdle", "", context());
-          })},
-          m_fs_check_timer{Clock::now() + fs_check_timeout,
-                           context().flags() & Context::Flags::Transient ?
-                            Timer::Callback() : Timer::Callback([this](Timer& timer) {
-              if (not context().has_client())
-                  return;
-              context().client().check_buffer_fs_timestamp();
-              timer.set_next_date(Clock::now() + fs_check_timeout);
           })}
     {}
 
@@ -75,7 +66,7 @@ public:
             return;
         // Do not check buffer timestamp, we might already be executing the
         // on next key of a buffer timestamp check.
-        m_fs_check_timer.set_next_date(Clock::now() + fs_check_timeout);
+        context().client().postpone_fs_check();
 
         context().hooks().run_hook("NormalBegin", "", context());
     }
@@ -164,7 +155,6 @@ private:
     bool m_hooks_disabled = false;
     bool m_waiting_for_reg = false;
     Timer m_idle_timer;
-    Timer m_fs_check_timer;
 };
 
 template<WordType word_type>
@@ -413,7 +403,7 @@ public:
             m_filter_editor.handle_key(key);
 
             auto search = ".*" + m_filter_editor.line() + ".*";
-            m_filter = Regex(search.begin(), search.end());
+            m_filter = cached_regex(search);
             auto it = std::find_if(m_selected, m_choices.end(), match_filter);
             if (it == m_choices.end())
                 it = std::find_if(m_choices.begin(), m_selected, match_filter);
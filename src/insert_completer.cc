@@ -188,6 +188,9 @@ InsertCompletion complete_option(const Buffer& buffer, ByteCoord cursor_pos,
             end = buffer.advance(coord, len);
         }
         size_t timestamp = (size_t)str_to_int(match[4].str());
+        if (not buffer.changes_available_since(timestamp) or
+            timestamp > buffer.timestamp())
+            return {};
         auto changes = buffer.changes_since(timestamp);
         if (find_if(changes, [&](const Buffer::Change& change){
                         return change.begin < coord;
@@ -0,0 +1,322 @@
+#include "journal.hh"
+
+#include "assert.hh"
+#include "compression.hh"
+#include "debug.hh"
+#include "event_manager.hh"
+#include "exception.hh"
+#include "file.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Kakoune
+{
+
+// Journals start with a magic string followed by the size and modification
+// time of the file the records apply to, as native 64 bits values. Records
+// are a type byte followed by the varint encoded coord and length, and the
+// content for insertions.
+static constexpr StringView journal_magic = { "KAKJRNL1", 8 };
+static constexpr size_t header_size = 8 + 3 * sizeof(int64_t);
+static constexpr size_t max_pending_size = 64 * 1024;
+static constexpr auto sync_delay = std::chrono::seconds{1};
+
+static String journal_header(StringView filename)
+{
+    int64_t values[3] = { -1, 0, 0 };
+    struct stat st;
+    if (stat(filename.zstr(), &st) == 0)
+    {
+        values[0] = st.st_size;
+        values[1] = st.st_mtim.tv_sec;
+        values[2] = st.st_mtim.tv_nsec;
+    }
+    String res = journal_magic.str();
+    res.stdstr().append(reinterpret_cast<const char*>(values), sizeof(values));
+    return res;
+}
+
+static bool write_data(int fd, StringView data)
+{
+    const char* ptr = data.data();
+    size_t count = (int)data.length();
+    while (count)
+    {
+        ssize_t written = ::write(fd, ptr, count);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        ptr += written;
+        count -= written;
+    }
+    return true;
+}
+
+Journal::Journal() = default;
+
+Journal::~Journal()
+{
+    disable();
+}
+
+void Journal::enable(StringView filename)
+{
+    if (enabled())
+        return;
+
+    m_filename = filename.str();
+    m_path = hidden_file_path(filename, ".kak.journal");
+    struct stat st;
+    m_stale = stat(m_path.c_str(), &st) == 0;
+    m_suspended = m_stale;
+    m_file_position = m_position;
+}
+
+void Journal::disable()
+{
+    close(true);
+    m_filename = m_path = m_stale_path = String{};
+    m_suspended = m_stale = false;
+}
+
+void Journal::suspend()
+{
+    close(true);
+    m_suspended = true;
+    m_file_position = m_position;
+}
+
+void Journal::insert(ByteCoord coord, StringView content)
+{
+    append(Record::Insert, coord, content.length());
+    if (not m_suspended)
+    {
+        m_pending += content;
+        m_position += (int)content.length();
+        if ((size_t)(int)m_pending.length() >= max_pending_size)
+            flush();
+    }
+}
+
+void Journal::erase(ByteCoord coord, ByteCount length)
+{
+    append(Record::Erase, coord, length);
+}
+
+void Journal::append(Record::Type type, ByteCoord coord, ByteCount length)
+{
+    kak_assert(enabled());
+    if (m_suspended)
+    {
+        ++m_position;
+        return;
+    }
+    if (m_fd == -1 and not open())
+        return;
+
+    const size_t size = (int)m_pending.length();
+    m_pending += (char)type;
+    write_varint(m_pending, (int)coord.line);
+    write_varint(m_pending, (int)coord.column);
+    write_varint(m_pending, (int)length);
+    m_position += (int)m_pending.length() - size;
+}
+
+bool Journal::open()
+{
+    m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (m_fd == -1 or not write_data(m_fd, journal_header(m_filename)))
+    {
+        const int error = errno;
+        suspend();
+        write_debug("could not create journal " + m_path + ": " + strerror(error));
+        return false;
+    }
+    m_file_position = m_position;
+    return true;
+}
+
+void Journal::close(bool remove)
+{
+    m_pending = String{};
+    if (m_fd == -1)
+        return;
+
+    ::close(m_fd);
+    m_fd = -1;
+    if (remove)
+        unlink(m_path.c_str());
+}
+
+size_t Journal::file_offset(size_t position) const
+{
+    kak_assert(position >= m_file_position);
+    return header_size + position - m_file_position;
+}
+
+void Journal::flush()
+{
+    if (m_fd == -1 or m_pending.empty())
+        return;
+
+    if (not write_data(m_fd, m_pending))
+    {
+        const int error = errno;
+        suspend();
+        write_debug("could not write journal " + m_path + ": " + strerror(error));
+        return;
+    }
+    m_pending = String{};
+    schedule_sync();
+}
+
+void Journal::schedule_sync()
+{
+    if (not EventManager::has_instance())
+        return;
+
+    if (not m_sync_timer)
+        m_sync_timer.reset(new Timer{TimePoint::max(), [this](Timer&) {
+            if (m_fd != -1)
+                fdatasync(m_fd);
+        }});
+    if (m_sync_timer->next_date() == TimePoint::max())
+        m_sync_timer->set_next_date(Clock::now() + sync_delay);
+}
+
+void Journal::saved(size_t position)
+{
+    if (not enabled())
+        return;
+
+    if (m_suspended)
+    {
+        // a stale journal does not apply to the saved file anymore, but
+        // its edits were never recovered, keep it aside.
+        if (m_stale)
+        {
+            String stale_path = m_path + ".orig";
+            for (int i = 1; access(stale_path.c_str(), F_OK) == 0; ++i)
+                stale_path = m_path + ".orig." + to_string(i);
+            if (rename(m_path.c_str(), stale_path.c_str()) != 0)
+            {
+                write_debug("could not move stale journal " + m_path + ": " + strerror(errno));
+                return;
+            }
+            m_stale_path = std::move(stale_path);
+        }
+        m_stale = false;
+        if (position == m_position)
+        {
+            m_suspended = false;
+            m_file_position = m_position;
+        }
+        return;
+    }
+
+    // the journal was restarted from a later state
+    if (position < m_file_position)
+        return;
+
+    flush();
+    if (position == m_position)
+    {
+        close(true);
+        m_file_position = m_position;
+        return;
+    }
+
+    // edits were made after the saved state, restart the journal with them
+    kak_assert(m_fd != -1);
+    String records;
+    const size_t begin = file_offset(position);
+    const size_t size = file_offset(m_position) - begin;
+    records.resize(size);
+    const String tmp_path = m_path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1 or pread(m_fd, &records.stdstr()[0], size, begin) != (ssize_t)size or
+        not write_data(fd, journal_header(m_filename)) or not write_data(fd, records) or
+        rename(tmp_path.c_str(), m_path.c_str()) != 0)
+    {
+        const int error = errno;
+        if (fd != -1)
+        {
+            ::close(fd);
+            unlink(tmp_path.c_str());
+        }
+        suspend();
+        write_debug("could not restart journal " + m_path + ": " + strerror(error));
+        return;
+    }
+    ::close(m_fd);
+    m_fd = fd;
+    m_file_position = position;
+}
+
+Vector<Journal::Record> Journal::read_stale(String& data) const
+{
+    kak_assert(m_stale);
+    data = read_file(m_path);
+    if (data.substr(0, journal_magic.length()) != journal_magic or
+        (size_t)(int)data.length() < header_size)
+        throw runtime_error("invalid journal " + m_path);
+    if (data.substr(0_byte, (int)header_size) != journal_header(m_filename))
+        throw runtime_error("journal " + m_path + " does not apply to the current file");
+
+    Vector<Record> records;
+    const char* pos = data.data() + header_size;
+    const char* end = data.data() + (int)data.length();
+    try
+    {
+        while (pos != end)
+        {
+            const auto type = (Record::Type)*pos++;
+            if (type != Record::Insert and type != Record::Erase)
+                break;
+            const LineCount line = (int)read_varint(pos, end);
+            const ByteCount column = (int)read_varint(pos, end);
+            const ByteCount length = (int)read_varint(pos, end);
+            StringView content;
+            if (type == Record::Insert)
+            {
+                if ((int)length > end - pos)
+                    break;
+                content = {pos, pos + (int)length};
+                pos += (int)length;
+            }
+            records.push_back({type, {line, column}, length, content,
+                               (size_t)(pos - data.data())});
+        }
+    }
+    catch (runtime_error&) {} // incomplete last record
+
+    return records;
+}
+
+void Journal::resume(size_t offset)
+{
+    kak_assert(m_stale);
+    offset = std::max(offset, header_size);
+    m_fd = ::open(m_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    if (m_fd == -1 or ftruncate(m_fd, offset) != 0)
+    {
+        const int error = errno;
+        if (m_fd != -1)
+            ::close(m_fd);
+        m_fd = -1;
+        write_debug("could not resume journal " + m_path + ": " + strerror(error));
+        return;
+    }
+    m_stale = m_suspended = false;
+    m_position += offset - header_size;
+    m_file_position = m_position - (offset - header_size);
+}
+
+}
@@ -0,0 +1,99 @@
+#ifndef journal_hh_INCLUDED
+#define journal_hh_INCLUDED
+
+#include "coord.hh"
+#include "string.hh"
+#include "vector.hh"
+
+#include <memory>
+
+namespace Kakoune
+{
+
+class Timer;
+
+// Append only log of the edits made to a file buffer since it was last
+// saved, kept next to the file so that unsaved edits can be recovered
+// after a crash. Records are buffered and written once per main loop
+// iteration, and synced to disk in batches.
+//
+// The journal file is created on the first edit, and removed when the
+// buffer is saved or closed. A journal left by a previous session is
+// never overwritten nor removed: journaling is suspended until it is
+// recovered, or until the buffer is saved, which moves it aside to a
+// .orig file.
+class Journal
+{
+public:
+    struct Record
+    {
+        enum Type : char { Insert, Erase };
+        Type type;
+        ByteCoord coord;
+        ByteCount length;
+        // inserted content
+        StringView content;
+        // offset following the record in the journal data
+        size_t end;
+    };
+
+    Journal();
+    ~Journal();
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    void enable(StringView filename);
+    void disable();
+    // edits no longer apply to the file, wait for the next save
+    void suspend();
+
+    bool enabled() const { return not m_path.empty(); }
+    bool recording() const { return enabled() and not m_suspended; }
+    bool stale() const { return m_stale; }
+    // where the stale journal was moved when the buffer got saved
+    const String& stale_path() const { return m_stale_path; }
+
+    void insert(ByteCoord coord, StringView content);
+    void erase(ByteCoord coord, ByteCount length);
+
+    // write buffered records
+    void flush();
+
+    // position following the last record
+    size_t position() const { return m_position; }
+    // the file was saved with the content the buffer had at position
+    void saved(size_t position);
+
+    // read the stale journal in data, throws if it does not apply to the
+    // current file. Reading stops at the first incomplete record.
+    Vector<Record> read_stale(String& data) const;
+    // continue journaling after the records of the stale journal up to
+    // offset were replayed
+    void resume(size_t offset);
+
+private:
+    void append(Record::Type type, ByteCoord coord, ByteCount length);
+    bool open();
+    void close(bool remove);
+    size_t file_offset(size_t position) const;
+    void schedule_sync();
+
+    String m_filename;
+    String m_path;
+    String m_stale_path;
+    int    m_fd = -1;
+    bool   m_suspended = false;
+    bool   m_stale = false;
+
+    // positions only grow, m_file_position is the position of the first
+    // record in the journal file.
+    size_t m_position = 0;
+    size_t m_file_position = 0;
+    String m_pending;
+
+    std::unique_ptr<Timer> m_sync_timer;
+};
+
+}
+
+#endif // journal_hh_INCLUDED
@@ -0,0 +1,673 @@
+#include "line_list.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Kakoune
+{
+
+PackedLines::PackedLines(size_t capacity)
+    : data((char*)::operator new(capacity)), capacity(capacity)
+{
+    on_alloc(MemoryDomain::BufferContent, capacity);
+}
+
+PackedLines::~PackedLines()
+{
+    on_dealloc(MemoryDomain::BufferContent, capacity);
+    ::operator delete(data);
+}
+
+template<typename Iterator>
+static size_t count_bytes(Iterator begin, Iterator end)
+{
+    size_t bytes = 0;
+    for (auto it = begin; it != end; ++it)
+        bytes += (*it)->length;
+    return bytes;
+}
+
+template<typename Iterator>
+static LineList::Block make_block(Iterator begin, Iterator end)
+{
+    LineList::Block block;
+    block.lines.assign(std::make_move_iterator(begin), std::make_move_iterator(end));
+    block.bytes = count_bytes(block.lines.begin(), block.lines.end());
+    return block;
+}
+
+size_t LineList::Block::line_offset(size_t index) const
+{
+    if (data)
+        return starts[index];
+
+    if (offsets.size() != lines.size())
+    {
+        offsets.resize(lines.size());
+        size_t offset = 0;
+        for (size_t i = 0; i < lines.size(); ++i)
+        {
+            offsets[i] = offset;
+            offset += lines[i]->length;
+        }
+    }
+    return offsets[index];
+}
+
+size_t LineList::Block::line_containing(size_t offset) const
+{
+    kak_assert(offset < bytes);
+    if (data)
+        return std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+
+    line_offset(0); // ensure offsets are computed
+    return std::upper_bound(offsets.begin(), offsets.end(), offset) - offsets.begin() - 1;
+}
+
+void LineList::assign(BufferLines lines)
+{
+    m_loaded_data.clear();
+    const int size = (int)lines.size();
+    BlockList blocks;
+    if (size <= max_block_size)
+    {
+        if (size != 0)
+        {
+            blocks.emplace_back();
+            blocks.back().bytes = count_bytes(lines.begin(), lines.end());
+            blocks.back().lines = std::move(lines);
+        }
+    }
+    else
+    {
+        const int count = (size + target_block_size - 1) / target_block_size;
+        blocks.reserve(count);
+        for (int i = 0; i < count; ++i)
+            blocks.push_back(make_block(lines.begin() + (size_t)size * i / count,
+                                        lines.begin() + (size_t)size * (i+1) / count));
+    }
+    spread(std::move(blocks));
+}
+
+void LineList::replace(LineCount first_line, LineCount last_line, BufferLines lines)
+{
+    const int first = (int)first_line;
+    const int last = (int)last_line;
+    kak_assert(0 <= first and first <= last and last <= m_size);
+    m_loaded_data.clear();
+
+    if (m_size == 0)
+        return assign(std::move(lines));
+
+    // appended lines go at the end of the last block
+    locate(std::min(first, m_size - 1));
+    const int block = m_cache_block;
+    const int start = m_cache_start;
+    const int block_end = start + m_cache_count;
+
+    const bool spans_blocks = last > block_end;
+    if (spans_blocks)
+    {
+        // drop the fully replaced blocks and trim the last one, the first
+        // one is truncated below.
+        locate(last - 1);
+        const int last_block = m_cache_block;
+        const int tail_start = m_cache_start;
+
+        Vector<int, MemoryDomain::BufferMeta> dropped;
+        for (int line = block_end; line < tail_start; line += m_cache_count)
+        {
+            locate(line);
+            dropped.push_back(m_cache_block);
+        }
+        for (auto slot : dropped)
+            take_block(slot);
+
+        auto& tail = m_blocks[last_block];
+        load(tail);
+        auto tail_end = tail.lines.begin() + (last - tail_start);
+        const size_t tail_bytes = count_bytes(tail.lines.begin(), tail_end);
+        tail.lines.erase(tail.lines.begin(), tail_end);
+        tail.bytes -= tail_bytes;
+        tail.offsets.clear();
+        tail.hot = true;
+        block_changed(last_block, -(last - tail_start), -(ptrdiff_t)tail_bytes);
+    }
+
+    auto& first_block = m_blocks[block];
+    load(first_block);
+    first_block.hot = true;
+    first_block.offsets.clear();
+    auto& block_lines = first_block.lines;
+    auto pos = block_lines.begin() + (first - start);
+    const int removed = std::min(last, block_end) - first;
+    const int added = (int)lines.size();
+    const size_t removed_bytes = count_bytes(pos, pos + removed);
+    const size_t added_bytes = count_bytes(lines.begin(), lines.end());
+    const int common = std::min(removed, added);
+    std::move(lines.begin(), lines.begin() + common, pos);
+    if (removed > common)
+        block_lines.erase(pos + common, pos + removed);
+    else
+        block_lines.insert(pos + common,
+                           std::make_move_iterator(lines.begin() + common),
+                           std::make_move_iterator(lines.end()));
+    first_block.bytes += added_bytes - removed_bytes;
+    block_changed(block, added - removed, (ptrdiff_t)added_bytes - (ptrdiff_t)removed_bytes);
+
+    const int size = (int)m_blocks[block].size();
+    if (spans_blocks or size > max_block_size or size == 0 or
+        (size < min_block_size and m_block_count > 1))
+        normalize(block, start);
+}
+
+void LineList::append_packed(ref_ptr<LineData> data, StringView content,
+                             BufferLines tail)
+{
+    m_loaded_data.clear();
+    BlockList blocks;
+    const char* pos = content.begin();
+    while (pos != content.end())
+    {
+        Block block;
+        block.data = data;
+        block.content = pos;
+        block.starts.reserve(target_block_size);
+        // keep block size addressable by its 32 bits line starts
+        const size_t max_bytes = std::min<size_t>(content.end() - pos, UINT32_MAX);
+        while (block.starts.size() < target_block_size and
+               (size_t)(pos - block.content) < max_bytes)
+        {
+            block.starts.push_back((uint32_t)(pos - block.content));
+            pos = (const char*)memchr(pos, '\n', content.end() - pos);
+            kak_assert(pos != nullptr);
+            ++pos;
+        }
+        block.bytes = pos - block.content;
+        blocks.push_back(std::move(block));
+    }
+    if (not tail.empty())
+        blocks.push_back(make_block(tail.begin(), tail.end()));
+
+    int end = 0;
+    if (m_size != 0)
+    {
+        locate(m_size - 1);
+        end = m_cache_block + 1;
+    }
+    place_blocks(end, end, std::move(blocks));
+}
+
+void LineList::load_all()
+{
+    m_loaded_data.clear();
+    for (auto& block : m_blocks)
+    {
+        if (block.data and not block.data->owned())
+            pack_block(block);
+    }
+}
+
+void LineList::load_truncated()
+{
+    m_loaded_data.clear();
+    for (auto& block : m_blocks)
+    {
+        if (block.data and block.data->truncated())
+            pack_block(block);
+    }
+}
+
+void LineList::pack()
+{
+    m_loaded_data.clear();
+    for (auto& block : m_blocks)
+    {
+        if (block.data or block.size() == 0)
+            continue;
+        if (block.hot)
+        {
+            block.hot = false;
+            continue;
+        }
+        // shared storages would stay alive, packing would use more memory
+        if (block.bytes <= UINT32_MAX and
+            std::all_of(block.lines.begin(), block.lines.end(),
+                        [](const ref_ptr<StringStorage>& line) { return line->refcount == 1; }))
+            pack_block(block);
+    }
+}
+
+// copy the block lines to a new PackedLines
+void LineList::pack_block(Block& block)
+{
+    kak_assert(block.bytes <= UINT32_MAX);
+    const bool truncated = block.data and block.data->truncated();
+    PackedLines* packed = new PackedLines{block.bytes};
+    ref_ptr<LineData> data = packed;
+    Vector<uint32_t, MemoryDomain::BufferMeta> starts;
+    starts.reserve(block.size());
+    char* pos = packed->data;
+    for (size_t i = 0; i < block.size(); ++i)
+    {
+        const StringView line = block[i];
+        starts.push_back((uint32_t)(pos - packed->data));
+        memcpy(pos, line.data(), (int)line.length());
+        pos += (int)line.length();
+        if (truncated)
+            pos[-1] = '\n';
+    }
+    kak_assert(pos == packed->data + block.bytes);
+
+    block.lines = {};
+    block.offsets = {};
+    block.content = packed->data;
+    block.data = std::move(data);
+    block.starts = std::move(starts);
+    block.hot = false;
+}
+
+size_t LineList::lazy_byte_count() const
+{
+    size_t bytes = 0;
+    for (auto& block : m_blocks)
+    {
+        if (block.data and not block.data->owned())
+            bytes += block.bytes;
+    }
+    return bytes;
+}
+
+// Loading a block does not change its logical content, so it is
+// considered a const operation, like the lookup cache update. Views
+// returned by const accessors must stay valid until the next modification
+// though, so the block data is kept alive until then.
+void LineList::load(const Block& const_block) const
+{
+    if (not const_block.data)
+        return;
+
+    Block& block = const_cast<Block&>(const_block);
+    block.hot = true;
+    block.lines.reserve(block.starts.size());
+    const bool truncated = block.data->truncated();
+    for (size_t i = 0; i < block.starts.size(); ++i)
+    {
+        const StringView line = block[i];
+        block.lines.push_back(truncated ? StringStorage::create(line.substr(0, line.length()-1), '\n')
+                                        : StringStorage::create(line));
+    }
+
+    if (m_loaded_data.empty() or m_loaded_data.back() != block.data)
+        m_loaded_data.push_back(std::move(block.data));
+    block.data = nullptr;
+    block.content = nullptr;
+    block.starts = {};
+}
+
+LineList::LineRef LineList::line_ref(LineCount line) const
+{
+    auto& block = get_block(line);
+    const StringView content = block[(int)line - m_cache_start];
+    if (block.data and block.data->owned())
+        return { content, block.data };
+    return { content, {} };
+}
+
+void LineList::set(LineCount line, ref_ptr<StringStorage> storage)
+{
+    m_loaded_data.clear();
+    auto& line_storage = const_cast<ref_ptr<StringStorage>&>(get_storage(line));
+    const ptrdiff_t byte_delta = (ptrdiff_t)storage->length - line_storage->length;
+    line_storage = std::move(storage);
+
+    m_blocks[m_cache_block].offsets.clear();
+    m_blocks[m_cache_block].hot = true;
+    m_blocks[m_cache_block].bytes += byte_delta;
+    add_to_trees(m_cache_block, 0, byte_delta);
+}
+
+size_t LineList::offset_of(LineCount line) const
+{
+    kak_assert(0 <= (int)line and (int)line <= m_size);
+    if ((int)line == m_size)
+        return m_byte_count;
+
+    locate((int)line);
+    size_t offset = 0;
+    for (int i = m_cache_block; i > 0; i -= i & -i)
+        offset += m_byte_tree[i];
+
+    return offset + m_blocks[m_cache_block].line_offset((int)line - m_cache_start);
+}
+
+LineCount LineList::line_at(size_t offset, size_t& line_offset) const
+{
+    kak_assert(offset < m_byte_count);
+    int block = 0;
+    int start = 0;
+    size_t remaining = offset;
+    for (int step = m_tree_mask; step != 0; step /= 2)
+    {
+        const int next = block + step;
+        if (next < (int)m_byte_tree.size() and m_byte_tree[next] <= remaining)
+        {
+            block = next;
+            start += m_tree[next];
+            remaining -= m_byte_tree[next];
+        }
+    }
+
+    auto& lines_block = m_blocks[block];
+    const size_t index = lines_block.line_containing(remaining);
+    line_offset = offset - remaining + lines_block.line_offset(index);
+    return start + (int)index;
+}
+
+void LineList::locate(int line) const
+{
+    int block = 0;
+    int remaining = line;
+    for (int step = m_tree_mask; step != 0; step /= 2)
+    {
+        const int next = block + step;
+        if (next < (int)m_tree.size() and m_tree[next] <= remaining)
+        {
+            block = next;
+            remaining -= m_tree[next];
+        }
+    }
+    kak_assert(block < (int)m_blocks.size() and
+               remaining < (int)m_blocks[block].size());
+
+    m_cache_block = block;
+    m_cache_start = line - remaining;
+    m_cache_count = (int)m_blocks[block].size();
+}
+
+void LineList::rebuild_trees()
+{
+    const int count = (int)m_blocks.size();
+    m_tree.assign(count + 1, 0);
+    m_byte_tree.assign(count + 1, 0);
+    m_size = 0;
+    m_byte_count = 0;
+    m_block_count = 0;
+    for (int i = 1; i <= count; ++i)
+    {
+        auto& block = m_blocks[i-1];
+        m_tree[i] += (int)block.size();
+        m_byte_tree[i] += block.bytes;
+        m_size += (int)block.size();
+        m_byte_count += block.bytes;
+        m_block_count += block.size() != 0;
+        const int parent = i + (i & -i);
+        if (parent <= count)
+        {
+            m_tree[parent] += m_tree[i];
+            m_byte_tree[parent] += m_byte_tree[i];
+        }
+    }
+
+    m_tree_mask = count == 0 ? 0 : 1;
+    while (m_tree_mask != 0 and m_tree_mask * 2 <= count)
+        m_tree_mask *= 2;
+
+    m_cache_count = 0;
+}
+
+void LineList::add_to_trees(int slot, int delta, ptrdiff_t byte_delta)
+{
+    for (int i = slot + 1; i < (int)m_tree.size(); i += i & -i)
+    {
+        m_tree[i] += delta;
+        m_byte_tree[i] += byte_delta;
+    }
+    m_size += delta;
+    m_byte_count += byte_delta;
+    m_cache_count = 0;
+}
+
+// remove the block from its slot, which becomes free
+LineList::Block LineList::take_block(int slot)
+{
+    Block block = std::move(m_blocks[slot]);
+    m_blocks[slot] = Block{};
+    if (block.size() != 0)
+    {
+        --m_block_count;
+        add_to_trees(slot, -(int)block.size(), -(ptrdiff_t)block.bytes);
+    }
+    return block;
+}
+
+// put a block in a free slot
+void LineList::set_block(int slot, Block block)
+{
+    kak_assert(m_blocks[slot].size() == 0 and block.size() != 0);
+    const int size = (int)block.size();
+    const size_t bytes = block.bytes;
+    m_blocks[slot] = std::move(block);
+    ++m_block_count;
+    add_to_trees(slot, size, bytes);
+}
+
+// update the trees for a block modified in place, freeing its slot if it
+// became empty
+void LineList::block_changed(int slot, int delta, ptrdiff_t byte_delta)
+{
+    add_to_trees(slot, delta, byte_delta);
+    if (m_blocks[slot].size() == 0)
+    {
+        m_blocks[slot] = Block{};
+        --m_block_count;
+    }
+}
+
+// put the blocks in the free slots [first, last). If there are not enough
+// of them, the blocks of the smallest aligned window of slots containing
+// them that stays under its allowed density are spread evenly over it,
+// along with the new ones. Windows closer to the whole list are allowed
+// lower densities, so that a spread window leaves free slots in its
+// smaller windows, which amortizes the moves to O(log^2 n) per block.
+void LineList::place_blocks(int first, int last, BlockList blocks)
+{
+    const int count = (int)blocks.size();
+    if (count <= last - first)
+    {
+        for (int i = 0; i < count; ++i)
+            set_block(first + i, std::move(blocks[i]));
+        return;
+    }
+
+    const int capacity = (int)m_blocks.size();
+    int height = 0;
+    while ((1 << height) < capacity)
+        ++height;
+
+    // number of blocks in [begin, end) outside of [first, last)
+    int begin = first, end = last, outside = 0;
+    const int anchor = std::min(first, capacity - 1);
+    for (int level = 1; level <= height; ++level)
+    {
+        const int size = 1 << level;
+        const int lo = anchor & ~(size - 1);
+        const int hi = lo + size;
+        if (hi < last)
+            continue;
+
+        for (int i = lo; i < begin; ++i)
+            outside += m_blocks[i].size() != 0;
+        for (int i = end; i < hi; ++i)
+            outside += m_blocks[i].size() != 0;
+        begin = lo;
+        end = hi;
+
+        // the allowed density goes from 1 for single slots to 1/2 for
+        // the whole list
+        if ((outside + count) * 2 * height > size * (2 * height - level))
+            continue;
+
+        BlockList window;
+        window.reserve(outside + count);
+        for (int i = lo; i < first; ++i)
+        {
+            if (m_blocks[i].size() != 0)
+                window.push_back(take_block(i));
+        }
+        window.insert(window.end(), std::make_move_iterator(blocks.begin()),
+                      std::make_move_iterator(blocks.end()));
+        for (int i = last; i < hi; ++i)
+        {
+            if (m_blocks[i].size() != 0)
+                window.push_back(take_block(i));
+        }
+        const int total = (int)window.size();
+        for (int i = 0; i < total; ++i)
+            set_block(lo + (int)((int64_t)i * size / total), std::move(window[i]));
+        return;
+    }
+
+    respread(first, last, std::move(blocks));
+}
+
+// spread all the blocks, with the given ones in place of the slots in
+// [first, last), over a new list of slots.
+void LineList::respread(int first, int last, BlockList blocks)
+{
+    BlockList all;
+    all.reserve(m_block_count + blocks.size());
+    for (int i = 0; i < first; ++i)
+    {
+        if (m_blocks[i].size() != 0)
+            all.push_back(std::move(m_blocks[i]));
+    }
+    all.insert(all.end(), std::make_move_iterator(blocks.begin()),
+               std::make_move_iterator(blocks.end()));
+    for (int i = last; i < (int)m_blocks.size(); ++i)
+    {
+        if (m_blocks[i].size() != 0)
+            all.push_back(std::move(m_blocks[i]));
+    }
+    spread(std::move(all));
+}
+
+// lay the blocks out evenly over between two and four times as many slots
+void LineList::spread(BlockList blocks)
+{
+    const int count = (int)blocks.size();
+    int capacity = count == 0 ? 0 : 2;
+    while (capacity < 2 * count)
+        capacity *= 2;
+
+    m_blocks.clear();
+    m_blocks.resize(capacity);
+    for (int i = 0; i < count; ++i)
+        m_blocks[(int64_t)i * capacity / count] = std::move(blocks[i]);
+    rebuild_trees();
+}
+
+// redistribute lines of the block in slot, starting at line start, and
+// of the blocks around it so that they respect the block size constraints.
+// The slot may have been freed by the modification.
+void LineList::normalize(int slot, int start)
+{
+    int slots[3];
+    int count = 0;
+    if (start > 0)
+    {
+        locate(start - 1);
+        slots[count++] = m_cache_block;
+    }
+    const int size = (int)m_blocks[slot].size();
+    if (size != 0)
+        slots[count++] = slot;
+    if (start + size < m_size)
+    {
+        locate(start + size);
+        slots[count++] = m_cache_block;
+    }
+
+    int total = 0;
+    bool balanced = true;
+    for (int i = 0; i < count; ++i)
+    {
+        const int size = (int)m_blocks[slots[i]].size();
+        total += size;
+        if (size < min_block_size or size > max_block_size)
+            balanced = false;
+    }
+
+    if (not balanced)
+    {
+        BufferLines lines;
+        lines.reserve(total);
+        for (int i = 0; i < count; ++i)
+        {
+            Block block = take_block(slots[i]);
+            load(block);
+            lines.insert(lines.end(), std::make_move_iterator(block.lines.begin()),
+                         std::make_move_iterator(block.lines.end()));
+        }
+
+        const int block_count = (total + target_block_size - 1) / target_block_size;
+        BlockList blocks;
+        blocks.reserve(block_count);
+        for (int i = 0; i < block_count; ++i)
+            blocks.push_back(make_block(lines.begin() + (size_t)total * i / block_count,
+                                        lines.begin() + (size_t)total * (i+1) / block_count));
+
+        place_blocks(count != 0 ? slots[0] : slot,
+                     count != 0 ? slots[count-1] + 1 : slot,
+                     std::move(blocks));
+    }
+
+    // give back the slots freed by removed lines
+    if (m_blocks.size() > 8 and m_block_count * 8 < (int)m_blocks.size())
+        respread(0, 0, {});
+}
+
+void LineList::check_invariant() const
+{
+#ifdef KAK_DEBUG
+    int total = 0;
+    size_t total_bytes = 0;
+    int block_count = 0;
+    kak_assert((m_blocks.size() & (m_blocks.size() - 1)) == 0);
+    for (int i = 0; i < (int)m_blocks.size(); ++i)
+    {
+        auto& block = m_blocks[i];
+        block_count += block.size() != 0;
+        if (block.size() == 0)
+        {
+            kak_assert(not block.data and block.bytes == 0);
+        }
+        else if (block.data)
+        {
+            kak_assert(block.lines.empty() and block.starts.front() == 0 and
+                       block.content[block.bytes-1] == '\n');
+        }
+        else
+        {
+            kak_assert(block.bytes == count_bytes(block.lines.begin(), block.lines.end()));
+        }
+        total += (int)block.size();
+        total_bytes += block.bytes;
+
+        int sum = 0;
+        size_t byte_sum = 0;
+        for (int j = i + 1 - ((i+1) & -(i+1)); j <= i; ++j)
+        {
+            sum += (int)m_blocks[j].size();
+            byte_sum += m_blocks[j].bytes;
+        }
+        kak_assert(m_tree[i+1] == sum);
+        kak_assert(m_byte_tree[i+1] == byte_sum);
+    }
+    kak_assert(total == m_size);
+    kak_assert(total_bytes == m_byte_count);
+    kak_assert(block_count == m_block_count);
+#endif
+}
+
+}
@@ -0,0 +1,283 @@
+#ifndef line_list_hh_INCLUDED
+#define line_list_hh_INCLUDED
+
+#include "assert.hh"
+#include "shared_string.hh"
+#include "units.hh"
+#include "vector.hh"
+
+#include <cstdint>
+
+namespace Kakoune
+{
+
+using BufferLines = Vector<ref_ptr<StringStorage>, MemoryDomain::BufferContent>;
+
+// Data owned outside of the line list that packed lines point into,
+// such as a memory mapped file for lazily loaded lines.
+struct LineData
+{
+    virtual ~LineData() = default;
+    // false if the data comes from an external source that can change,
+    // like a file mapping
+    virtual bool owned() const { return false; }
+    // true once the data was lost, like a truncated mapped file whose
+    // missing pages read as zeros. Its lines may not end with '\n'.
+    virtual bool truncated() const { return false; }
+
+    friend void inc_ref_count(LineData* data) { ++data->refcount; }
+    friend void dec_ref_count(LineData* data) { if (--data->refcount == 0) delete data; }
+
+    int refcount = 0;
+};
+
+// Lines copied in a single allocation, accounted to the BufferContent
+// memory domain.
+struct PackedLines : LineData
+{
+    PackedLines(size_t capacity);
+    ~PackedLines();
+    bool owned() const override { return true; }
+
+    char* data;
+    size_t capacity;
+};
+
+// A LineList holds the lines of a buffer
+//
+// Lines are stored in blocks of contiguous lines, and Fenwick trees
+// of the block line counts and byte counts permit to find the block
+// holding a given line or byte offset in logarithmic time. Inserting
+// or removing lines only touches the blocks containing them, so edits
+// cost is independent of where they happen in the buffer.
+//
+// Blocks are kept in order in a list of slots with free slots between
+// them, so that splitting or merging blocks only changes the slots
+// around them, and the trees are updated for these slots. When there
+// are no free slots left around a block, the blocks of the smallest
+// enclosing window of slots that is sparse enough are spread evenly
+// over it, the allowed density getting lower as windows grow.
+//
+// Blocks can be packed, in which case their lines are views into a
+// LineData, which avoids the per line storage overhead. They are unpacked
+// to a StringStorage per line when a block gets modified or when a line
+// storage is requested, and packed again by pack once they are not
+// modified anymore. The data of unpacked blocks is kept until the next
+// modification, so that views returned before stay valid. Lazily loaded
+// lines are packed lines pointing into the file mapping.
+class LineList
+{
+public:
+    LineList() = default;
+    LineList(BufferLines lines) { assign(std::move(lines)); }
+    LineList(std::initializer_list<ref_ptr<StringStorage>> lines)
+        : LineList(BufferLines(lines)) {}
+
+    void assign(BufferLines lines);
+
+    // replace lines in [first, last) with the given ones
+    void replace(LineCount first, LineCount last, BufferLines lines);
+
+    void set(LineCount line, ref_ptr<StringStorage> storage);
+
+    // append content lines as packed lines pointing into data, followed
+    // by the tail lines. Each line in content must end with a '\n'.
+    void append_packed(ref_ptr<LineData> data, StringView content,
+                       BufferLines tail = {});
+
+    // copy all lines pointing to data that is not owned to owned storage
+    void load_all();
+    // same for lines pointing to truncated data, restoring their end of lines
+    void load_truncated();
+
+    // pack the blocks that were not modified since the previous call
+    // and whose line storages are not shared.
+    void pack();
+
+    [[gnu::always_inline]]
+    const ref_ptr<StringStorage>& get_storage(LineCount line) const
+    {
+        auto& block = get_block(line);
+        if (block.data)
+            load(block);
+        return block.lines[(int)line - m_cache_start];
+    }
+
+    [[gnu::always_inline]]
+    StringView operator[](LineCount line) const
+    {
+        auto& block = get_block(line);
+        return block[(int)line - m_cache_start];
+    }
+
+    // A line content and, when the line is packed in owned data, that
+    // data, which keeps the content valid once the line is modified,
+    // without loading the block.
+    struct LineRef
+    {
+        StringView content;
+        ref_ptr<LineData> data;
+    };
+    LineRef line_ref(LineCount line) const;
+
+    StringView front() const { return (*this)[0]; }
+    StringView back() const { return (*this)[m_size-1]; }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    // total number of bytes in all lines
+    size_t byte_count() const { return m_byte_count; }
+    // number of bytes in packed lines pointing to data that is not owned
+    size_t lazy_byte_count() const;
+
+    // number of bytes before the given line, line can be one past the last
+    size_t offset_of(LineCount line) const;
+    // line containing the byte at given offset, sets line_offset to the
+    // offset of that line start. offset must be less than byte_count()
+    LineCount line_at(size_t offset, size_t& line_offset) const;
+
+    // calls func with successive views covering the content of the lines
+    // in [first, last), the lines of a packed block being given at once.
+    template<typename Func>
+    void for_each_chunk(LineCount first, LineCount last, Func func) const
+    {
+        int line = (int)first;
+        while (line < (int)last)
+        {
+            auto& block = get_block(line);
+            const int start = m_cache_start;
+            const int index = line - start;
+            const int end = std::min((int)last - start, (int)block.size());
+            if (block.data)
+                func(StringView{block[index].begin(), block[end-1].end()});
+            else
+            {
+                for (int i = index; i < end; ++i)
+                    func(block[i]);
+            }
+            line = start + end;
+        }
+    }
+
+    struct Block
+    {
+        BufferLines lines;
+        size_t bytes = 0;
+        // lazily computed offset of each line from block start
+        mutable Vector<size_t, MemoryDomain::BufferMeta> offsets;
+
+        // packed blocks content, lines is empty until they are loaded
+        ref_ptr<LineData> data;
+        const char* content = nullptr;
+        Vector<uint32_t, MemoryDomain::BufferMeta> starts;
+
+        // modified since the last pack call
+        bool hot = true;
+
+        // free slots hold empty blocks
+        [[gnu::always_inline]]
+        size_t size() const { return data ? starts.size() : lines.size(); }
+
+        [[gnu::always_inline]]
+        StringView operator[](size_t index) const
+        {
+            if (not data)
+                return lines[index]->strview();
+            const size_t end = index + 1 < starts.size() ? starts[index+1] : bytes;
+            return { content + starts[index], content + end };
+        }
+
+        size_t line_offset(size_t index) const;
+        size_t line_containing(size_t offset) const;
+    };
+    using BlockList = Vector<Block, MemoryDomain::BufferMeta>;
+
+    struct const_iterator
+    {
+        StringView operator*() const { return (*blocks)[block][index]; }
+
+        const_iterator& operator++()
+        {
+            if (++index == (*blocks)[block].size())
+            {
+                do
+                    ++block;
+                while (block < blocks->size() and (*blocks)[block].size() == 0);
+                index = 0;
+            }
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const
+        { return block == other.block and index == other.index; }
+        bool operator!=(const const_iterator& other) const
+        { return not (*this == other); }
+
+        const BlockList* blocks;
+        size_t block;
+        size_t index;
+    };
+
+    const_iterator begin() const
+    {
+        if (m_size == 0)
+            return end();
+        get_block(0);
+        return { &m_blocks, (size_t)m_cache_block, 0 };
+    }
+    const_iterator end() const { return { &m_blocks, m_blocks.size(), 0 }; }
+
+    void check_invariant() const;
+
+private:
+    static constexpr int max_block_size = 1024;
+    static constexpr int target_block_size = max_block_size / 2;
+    static constexpr int min_block_size = max_block_size / 4;
+
+    [[gnu::always_inline]]
+    const Block& get_block(LineCount line) const
+    {
+        kak_assert(0 <= (int)line and (int)line < m_size);
+        const int l = (int)line;
+        if ((unsigned)(l - m_cache_start) >= (unsigned)m_cache_count)
+            locate(l);
+        return m_blocks[m_cache_block];
+    }
+
+    void locate(int line) const;
+    void load(const Block& block) const;
+    void pack_block(Block& block);
+    void rebuild_trees();
+    void add_to_trees(int slot, int delta, ptrdiff_t byte_delta);
+
+    Block take_block(int slot);
+    void set_block(int slot, Block block);
+    void block_changed(int slot, int delta, ptrdiff_t byte_delta);
+    void place_blocks(int first, int last, BlockList blocks);
+    void respread(int first, int last, BlockList blocks);
+    void spread(BlockList blocks);
+    void normalize(int slot, int start);
+
+    // slots, the number of slots is a power of two
+    BlockList m_blocks;
+    Vector<int, MemoryDomain::BufferMeta> m_tree;
+    Vector<size_t, MemoryDomain::BufferMeta> m_byte_tree;
+    int m_tree_mask = 0;
+    int m_size = 0;
+    size_t m_byte_count = 0;
+    // number of slots holding a block
+    int m_block_count = 0;
+
+    // last located block, line accesses are mostly sequential
+    mutable int m_cache_block = 0;
+    mutable int m_cache_start = 0;
+    mutable int m_cache_count = 0;
+
+    // data of the blocks loaded since the last modification
+    mutable Vector<ref_ptr<LineData>, MemoryDomain::BufferMeta> m_loaded_data;
+};
+
+}
+
+#endif // line_list_hh_INCLUDED
@@ -11,6 +11,7 @@
 #include "event_manager.hh"
 #include "face_registry.hh"
 #include "file.hh"
+#include "file_watcher.hh"
 #include "highlighters.hh"
 #include "insert_completer.hh"
 #include "shared_string.hh"
@@ -219,6 +220,33 @@ void register_options()
                            InsertCompleterDesc{ InsertCompleterDesc::Filename },
                            InsertCompleterDesc{ InsertCompleterDesc::Word, "all"_str }
                        }), OptionFlags::None);
+    reg.declare_option("lazy_load_size",
+                       "minimum size of files whose lines are loaded lazily, 0 to disable",
+                       0);
+    reg.declare_option("undo_spill_size",
+                       "size of packed undo history above which it is written to a temporary file, 0 to disable",
+                       0);
+    reg.declare_option("buffer_memory_budget",
+                       "memory used by buffers above which idle ones are evicted, 0 to disable",
+                       0);
+    reg.declare_option("fifo_max_lines",
+                       "maximum number of lines kept in fifo buffers, 0 for no limit",
+                       0);
+    reg.declare_option("persistent_undo",
+                       "save undo history along files, and restore it when opening them",
+                       false);
+    reg.declare_option("write_method",
+                       "how files are written: overwrite or replace",
+                       "overwrite"_str);
+    reg.declare_option("write_sync",
+                       "flush written files to disk before considering them written",
+                       false);
+    reg.declare_option("write_async",
+                       "write buffers from a background thread with the write and writeall commands",
+                       false);
+    reg.declare_option("journal",
+                       "record unsaved edits of file buffers in a journal, to recover them after a crash",
+                       false);
     reg.declare_option("autoreload",
                        "autoreload buffer when a filesystem modification is detected",
                        Ask);
@@ -335,6 +363,7 @@ int run_server(StringView session, StringView init_command,
     }
 
     StringRegistry      string_registry;
+    RegexCache          regex_cache;
     EventManager        event_manager;
     GlobalScope         global_scope;
     ShellManager        shell_manager;
@@ -345,6 +374,7 @@ int run_server(StringView session, StringView init_command,
     DefinedHighlighters defined_highlighters;
     FaceRegistry        face_registry;
     ClientManager       client_manager;
+    FileWatcher         file_watcher;
 
     run_unit_tests();
 
@@ -400,14 +430,26 @@ int run_server(StringView session, StringView init_command,
 
     while (not terminate and (not client_manager.empty() or daemon))
     {
+        load_truncated_lines();
         client_manager.redraw_clients();
         event_manager.handle_next_events(EventMode::Normal);
         client_manager.handle_pending_inputs();
         client_manager.clear_mode_trashes();
+        buffer_manager.flush_journals();
         buffer_manager.clear_buffer_trash();
+        buffer_manager.compact_buffers();
         string_registry.purge_unused();
     }
 
+    try
+    {
+        wait_for_async_writes();
+    }
+    catch (Kakoune::runtime_error& error)
+    {
+        fprintf(stderr, "%s\n", error.what());
+    }
+
     {
         Context empty_context;
         global_scope.hooks().run_hook("KakEnd", "", empty_context);
@@ -419,6 +461,7 @@ int run_server(StringView session, StringView init_command,
 int run_filter(StringView keystr, ArrayView<StringView> files, bool quiet)
 {
     StringRegistry  string_registry;
+    RegexCache      regex_cache;
     GlobalScope     global_scope;
     ShellManager    shell_manager;
     BufferManager   buffer_manager;
@@ -32,6 +32,7 @@ enum class MemoryDomain
     WordDB,
     Selections,
     History,
+    Regex, // with estimated compiled regex sizes
     Count
 };
 
@@ -59,6 +60,7 @@ inline const char* domain_name(MemoryDomain domain)
         case MemoryDomain::Client: return "Client";
         case MemoryDomain::Selections: return "Selections";
         case MemoryDomain::History: return "History";
+        case MemoryDomain::Regex: return "Regex";
         case MemoryDomain::Count: break;
     }
     kak_assert(false);
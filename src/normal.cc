@@ -582,8 +582,7 @@ void regex_prompt(Context& context, const String prompt, T func)
 
                 if (event == PromptEvent::Validate)
                     context.push_jump();
-                Regex regex = str.empty() ? Regex{}
-                                          : Regex{str.begin(), str.end()};
+                Regex regex = str.empty() ? Regex{} : cached_regex(str);
                 func(std::move(regex), event, context);
             }
             catch (RegexError& err)
@@ -624,7 +623,7 @@ void search(Context& context, NormalParams)
     regex_prompt(context, direction == Forward ? "search:" : "reverse search:",
                  [](Regex ex, PromptEvent event, Context& context) {
                      if (ex.empty())
-                         ex = Regex{context.main_sel_register_value("/").str()};
+                         ex = cached_regex(context.main_sel_register_value("/"));
                      else if (event == PromptEvent::Validate)
                          RegisterManager::instance()['/'] = String{ex.str()};
                      if (not ex.empty() and not ex.str().empty())
@@ -640,7 +639,7 @@ void search_next(Context& context, NormalParams params)
     {
         try
         {
-            Regex ex{str.begin(), str.end()};
+            Regex ex = cached_regex(str);
             do {
                 select_next_match<direction, mode>(context.buffer(), context.selections(), ex);
             } while (--params.count > 0);
@@ -681,7 +680,7 @@ void select_regex(Context& context, NormalParams)
 {
     regex_prompt(context, "select:", [](Regex ex, PromptEvent event, Context& context) {
         if (ex.empty())
-            ex = Regex{context.main_sel_register_value("/").str()};
+            ex = cached_regex(context.main_sel_register_value("/"));
         else if (event == PromptEvent::Validate)
             RegisterManager::instance()['/'] = String{ex.str()};
         if (not ex.empty() and not ex.str().empty())
@@ -693,7 +692,7 @@ void split_regex(Context& context, NormalParams)
 {
     regex_prompt(context, "split:", [](Regex ex, PromptEvent event, Context& context) {
         if (ex.empty())
-            ex = Regex{context.main_sel_register_value("/").str()};
+            ex = cached_regex(context.main_sel_register_value("/"));
         else if (event == PromptEvent::Validate)
             RegisterManager::instance()['/'] = String{ex.str()};
         if (not ex.empty() and not ex.str().empty())
@@ -768,10 +767,13 @@ void keep(Context& context, NormalParams)
             return;
         const Buffer& buffer = context.buffer();
         Vector<Selection> keep;
+        MatchResults<ChunkedBufferRange::iterator> matches;
         for (auto& sel : context.selections())
         {
-            if (regex_search(buffer.iterator_at(sel.min()),
-                             utf8::next(buffer.iterator_at(sel.max()), buffer.end()), ex) == matching)
+            ChunkedBufferRange range{
+                buffer, buffer.iterator_at(sel.min()).coord(),
+                utf8::next(buffer.iterator_at(sel.max()), buffer.end()).coord()};
+            if (regex_find(range.begin(), range.end(), matches, ex) == matching)
                 keep.push_back(sel);
         }
         if (keep.empty())
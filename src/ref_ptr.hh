@@ -33,7 +33,7 @@ struct ref_ptr
 
     T* get() const { return m_ptr; }
 
-    explicit operator bool() { return m_ptr; }
+    explicit operator bool() const { return m_ptr; }
 
     friend bool operator==(const ref_ptr& lhs, const ref_ptr& rhs)
     {
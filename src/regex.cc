@@ -1,7 +1,11 @@
 #include "regex.hh"
 
+#include "containers.hh"
+#include "debug.hh"
 #include "exception.hh"
 
+#include <string.h>
+
 namespace Kakoune
 {
 
@@ -14,7 +18,7 @@ void option_from_string(StringView str, Regex& re)
 {
     try
     {
-        re = Regex{str.begin(), str.end()};
+        re = cached_regex(str);
     }
     catch (RegexError& err)
     {
@@ -22,4 +26,335 @@ void option_from_string(StringView str, Regex& re)
     }
 }
 
+RegexCache::~RegexCache()
+{
+    for (auto& entry : m_entries)
+        on_dealloc(MemoryDomain::Regex, entry.size);
+}
+
+Regex RegexCache::get(StringView re, Regex::flag_type flags)
+{
+    auto it = find_if(m_entries, [&](const Entry& entry) {
+        return entry.flags == flags and entry.pattern == re;
+    });
+    if (it != m_entries.end())
+    {
+        ++m_hits;
+        std::rotate(m_entries.begin(), it, it+1);
+        return m_entries.front().regex;
+    }
+
+    ++m_misses;
+    Regex regex{re, flags};
+    // the compiled program is allocated by the regex library, which
+    // cannot be measured, so the Regex memory domain is given an estimate:
+    // about 1.5K of tables plus a 128 bytes state per pattern byte.
+    const size_t size = 1536 + 128 * (int)re.length();
+
+    if (m_entries.size() == max_entries)
+    {
+        on_dealloc(MemoryDomain::Regex, m_entries.back().size);
+        m_entries.pop_back();
+    }
+    on_alloc(MemoryDomain::Regex, size);
+    m_entries.insert(m_entries.begin(), Entry{re.str(), flags, regex, size});
+    return regex;
+}
+
+void RegexCache::debug_stats() const
+{
+    write_debug("Regex cache stats:");
+    size_t size = 0;
+    for (auto& entry : m_entries)
+        size += entry.size;
+    write_debug("  count: " + to_string(m_entries.size()) + "/" + to_string(max_entries) +
+                ", estimated compiled size: " + to_string(size));
+    write_debug("  hits: " + to_string(m_hits) + ", misses: " + to_string(m_misses));
+}
+
+const char* find_literal(const char* begin, const char* end, StringView literal)
+{
+    if (end - begin < (int)literal.length())
+        return end;
+    auto res = memmem(begin, end - begin, literal.data(), (int)literal.length());
+    return res ? (const char*)res : end;
+}
+
+#ifndef KAK_USE_STDREGEX
+static bool is_regex_metachar(char c)
+{
+    return contains(StringView{"^$.|?*+()[]{}\\"}, c);
+}
+
+static bool is_plain_syntax(boost::regex::flag_type flags)
+{
+    using boost::regex;
+    return (flags & regex::main_option_type) == regex::perl_syntax_group and
+           not (flags & (regex::icase | regex::mod_x));
+}
+
+// character matched by the escape sequence \c, -1 if it is not a literal
+static int escaped_literal(char c)
+{
+    // word and buffer boundaries are zero width assertions
+    if (contains(StringView{"<>`'"}, c))
+        return -1;
+    if (not isalnum((unsigned char)c))
+        return (unsigned char)c;
+    switch (c)
+    {
+        case 'a': return '\a';
+        case 'e': return '\x1b';
+        case 'f': return '\f';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        default: return -1;
+    }
+}
+
+// returns the position following the item starting at it, which can be an
+// escape sequence, a character class, a group or a single character.
+static const char* skip_item(const char* it, const char* end)
+{
+    if (*it == '\\')
+    {
+        if (it+1 == end)
+            return end;
+        if (*(it+1) != 'Q')
+            return it+2;
+        for (it += 2; it != end; ++it)
+        {
+            if (*it == '\\' and it+1 != end and *(it+1) == 'E')
+                return it+2;
+        }
+        return end;
+    }
+    if (*it == '[')
+    {
+        if (++it != end and *it == '^')
+            ++it;
+        if (it != end and *it == ']')
+            ++it;
+        for (; it != end and *it != ']'; ++it)
+        {
+            if (*it == '\\' and it+1 != end)
+                ++it;
+            else if (*it == '[' and it+1 != end and contains(StringView{":=."}, *(it+1)))
+            {
+                const char delim = *++it;
+                while (++it != end and not (*it == ']' and *(it-1) == delim))
+                {}
+                if (it == end)
+                    break;
+            }
+        }
+        return it == end ? end : it+1;
+    }
+    if (*it == '(')
+    {
+        if (it+2 < end and *(it+1) == '?' and *(it+2) == '#')
+        {
+            it = std::find(it, end, ')');
+            return it == end ? end : it+1;
+        }
+        for (++it; it != end and *it != ')'; it = skip_item(it, end))
+        {}
+        return it == end ? end : it+1;
+    }
+    return it+1;
+}
+
+static const char* skip_quantifier(const char* it, const char* end)
+{
+    if (it != end and contains(StringView{"?*+"}, *it))
+        ++it;
+    else if (it != end and *it == '{')
+    {
+        it = std::find(it, end, '}');
+        if (it != end)
+            ++it;
+    }
+    else
+        return it;
+    // lazy or possessive quantifier
+    if (it != end and (*it == '?' or *it == '+'))
+        ++it;
+    return it;
+}
+
+// a top level alternation means matches do not share anything
+static bool has_top_level_alternation(StringView re)
+{
+    for (auto it = re.begin(), end = re.end(); it != end; it = skip_item(it, end))
+    {
+        if (*it == '|')
+            return true;
+    }
+    return false;
+}
+
+// Returns the literal string all matches of re start with, empty if there is
+// none or if it cannot be cheaply determined.
+String extract_literal_prefix(StringView re, boost::regex::flag_type flags)
+{
+    if (not is_plain_syntax(flags) or has_top_level_alternation(re))
+        return {};
+
+    auto it = re.begin();
+    const auto end = re.end();
+    // zero width assertions do not change where matches start
+    while (it != end)
+    {
+        if (*it == '^')
+            ++it;
+        else if (*it == '\\' and it+1 != end and contains(StringView{"AbB<`"}, *(it+1)))
+            it += 2;
+        else if (*it == '(' and end - it > 3 and *(it+1) == '?' and *(it+2) == '<' and
+                 (*(it+3) == '=' or *(it+3) == '!'))
+            it = skip_item(it, end);
+        else
+            break;
+    }
+
+    String res;
+    while (it != end)
+    {
+        int c = *it;
+        auto next = it+1;
+        if (*it == '\\')
+        {
+            if (it+1 == end or (c = escaped_literal(*(it+1))) < 0)
+                break;
+            next = it+2;
+        }
+        else if (is_regex_metachar(*it))
+            break;
+
+        // a quantifier applies to that last literal character
+        if (next != end and contains(StringView{"?*+{"}, *next))
+        {
+            if (*next == '+')
+                res += (char)c;
+            break;
+        }
+        res += (char)c;
+        it = next;
+    }
+    return res;
+}
+
+// Returns bytes that appear in all matches of re, in no particular order.
+static String extract_required_bytes(StringView re, boost::regex::flag_type flags)
+{
+    if (not is_plain_syntax(flags) or has_top_level_alternation(re))
+        return {};
+
+    // inline modifiers could make the following characters case insensitive
+    for (auto it = re.begin(), end = re.end(); it != end; ++it)
+    {
+        if (*it == '(' and end - it > 2 and *(it+1) == '?' and
+            contains(StringView{"imsx-"}, *(it+2)))
+            return {};
+    }
+
+    String res;
+    for (auto it = re.begin(), end = re.end(); it != end; )
+    {
+        int c = (unsigned char)*it;
+        auto next = it+1;
+        if (*it == '\\')
+        {
+            if (it+1 == end)
+                break;
+            c = escaped_literal(*(it+1));
+            // other escapes can take arguments we do not know how to skip
+            if (c < 0 and not contains(StringView{"dDwWsShHbBAzZGK<>`'Q"}, *(it+1)))
+                break;
+            next = skip_item(it, end);
+        }
+        else if (*it == ')')
+            break;
+        else if (is_regex_metachar(*it))
+        {
+            c = -1;
+            next = skip_item(it, end);
+        }
+
+        const bool optional = next != end and contains(StringView{"?*{"}, *next);
+        if (c >= 0 and not optional and not contains(res, (char)c))
+            res += (char)c;
+        it = skip_quantifier(next, end);
+    }
+    return res;
+}
+
+String required_bytes(const Regex& re)
+{
+    const std::string str = re.str();
+    return extract_required_bytes(str, re.flags());
+}
+
+// Conservatively checks that no construct in re can match an end of line
+static bool pattern_can_span_lines(StringView re, boost::regex::flag_type flags)
+{
+    using boost::regex;
+    if ((flags & regex::main_option_type) != regex::perl_syntax_group or
+        (flags & regex::mod_x))
+        return true;
+
+    for (auto it = re.begin(), end = re.end(); it != end; ++it)
+    {
+        if (*it == '\n' or *it == '.')
+            return true;
+        // inline modifiers can change what '.' or whitespace mean
+        if (*it == '(' and end - it > 2 and *(it+1) == '?' and
+            contains(StringView{"imsx-"}, *(it+2)))
+            return true;
+        if (*it == '\\')
+        {
+            if (++it == end)
+                return true;
+            // non alphanumeric escapes are literals, \Z looks past ends of
+            // lines and \G depends on where the search started
+            if (isalnum((unsigned char)*it) and
+                not contains(StringView{"dwhSbBAzKaefrt"}, *it))
+                return true;
+        }
+        else if (*it == '[')
+        {
+            const auto class_end = skip_item(it, end);
+            if (it+1 != end and *(it+1) == '^')
+                return true;
+            for (++it; it != class_end; ++it)
+            {
+                // a range including '\n' starts before it
+                if ((unsigned char)*it <= '\n' or *it == ':' or
+                    (*it == '\\' and it+1 != class_end and isalnum((unsigned char)*(it+1)) and
+                     not contains(StringView{"dwhSefr"}, *(it+1))))
+                    return true;
+            }
+            --it;
+        }
+    }
+    return false;
+}
+
+bool matches_can_span_lines(const Regex& re)
+{
+    const std::string str = re.str();
+    return pattern_can_span_lines(str, re.flags());
+}
+#else
+String required_bytes(const Regex& re)
+{
+    return {};
+}
+
+bool matches_can_span_lines(const Regex& re)
+{
+    return true;
+}
+#endif
+
 }
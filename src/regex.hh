@@ -2,6 +2,9 @@
 #define regex_hh_INCLUDED
 
 #include "string.hh"
+#include "utils.hh"
+
+#include <algorithm>
 
 #ifdef KAK_USE_STDREGEX
 #include <regex>
@@ -37,16 +40,187 @@ private:
 namespace regex_ns = std;
 #else
 namespace regex_ns = boost;
-using Regex = boost::regex;
+
+String extract_literal_prefix(StringView re, boost::regex::flag_type flags);
+
+// Regex that keeps track of the literal string all its matches start with
+struct Regex : boost::regex
+{
+    Regex() = default;
+
+    explicit Regex(StringView re, flag_type flags = ECMAScript)
+        : boost::regex(re.begin(), re.end(), flags),
+          m_literal_prefix(extract_literal_prefix(re, flags)) {}
+
+    template<typename Iterator>
+    Regex(Iterator begin, Iterator end, flag_type flags = ECMAScript)
+        : boost::regex(begin, end, flags)
+    {
+        const std::string re = str();
+        m_literal_prefix = extract_literal_prefix(re, flags);
+    }
+
+    StringView literal_prefix() const { return m_literal_prefix; }
+
+private:
+    String m_literal_prefix;
+};
 #endif
 
+template<typename Iterator>
+using MatchResults = regex_ns::match_results<Iterator>;
+
+using RegexMatchFlags = regex_ns::regex_constants::match_flag_type;
+using RegexError = regex_ns::regex_error;
+
+template<typename Iterator>
+Iterator find_literal(Iterator begin, Iterator end, StringView literal)
+{
+    return std::search(begin, end, literal.begin(), literal.end());
+}
+
+const char* find_literal(const char* begin, const char* end, StringView literal);
+
+#ifdef KAK_USE_STDREGEX
 template<typename Iterator>
 using RegexIterator = regex_ns::regex_iterator<Iterator>;
 
 template<typename Iterator>
-using MatchResults = regex_ns::match_results<Iterator>;
+bool regex_find(Iterator begin, Iterator end, MatchResults<Iterator>& res,
+                const Regex& re, RegexMatchFlags flags, Iterator base)
+{
+    if (begin != base)
+        flags |= std::regex_constants::match_prev_avail;
+    return std::regex_search(begin, end, res, re, flags);
+}
+#else
+// regex_search front-end, the full matcher is only run at the occurrences of
+// the regex literal prefix. base is the start of the searched sequence, so
+// that assertions can look before begin.
+template<typename Iterator>
+bool regex_find(Iterator begin, Iterator end, MatchResults<Iterator>& res,
+                const Regex& re, RegexMatchFlags flags, Iterator base)
+{
+    const StringView literal = re.literal_prefix();
+    if (literal.empty())
+        return boost::regex_search(begin, end, res, re, flags, base);
 
-using RegexError = regex_ns::regex_error;
+    flags |= boost::regex_constants::match_continuous;
+    for (auto pos = find_literal(begin, end, literal); pos != end;
+         pos = find_literal(++pos, end, literal))
+    {
+        if (boost::regex_search(pos, end, res, re, flags, base))
+            return true;
+    }
+    return false;
+}
+
+// Same semantics as boost::regex_iterator, searching through regex_find
+template<typename Iterator>
+class RegexIterator
+{
+public:
+    using value_type = MatchResults<Iterator>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+    using iterator_category = std::forward_iterator_tag;
+
+    RegexIterator() = default;
+    RegexIterator(Iterator begin, Iterator end, const Regex& re,
+                  RegexMatchFlags flags = boost::regex_constants::match_default)
+        : m_regex{&re}, m_base{begin}, m_end{end}, m_flags{flags}
+    {
+        if (not regex_find(begin, end, m_results, re, flags, begin))
+            m_regex = nullptr;
+    }
+
+    const value_type& operator*() const { return m_results; }
+    const value_type* operator->() const { return &m_results; }
+
+    RegexIterator& operator++()
+    {
+        auto flags = m_flags;
+        if (m_results[0].first == m_results[0].second)
+            flags |= boost::regex_constants::match_not_initial_null;
+        if (not regex_find(m_results[0].second, m_end, m_results,
+                           *m_regex, flags, m_base))
+            m_regex = nullptr;
+        return *this;
+    }
+
+    bool operator==(const RegexIterator& other) const
+    {
+        if (m_regex == nullptr or other.m_regex == nullptr)
+            return m_regex == other.m_regex;
+        return m_regex == other.m_regex and m_end == other.m_end and
+               m_results[0].first == other.m_results[0].first and
+               m_results[0].second == other.m_results[0].second;
+    }
+    bool operator!=(const RegexIterator& other) const { return not (*this == other); }
+
+private:
+    const Regex* m_regex = nullptr;
+    Iterator m_base;
+    Iterator m_end;
+    RegexMatchFlags m_flags = boost::regex_constants::match_default;
+    value_type m_results;
+};
+#endif
+
+template<typename Iterator>
+bool regex_find(Iterator begin, Iterator end, MatchResults<Iterator>& res,
+                const Regex& re, RegexMatchFlags flags = regex_ns::regex_constants::match_default)
+{
+    return regex_find(begin, end, res, re, flags, begin);
+}
+
+// Most recently used compiled regexes, so that patterns coming from
+// registers, options or prompts do not get recompiled on each use.
+class RegexCache : public Singleton<RegexCache>
+{
+public:
+    ~RegexCache();
+
+    // throws RegexError if re is invalid
+    Regex get(StringView re, Regex::flag_type flags = Regex::ECMAScript);
+    void debug_stats() const;
+
+    size_t hits() const { return m_hits; }
+    size_t misses() const { return m_misses; }
+
+    static constexpr size_t max_entries = 64;
+
+private:
+    struct Entry
+    {
+        String pattern;
+        Regex::flag_type flags;
+        Regex regex;
+        // compiled size accounted to MemoryDomain::Regex. The regex
+        // library allocates it out of our reach, so it is an estimate
+        // and not a measure.
+        size_t size;
+    };
+
+    // most recently used first
+    Vector<Entry, MemoryDomain::Regex> m_entries;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
+
+inline Regex cached_regex(StringView re, Regex::flag_type flags = Regex::ECMAScript)
+{
+    if (not RegexCache::has_instance())
+        return Regex{re, flags};
+    return RegexCache::instance().get(re, flags);
+}
+
+// Bytes that appear in every match of re, possibly not all of them
+String required_bytes(const Regex& re);
+
+// false when no match of re can contain an end of line
+bool matches_can_span_lines(const Regex& re);
 
 String option_to_string(const Regex& re);
 void option_from_string(StringView str, Regex& re);
@@ -16,7 +16,7 @@ void Selection::merge_with(const Selection& range)
 }
 
 SelectionList::SelectionList(Buffer& buffer, Selection s, size_t timestamp)
-    : m_buffer(&buffer), m_selections({ std::move(s) }), m_timestamp(timestamp)
+    : m_buffer(&buffer), m_selections({ std::move(s) }), m_timestamp(buffer, timestamp)
 {
     check_invariant();
 }
@@ -26,7 +26,7 @@ SelectionList::SelectionList(Buffer& buffer, Selection s)
 {}
 
 SelectionList::SelectionList(Buffer& buffer, Vector<Selection> s, size_t timestamp)
-    : m_buffer(&buffer), m_selections(std::move(s)), m_timestamp(timestamp)
+    : m_buffer(&buffer), m_selections(std::move(s)), m_timestamp(buffer, timestamp)
 {
     kak_assert(size() > 0);
     check_invariant();
@@ -336,25 +336,29 @@ void SelectionList::update()
     if (m_timestamp == m_buffer->timestamp())
         return;
 
-    auto changes = m_buffer->changes_since(m_timestamp);
-    auto change_it = changes.begin();
-    while (change_it != changes.end())
+    // if the changes were dropped, we can only keep selections in the buffer
+    if (m_buffer->changes_available_since(m_timestamp))
     {
-        auto forward_end = forward_sorted_until(change_it, changes.end());
-        auto backward_end = backward_sorted_until(change_it, changes.end());
-
-        if (forward_end >= backward_end)
+        auto changes = m_buffer->changes_since(m_timestamp);
+        auto change_it = changes.begin();
+        while (change_it != changes.end())
         {
-            update_forward({ change_it, forward_end }, m_selections, m_main);
-            change_it = forward_end;
-        }
-        else
-        {
-            update_backward({ change_it, backward_end }, m_selections, m_main);
-            change_it = backward_end;
+            auto forward_end = forward_sorted_until(change_it, changes.end());
+            auto backward_end = backward_sorted_until(change_it, changes.end());
+
+            if (forward_end >= backward_end)
+            {
+                update_forward({ change_it, forward_end }, m_selections, m_main);
+                change_it = forward_end;
+            }
+            else
+            {
+                update_backward({ change_it, backward_end }, m_selections, m_main);
+                change_it = backward_end;
+            }
+            kak_assert(std::is_sorted(m_selections.begin(), m_selections.end(),
+                                      compare_selections));
         }
-        kak_assert(std::is_sorted(m_selections.begin(), m_selections.end(),
-                                  compare_selections));
     }
     for (auto& sel : m_selections)
     {
@@ -432,37 +436,45 @@ void SelectionList::avoid_eol()
         _avoid_eol(buffer(), sel);
 }
 
-BufferIterator prepare_insert(Buffer& buffer, const Selection& sel, InsertMode mode)
+// returns the range of the buffer replaced when inserting with given mode
+static std::pair<ByteCoord, ByteCoord> insert_range(const Buffer& buffer, const Selection& sel,
+                                                    InsertMode mode)
 {
     switch (mode)
     {
     case InsertMode::Insert:
-        return buffer.iterator_at(sel.min());
+        return { sel.min(), sel.min() };
     case InsertMode::InsertCursor:
-        return buffer.iterator_at(sel.cursor());
+        return { sel.cursor(), sel.cursor() };
     case InsertMode::Replace:
-        return erase(buffer, sel);
+        return { sel.min(), buffer.char_next(sel.max()) };
     case InsertMode::Append:
     {
         // special case for end of lines, append to current line instead
         auto pos = buffer.iterator_at(sel.max());
-        return *pos == '\n' ? pos : utf8::next(pos, buffer.end());
+        pos = *pos == '\n' ? pos : utf8::next(pos, buffer.end());
+        return { pos.coord(), pos.coord() };
     }
     case InsertMode::InsertAtLineBegin:
-        return buffer.iterator_at(sel.min().line);
+        return { sel.min().line, sel.min().line };
     case InsertMode::AppendAtLineEnd:
-        return buffer.iterator_at({sel.max().line, buffer[sel.max().line].length() - 1});
+    {
+        ByteCoord pos{sel.max().line, buffer[sel.max().line].length() - 1};
+        return { pos, pos };
+    }
     case InsertMode::InsertAtNextLineBegin:
-        return buffer.iterator_at(sel.max().line+1);
     case InsertMode::OpenLineBelow:
-        return buffer.insert(buffer.iterator_at(sel.max().line + 1), "\n");
+        return { sel.max().line+1, sel.max().line+1 };
     case InsertMode::OpenLineAbove:
-        return buffer.insert(buffer.iterator_at(sel.min().line), "\n");
+        return { sel.min().line, sel.min().line };
     }
     kak_assert(false);
     return {};
 }
 
+// All selections are modified through a single batch of buffer edits,
+// each selection having an edit for its string and one for the new line
+// of the open line modes.
 void SelectionList::insert(ArrayView<String> strings, InsertMode mode,
                            bool select_inserted)
 {
@@ -470,42 +482,66 @@ void SelectionList::insert(ArrayView<String> strings, InsertMode mode,
         return;
 
     update();
-    ForwardChangesTracker changes_tracker;
+    const bool open_line = mode == InsertMode::OpenLineBelow or
+                           mode == InsertMode::OpenLineAbove;
+    Vector<Buffer::Edit> edits;
+    edits.reserve(m_selections.size() * 2);
     for (size_t index = 0; index < m_selections.size(); ++index)
     {
-        auto& sel = m_selections[index];
+        const String& str = strings[std::min(index, strings.size()-1)];
+        auto range = insert_range(*m_buffer, m_selections[index], mode);
+        edits.push_back({ range.first, range.second, str });
+        edits.push_back({ range.second, range.second, open_line ? "\n" : StringView{} });
+    }
+    auto inserted = m_buffer->apply_batch(edits);
+    m_timestamp = m_buffer->timestamp();
 
-        sel.anchor() = changes_tracker.get_new_coord(sel.anchor());
-        kak_assert(m_buffer->is_valid(sel.anchor()));
-        sel.cursor() = changes_tracker.get_new_coord(sel.cursor());
-        kak_assert(m_buffer->is_valid(sel.cursor()));
+    // coordinates after the end of the last edit of a previous selection
+    // are moved as that end was.
+    ByteCoord old_pos, cur_pos;
+    auto new_coord = [&](ByteCoord coord) {
+        if (coord < old_pos)
+            return coord;
+        if (coord.line == old_pos.line)
+            coord.column += cur_pos.column - old_pos.column;
+        coord.line += cur_pos.line - old_pos.line;
+        return coord;
+    };
 
-        auto pos = prepare_insert(*m_buffer, sel, mode);
-        changes_tracker.update(*m_buffer, m_timestamp);
+    for (size_t index = 0; index < m_selections.size(); ++index)
+    {
+        auto& sel = m_selections[index];
+        auto& range = inserted[index * 2];
+        auto& next_range = inserted[index * 2 + 1];
 
-        const String& str = strings[std::min(index, strings.size()-1)];
-        if (str.empty())
+        sel.anchor() = new_coord(sel.anchor());
+        sel.cursor() = new_coord(sel.cursor());
+        old_pos = edits[index * 2 + 1].end;
+        cur_pos = next_range.second;
+
+        if (range.first == range.second)
         {
             if (mode == InsertMode::Replace)
-                sel.anchor() = sel.cursor() = m_buffer->clamp(pos.coord());
-            continue;
+                sel.anchor() = sel.cursor() = m_buffer->clamp(range.first);
+            else if (open_line)
+            {
+                sel.anchor() = m_buffer->clamp(update_insert(sel.anchor(), next_range.first, next_range.second));
+                sel.cursor() = m_buffer->clamp(update_insert(sel.cursor(), next_range.first, next_range.second));
+            }
         }
-
-        pos = m_buffer->insert(pos, str);
-
-        auto& change = m_buffer->changes_since(m_timestamp).back();
-        changes_tracker.update(change);
-        m_timestamp = m_buffer->timestamp();
-
-        if (select_inserted or mode == InsertMode::Replace)
+        else if (select_inserted or mode == InsertMode::Replace)
         {
-            sel.min() = change.begin;
-            sel.max() = m_buffer->char_prev(change.end);
+            sel.min() = range.first;
+            sel.max() = m_buffer->char_prev(range.second);
         }
         else
         {
-            sel.anchor() = m_buffer->clamp(update_insert(sel.anchor(), change.begin, change.end));
-            sel.cursor() = m_buffer->clamp(update_insert(sel.cursor(), change.begin, change.end));
+            auto update = [&](ByteCoord coord) {
+                coord = update_insert(coord, range.first, range.second);
+                return m_buffer->clamp(update_insert(coord, next_range.first, next_range.second));
+            };
+            sel.anchor() = update(sel.anchor());
+            sel.cursor() = update(sel.cursor());
         }
     }
     check_invariant();
@@ -515,26 +551,18 @@ void SelectionList::insert(ArrayView<String> strings, InsertMode mode,
 void SelectionList::erase()
 {
     update();
-    ForwardChangesTracker changes_tracker;
+    Vector<Buffer::Edit> edits;
+    edits.reserve(m_selections.size());
     for (auto& sel : m_selections)
-    {
-        sel.anchor() = changes_tracker.get_new_coord(sel.anchor());
-        kak_assert(m_buffer->is_valid(sel.anchor()));
-        sel.cursor() = changes_tracker.get_new_coord(sel.cursor());
-        kak_assert(m_buffer->is_valid(sel.cursor()));
-
-        auto pos = Kakoune::erase(*m_buffer, sel);
-        sel.anchor() = sel.cursor() = m_buffer->clamp(pos.coord());
-        changes_tracker.update(*m_buffer, m_timestamp);
-    }
+        edits.push_back({ sel.min(), m_buffer->char_next(sel.max()), {} });
+    auto erased = m_buffer->apply_batch(edits);
+    m_timestamp = m_buffer->timestamp();
 
     ByteCoord back_coord = m_buffer->back_coord();
-    for (auto& sel : m_selections)
+    for (size_t index = 0; index < m_selections.size(); ++index)
     {
-        if (sel.anchor() > back_coord)
-            sel.anchor() = back_coord;
-        if (sel.cursor() > back_coord)
-            sel.cursor() = back_coord;
+        auto& sel = m_selections[index];
+        sel.anchor() = sel.cursor() = std::min(m_buffer->clamp(erased[index].first), back_coord);
     }
     m_buffer->check_invariant();
 }
@@ -137,7 +137,7 @@ private:
     Vector<Selection> m_selections;
 
     safe_ptr<Buffer> m_buffer;
-    size_t m_timestamp;
+    ChangeTimestamp m_timestamp;
 };
 
 Vector<Selection> compute_modified_ranges(Buffer& buffer, size_t timestamp);
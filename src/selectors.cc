@@ -4,6 +4,8 @@
 #include "string.hh"
 
 #include <algorithm>
+#include <exception>
+#include <thread>
 
 namespace Kakoune
 {
@@ -496,7 +498,313 @@ void select_buffer(SelectionList& selections)
     selections = SelectionList{ buffer, target_eol({{0,0}, buffer.back_coord()}) };
 }
 
-using RegexIt = RegexIterator<BufferIterator>;
+using RangeIterator = ChunkedBufferRange::iterator;
+
+// RegexIterator step: next match from pos with flags, previous_empty
+// telling if the previous match was empty and ended at pos.
+template<typename Iterator>
+static bool next_regex_match(Iterator pos, Iterator end, Iterator base,
+                             const Regex& regex, RegexMatchFlags flags,
+                             bool previous_empty, MatchResults<Iterator>& res)
+{
+    using namespace regex_ns::regex_constants;
+#ifdef KAK_USE_STDREGEX
+    // std has no match_not_initial_null, do as std::regex_iterator: look
+    // for a non empty match at pos, then for any match after it.
+    if (previous_empty)
+    {
+        if (pos == end)
+            return false;
+        if (regex_find(pos, end, res, regex, flags | match_not_null | match_continuous, base))
+            return true;
+        ++pos;
+    }
+    return regex_find(pos, end, res, regex, flags, base);
+#else
+    return regex_find(pos, end, res, regex,
+                      previous_empty ? flags | match_not_initial_null : flags, base);
+#endif
+}
+
+// Appends the successive matches starting before limit, or all of them
+// if limit is end, searching from begin. Does not use the memory domains
+// so that it can run on worker threads.
+static void collect_matches(RangeIterator begin, RangeIterator limit,
+                            RangeIterator end, RangeIterator base,
+                            const Regex& regex, RegexMatchList& matches)
+{
+    MatchResults<RangeIterator> res;
+    RangeIterator pos = begin;
+    bool previous_empty = false;
+    while (next_regex_match(pos, end, base, regex, regex_ns::regex_constants::match_default,
+                            previous_empty, res) and
+           (res[0].first < limit or limit == end))
+    {
+        matches.push_back(res);
+        pos = res[0].second;
+        previous_empty = res[0].first == res[0].second;
+    }
+}
+
+static bool find_last_match(RangeIterator begin, RangeIterator end,
+                            MatchResults<RangeIterator>& res,
+                            const Regex& regex, RegexMatchFlags flags)
+{
+    MatchResults<RangeIterator> matches;
+    while (regex_find(begin, end, matches, regex, flags))
+    {
+        if (begin == matches[0].second)
+            break;
+        begin = matches[0].second;
+        res.swap(matches);
+    }
+    return not res.empty();
+}
+
+bool find_match_in_buffer(const Buffer& buffer, ByteCoord pos, Direction direction,
+                          const Regex& regex, BufferIterator& begin,
+                          BufferIterator& end, CaptureList& captures)
+{
+    auto search_range = [&](ByteCoord first, ByteCoord last, RegexMatchFlags flags) {
+        ChunkedBufferRange content{buffer, first, last};
+        MatchResults<RangeIterator> matches;
+        if (not (direction == Forward
+                 ? regex_find(content.begin(), content.end(), matches, regex, flags)
+                 : find_last_match(content.begin(), content.end(), matches, regex, flags)))
+            return false;
+
+        begin = ensure_char_start(buffer, content.buffer_iterator(matches[0].first));
+        end = ensure_char_start(buffer, content.buffer_iterator(matches[0].second));
+        captures.clear();
+        for (auto& match : matches)
+            captures.emplace_back(match.first, match.second);
+        return true;
+    };
+
+    // Matches that stay within a line can be searched in line ranges of
+    // growing size, starting from pos, so that only the lines near pos
+    // are searched when a match is found there. std regexes have no flags
+    // for window edges, matches_can_span_lines is always true for them.
+    const bool by_lines = not matches_can_span_lines(regex);
+    auto search = [&](ByteCoord first, ByteCoord last) {
+        using namespace regex_ns::regex_constants;
+        if (not by_lines)
+            return search_range(first, last, match_default);
+
+#ifndef KAK_USE_STDREGEX
+        const ByteCoord range_first = first, range_last = last;
+        for (LineCount count = 256; first < last; count *= 2)
+        {
+            const ByteCoord window_first = direction == Forward or last.line - count <= first.line
+                                         ? first : ByteCoord{last.line - count, 0};
+            const ByteCoord window_last = direction == Backward or first.line + count >= last.line
+                                        ? last : ByteCoord{first.line + count, 0};
+            RegexMatchFlags flags = match_default;
+            if (window_first != range_first)
+                flags |= match_not_bob;
+            if (window_last != range_last)
+                flags |= match_not_eob | match_not_eol;
+            if (search_range(window_first, window_last, flags))
+                return true;
+            if (direction == Forward)
+                first = window_last;
+            else
+                last = window_first;
+        }
+#endif
+        return false;
+    };
+
+    if (direction == Forward)
+        return search(pos, buffer.end_coord()) or search({0, 0}, buffer.end_coord());
+    else
+        return search({0, 0}, pos) or search({0, 0}, buffer.end_coord());
+}
+
+// Matches of a regex that cannot match an end of line stay inside a chunk,
+// so the chunks in [first, last) are searched one by one through const
+// char*, a match starting at the end of a chunk being found in the next one.
+// std regexes have no flags for chunk edges, and are never searched by
+// chunks as matches_can_span_lines is always true for them.
+static void collect_chunk_matches(const ChunkedBufferRange& range,
+                                  size_t first, size_t last,
+                                  const Regex& regex, RegexMatchList& matches)
+{
+    using namespace regex_ns::regex_constants;
+    const auto chunks = range.chunks();
+    MatchResults<const char*> res;
+    for (size_t i = first; i < last; ++i)
+    {
+        const auto& chunk = chunks[i];
+        const bool last_chunk = i == chunks.size() - 1;
+        RegexMatchFlags flags = match_default;
+#ifndef KAK_USE_STDREGEX
+        if (i != 0)
+            flags |= match_not_bob;
+        if (not last_chunk)
+            flags |= match_not_eob | match_not_eol;
+#endif
+
+        const char* pos = chunk.begin;
+        bool previous_empty = false;
+        while (next_regex_match(pos, chunk.end, chunk.begin, regex, flags, previous_empty, res) and
+               (res[0].first != chunk.end or last_chunk))
+        {
+            matches.sub_count = res.size();
+            for (auto& sub : res)
+            {
+                if (sub.matched)
+                    matches.subs.emplace_back(range.iterator_in(chunk, sub.first),
+                                              range.iterator_in(chunk, sub.second));
+                else
+                    matches.subs.emplace_back(range.end(), range.end());
+            }
+            pos = res[0].second;
+            previous_empty = res[0].first == res[0].second;
+        }
+    }
+}
+
+RegexMatchList find_all_matches(const ChunkedBufferRange& range, const Regex& regex,
+                                size_t min_chunk_size, size_t max_threads)
+{
+    RegexMatchList result;
+    const RangeIterator begin = range.begin(), end = range.end();
+    const auto chunks = range.chunks();
+    // an empty range has no chunk, but can have an empty match
+    const bool by_chunks = not chunks.empty() and not matches_can_span_lines(regex);
+    const size_t size = end - begin;
+    const size_t thread_count = std::min(max_threads, size / min_chunk_size);
+    if (thread_count < 2)
+    {
+        if (by_chunks)
+            collect_chunk_matches(range, 0, chunks.size(), regex, result);
+        else
+            collect_matches(begin, end, end, begin, regex, result);
+        return result;
+    }
+
+    // parts are made of whole chunks, and are searched in place, reading
+    // past their end for the matches that continue into the next ones.
+    std::vector<size_t> first_chunks{0};
+    for (size_t i = 1; i < thread_count; ++i)
+    {
+        const size_t offset = size * i / thread_count;
+        const size_t chunk = std::upper_bound(chunks.begin(), chunks.end(), offset,
+                                              [](size_t offset, const ChunkedBufferRange::Chunk& chunk)
+                                              { return offset < chunk.offset; }) - chunks.begin();
+        if (chunk < chunks.size() and chunk > first_chunks.back())
+            first_chunks.push_back(chunk);
+    }
+    first_chunks.push_back(chunks.size());
+    const size_t part_count = first_chunks.size() - 1;
+
+    std::vector<RangeIterator> starts;
+    for (auto chunk : first_chunks)
+        starts.push_back(chunk == chunks.size() ? end : RangeIterator{&chunks[chunk], chunks[chunk].begin});
+
+    // the parts are searched as if a search started at their beginning,
+    // buffer content does not change while we wait for the workers.
+    std::vector<RegexMatchList> parts(part_count);
+    std::vector<std::exception_ptr> errors(part_count);
+    auto search_part = [&](size_t i) {
+        try
+        {
+            if (by_chunks)
+                collect_chunk_matches(range, first_chunks[i], first_chunks[i+1], regex, parts[i]);
+            else
+                collect_matches(starts[i], starts[i+1], end, begin, regex, parts[i]);
+        }
+        catch (...)
+        {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < part_count; ++i)
+        workers.emplace_back(search_part, i);
+    search_part(0);
+    for (auto& worker : workers)
+        worker.join();
+    for (auto& error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    result = std::move(parts[0]);
+    // chunk matches are exact, parts only need to be concatenated
+    if (by_chunks)
+    {
+        for (size_t i = 1; i < part_count; ++i)
+        {
+            if (parts[i].size() == 0)
+                continue;
+            result.sub_count = parts[i].sub_count;
+            result.subs.insert(result.subs.end(), parts[i].subs.begin(), parts[i].subs.end());
+        }
+        return result;
+    }
+
+    // Merge the parts matches. Before handling part i, all merged
+    // matches start before it, and the next one would start inside or
+    // after it. When the last merged match overlaps part i, its matches
+    // are only valid from one the sequential search would find as well,
+    // so we search sequentially until reaching such a match.
+    RangeIterator pos = begin;
+    bool previous_empty = false;
+    auto update_pos = [&] {
+        if (result.size() == 0)
+            return;
+        auto& last = result.get(result.size()-1);
+        pos = last.second;
+        previous_empty = last.first == last.second;
+    };
+    update_pos();
+    for (size_t i = 1; i < part_count; ++i)
+    {
+        auto& part = parts[i];
+        size_t first = 0;
+        if (pos > starts[i])
+        {
+            while (first < part.size() and part.get(first).first < pos)
+                ++first;
+            // the part search reached pos right after a match that did not overlap it
+            const bool synced = first == 0 or part.get(first-1).second < pos or
+                (part.get(first-1).second == pos and part.get(first-1).first != pos);
+            if (not synced)
+            {
+                MatchResults<RangeIterator> res;
+                size_t index = first;
+                first = part.size();
+                while (next_regex_match(pos, end, begin, regex, regex_ns::regex_constants::match_default,
+                                        previous_empty, res) and
+                       (res[0].first < starts[i+1] or starts[i+1] == end))
+                {
+                    result.push_back(res);
+                    update_pos();
+                    while (index < part.size() and part.get(index).first < res[0].first)
+                        ++index;
+                    if (index < part.size() and part.get(index).first == res[0].first and
+                        part.get(index).second == res[0].second)
+                    {
+                        first = index + 1;
+                        break;
+                    }
+                }
+            }
+        }
+        if (first < part.size())
+        {
+            result.sub_count = part.sub_count;
+            result.subs.insert(result.subs.end(),
+                               part.subs.begin() + first * part.sub_count,
+                               part.subs.end());
+            update_pos();
+        }
+    }
+    return result;
+}
 
 void select_all_matches(SelectionList& selections, const Regex& regex)
 {
@@ -505,20 +813,20 @@ void select_all_matches(SelectionList& selections, const Regex& regex)
     for (auto& sel : selections)
     {
         auto sel_end = utf8::next(buffer.iterator_at(sel.max()), buffer.end());
-        RegexIt re_it(buffer.iterator_at(sel.min()), sel_end, regex);
-        RegexIt re_end;
-
-        for (; re_it != re_end; ++re_it)
+        ChunkedBufferRange range{buffer, buffer.iterator_at(sel.min()).coord(),
+                                 sel_end.coord()};
+        auto matches = find_all_matches(range, regex);
+        for (size_t i = 0; i < matches.size(); ++i)
         {
-            auto begin = ensure_char_start(buffer, (*re_it)[0].first);
-            auto end = ensure_char_start(buffer, (*re_it)[0].second);
+            auto begin = ensure_char_start(buffer, range.buffer_iterator(matches.get(i).first));
+            auto end = ensure_char_start(buffer, range.buffer_iterator(matches.get(i).second));
 
             if (begin == sel_end)
                 continue;
 
             CaptureList captures;
-            for (auto& match : *re_it)
-                captures.emplace_back(match.first, match.second);
+            for (size_t sub = 0; sub < matches.sub_count; ++sub)
+                captures.emplace_back(matches.get(i, sub).first, matches.get(i, sub).second);
 
             result.push_back(
                 keep_direction({ begin.coord(),
@@ -540,18 +848,17 @@ void split_selections(SelectionList& selections, const Regex& regex)
     {
         auto begin = buffer.iterator_at(sel.min());
         auto sel_end = utf8::next(buffer.iterator_at(sel.max()), buffer.end());
-        RegexIt re_it(begin, sel_end, regex);
-        RegexIt re_end;
-
-        for (; re_it != re_end; ++re_it)
+        ChunkedBufferRange range{buffer, begin.coord(), sel_end.coord()};
+        auto matches = find_all_matches(range, regex);
+        for (size_t i = 0; i < matches.size(); ++i)
         {
-            BufferIterator end = (*re_it)[0].first;
+            BufferIterator end = range.buffer_iterator(matches.get(i).first);
             if (end == buf_end)
                 continue;
 
             end = ensure_char_start(buffer, end);
             result.push_back(keep_direction({ begin.coord(), (begin == end) ? end.coord() : utf8::previous(end, begin).coord() }, sel));
-            begin = ensure_char_start(buffer, (*re_it)[0].second);
+            begin = ensure_char_start(buffer, range.buffer_iterator(matches.get(i).second));
         }
         if (begin.coord() <= sel.max())
             result.push_back(keep_direction({ begin.coord(), sel.max() }, sel));
@@ -8,6 +8,8 @@
 #include "utf8_iterator.hh"
 #include "regex.hh"
 
+#include <thread>
+
 namespace Kakoune
 {
 
@@ -228,40 +230,18 @@ void select_buffer(SelectionList& selections);
 
 enum Direction { Forward, Backward };
 
-inline bool find_last_match(BufferIterator begin, const BufferIterator& end,
-                            MatchResults<BufferIterator>& res,
-                            const Regex& regex)
-{
-    MatchResults<BufferIterator> matches;
-    while (regex_search(begin, end, matches, regex))
-    {
-        if (begin == matches[0].second)
-            break;
-        begin = matches[0].second;
-        res.swap(matches);
-    }
-    return not res.empty();
-}
-
-template<Direction direction>
-bool find_match_in_buffer(const Buffer& buffer, const BufferIterator pos,
-                          MatchResults<BufferIterator>& matches,
-                          const Regex& ex)
-{
-    if (direction == Forward)
-        return (regex_search(pos, buffer.end(), matches, ex) or
-                regex_search(buffer.begin(), buffer.end(), matches, ex));
-    else
-        return (find_last_match(buffer.begin(), pos, matches, ex) or
-                find_last_match(buffer.begin(), buffer.end(), matches, ex));
-}
-
 inline BufferIterator ensure_char_start(const Buffer& buffer, const BufferIterator& it)
 {
     return it != buffer.end() ?
         utf8::character_start(it, buffer.iterator_at(it.coord().line)) : it;
 }
 
+// Finds the first match after pos, or the last one before it, wrapping
+// around the buffer.
+bool find_match_in_buffer(const Buffer& buffer, ByteCoord pos, Direction direction,
+                          const Regex& regex, BufferIterator& begin,
+                          BufferIterator& end, CaptureList& captures);
+
 template<Direction direction>
 Selection find_next_match(const Buffer& buffer, const Selection& sel, const Regex& regex)
 {
@@ -269,17 +249,10 @@ Selection find_next_match(const Buffer& buffer, const Selection& sel, const Rege
     auto end = begin;
 
     CaptureList captures;
-    MatchResults<BufferIterator> matches;
-    bool found = false;
     auto pos = direction == Forward ? utf8::next(begin, buffer.end())
                                     : utf8::previous(begin, buffer.begin());
-    if ((found = find_match_in_buffer<direction>(buffer, pos, matches, regex)))
-    {
-        begin = ensure_char_start(buffer, matches[0].first);
-        end = ensure_char_start(buffer, matches[0].second);
-        for (auto& match : matches)
-            captures.emplace_back(match.first, match.second);
-    }
+    bool found = find_match_in_buffer(buffer, pos.coord(), direction, regex,
+                                      begin, end, captures);
     if (not found or begin == buffer.end())
         throw runtime_error("'" + regex.str() + "': no matches found");
 
@@ -290,6 +263,36 @@ Selection find_next_match(const Buffer& buffer, const Selection& sel, const Rege
     return {begin.coord(), end.coord(), std::move(captures)};
 }
 
+// Sub-expression bounds of successive regex matches. Uses std::vector as
+// it is filled from worker threads, which must not touch the memory
+// domain counters.
+struct RegexMatchList
+{
+    using Iterator = ChunkedBufferRange::iterator;
+
+    size_t sub_count = 0;
+    std::vector<std::pair<Iterator, Iterator>> subs;
+
+    size_t size() const { return sub_count ? subs.size() / sub_count : 0; }
+    const std::pair<Iterator, Iterator>& get(size_t match, size_t sub = 0) const
+    { return subs[match * sub_count + sub]; }
+
+    void push_back(const MatchResults<Iterator>& match)
+    {
+        sub_count = match.size();
+        for (auto& sub : match)
+            subs.emplace_back(sub.first, sub.second);
+    }
+};
+
+// Same matches as a RegexIterator over range. Ranges bigger than twice
+// min_chunk_size are split at the chunk boundaries of the range, and the
+// parts are searched in place in parallel on up to max_threads threads.
+RegexMatchList find_all_matches(const ChunkedBufferRange& range,
+                                const Regex& regex,
+                                size_t min_chunk_size = 1024 * 1024,
+                                size_t max_threads = std::thread::hardware_concurrency());
+
 void select_all_matches(SelectionList& selections,
                         const Regex& regex);
 
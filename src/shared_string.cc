@@ -1,28 +1,106 @@
 #include "shared_string.hh"
 #include "debug.hh"
 
+#include <cstring>
+
 namespace Kakoune
 {
 
+SlabAllocator& StringStorage::allocator()
+{
+    // never destroyed, as storages can outlive static objects
+    static SlabAllocator* allocator = new SlabAllocator;
+    return *allocator;
+}
+
+constexpr size_t StringRegistry::min_capacity;
+
 SharedString StringRegistry::intern(StringView str)
 {
-    auto it = m_strings.find(str);
-    if (it == m_strings.end())
+    if (str.empty())
+        return {};
+
+    const uint32_t hash = (uint32_t)hash_data(str.data(), (int)str.length());
+    const uint32_t length = (uint32_t)(int)str.length();
+    if ((m_count + 1) * 10 > m_entries.size() * 7)
+        rehash(std::max(min_capacity, m_entries.size() * 2));
+
+    ++m_lookups;
+    const size_t mask = m_entries.size() - 1;
+    for (size_t index = hash & mask, probe = 1; true; index = (index + 1) & mask, ++probe)
     {
-        SharedString shared_str = str;
-        it = m_strings.emplace(shared_str, shared_str.m_storage).first;
+        Entry& entry = m_entries[index];
+        if (entry.storage and (entry.hash != hash or entry.length != length or
+                               memcmp(entry.storage->data(), str.data(), length) != 0))
+            continue;
+
+        m_probes += probe;
+        m_max_probe = std::max(m_max_probe, probe);
+        if (entry.storage)
+            ++m_hits;
+        else
+        {
+            entry = Entry{hash, length, StringStorage::create(str)};
+            ++m_count;
+        }
+        return SharedString{entry.storage};
     }
-    return SharedString{it->second};
 }
 
-void StringRegistry::purge_unused()
+void StringRegistry::rehash(size_t capacity)
 {
-    for (auto it = m_strings.begin(); it != m_strings.end(); )
+    Vector<Entry, MemoryDomain::SharedString> old_entries(capacity);
+    std::swap(m_entries, old_entries);
+    const size_t mask = capacity - 1;
+    for (auto& entry : old_entries)
     {
-        if (it->second->refcount == 1)
-            it = m_strings.erase(it);
-        else
-            ++it;
+        if (not entry.storage)
+            continue;
+        size_t index = entry.hash & mask;
+        while (m_entries[index].storage)
+            index = (index + 1) & mask;
+        m_entries[index] = std::move(entry);
+    }
+    m_purge_cursor = 0;
+}
+
+// backward shift deletion, moving back the following entries which are
+// not at their ideal slot, so that lookups never need tombstones.
+void StringRegistry::erase_at(size_t index)
+{
+    const size_t mask = m_entries.size() - 1;
+    for (size_t next = (index + 1) & mask; m_entries[next].storage; next = (next + 1) & mask)
+    {
+        const size_t ideal = m_entries[next].hash & mask;
+        const bool stays = index < next ? (ideal > index and ideal <= next)
+                                        : (ideal > index or ideal <= next);
+        if (stays)
+            continue;
+        m_entries[index] = std::move(m_entries[next]);
+        index = next;
+    }
+    m_entries[index] = Entry{};
+    --m_count;
+}
+
+void StringRegistry::purge_unused(size_t max_slots)
+{
+    for (size_t visited = 0; visited < max_slots and not m_entries.empty(); ++visited)
+    {
+        if (m_purge_cursor < m_entries.size())
+        {
+            // on erase, the slot gets the next entry, so it is visited again
+            auto& storage = m_entries[m_purge_cursor].storage;
+            if (storage and storage->refcount == 1)
+                erase_at(m_purge_cursor);
+            else
+                ++m_purge_cursor;
+            continue;
+        }
+
+        m_purge_cursor = 0;
+        if (m_entries.size() > min_capacity and m_count * 4 < m_entries.size())
+            rehash(m_entries.size() / 2);
     }
 }
 
@@ -31,14 +109,23 @@ void StringRegistry::debug_stats() const
     write_debug("Shared Strings stats:");
     size_t total_refcount = 0;
     size_t total_size = 0;
-    size_t count = m_strings.size();
-    for (auto& st : m_strings)
+    for (auto& entry : m_entries)
     {
-        total_refcount += st.second->refcount - 1;
-        total_size += (int)st.second->length;
+        if (not entry.storage)
+            continue;
+        total_refcount += entry.storage->refcount - 1;
+        total_size += entry.length;
     }
-    write_debug("  data size: " + to_string(total_size) + ", mean: " + to_string((float)total_size/count));
-    write_debug("  refcounts: " + to_string(total_refcount) + ", mean: " + to_string((float)total_refcount/count));
+    // the table is empty until the first lookup
+    auto ratio = [](size_t value, size_t total) { return total != 0 ? (float)value/total : 0.f; };
+    const size_t count = m_count;
+    const size_t capacity = m_entries.size();
+    write_debug("  count: " + to_string(count) + ", table size: " + to_string(capacity) +
+                ", load: " + to_string(ratio(count, capacity)));
+    write_debug("  data size: " + to_string(total_size) + ", mean: " + to_string(ratio(total_size, count)));
+    write_debug("  refcounts: " + to_string(total_refcount) + ", mean: " + to_string(ratio(total_refcount, count)));
+    write_debug("  lookups: " + to_string(m_lookups) + ", hit rate: " + to_string(ratio(m_hits, m_lookups)));
+    write_debug("  probe length mean: " + to_string(ratio(m_probes, m_lookups)) + ", max: " + to_string(m_max_probe));
 }
 
 }
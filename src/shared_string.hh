@@ -4,7 +4,8 @@
 #include "string.hh"
 #include "ref_ptr.hh"
 #include "utils.hh"
-#include "unordered_map.hh"
+#include "vector.hh"
+#include "slab_allocator.hh"
 
 namespace Kakoune
 {
@@ -21,6 +22,20 @@ struct StringStorage : UseMemoryDomain<MemoryDomain::SharedString>
     [[gnu::always_inline]]
     StringView strview() const { return {data(), length}; }
 
+    // storages are allocated from slabs, accounted by their block size
+    static SlabAllocator& allocator();
+
+    static void* operator new(size_t size)
+    {
+        on_alloc(Domain, SlabAllocator::block_size(size));
+        return allocator().allocate(size);
+    }
+    static void operator delete(void* ptr, size_t size)
+    {
+        on_dealloc(Domain, SlabAllocator::block_size(size));
+        SlabAllocator::deallocate(ptr, size);
+    }
+
     static StringStorage* create(StringView str, char back = 0)
     {
         const int len = (int)str.length() + (back != 0 ? 1 : 0);
@@ -91,15 +106,39 @@ inline size_t hash_value(const SharedString& str)
     return hash_data(str.data(), (int)str.length());
 }
 
+// Interned strings, in an open addressing table that is purged incrementally
 class StringRegistry : public Singleton<StringRegistry>
 {
 public:
     void debug_stats() const;
     SharedString intern(StringView str);
-    void purge_unused();
+    // drop strings only referenced by the registry, visiting at most
+    // max_slots table slots, resuming where the previous call stopped
+    void purge_unused(size_t max_slots = 16 * 1024);
+
+    size_t size() const { return m_count; }
 
 private:
-    UnorderedMap<StringView, ref_ptr<StringStorage>, MemoryDomain::SharedString> m_strings;
+    struct Entry
+    {
+        uint32_t hash;
+        uint32_t length;
+        ref_ptr<StringStorage> storage;
+    };
+
+    void rehash(size_t capacity);
+    void erase_at(size_t index);
+
+    static constexpr size_t min_capacity = 64;
+
+    Vector<Entry, MemoryDomain::SharedString> m_entries;
+    size_t m_count = 0;
+    size_t m_purge_cursor = 0;
+
+    size_t m_lookups = 0;
+    size_t m_hits = 0;
+    size_t m_probes = 0;
+    size_t m_max_probe = 0;
 };
 
 inline SharedString intern(StringView str)
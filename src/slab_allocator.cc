@@ -0,0 +1,140 @@
+#include "slab_allocator.hh"
+
+#include "assert.hh"
+
+#include <new>
+#include <stdlib.h>
+
+namespace Kakoune
+{
+
+// Slabs are aligned on their size, so that the slab of a block is found
+// by masking its address. The header is followed by the blocks, which are
+// either in use, in the free list, or past the bump pointer.
+struct SlabAllocator::Slab
+{
+    SlabAllocator* owner;
+    Slab* prev;
+    Slab* next;
+    void* free_list;
+    char* bump;
+    uint32_t used;
+    uint32_t size_class;
+    bool partial;
+
+    char* end() { return reinterpret_cast<char*>(this) + slab_size; }
+    size_t block() const { return (size_class + 1) * granularity; }
+    bool full() { return free_list == nullptr and bump + block() > end(); }
+};
+
+SlabAllocator::~SlabAllocator()
+{
+    for (auto& head : m_partial)
+    {
+        while (Slab* slab = head)
+        {
+            kak_assert(slab->used == 0);
+            unlink(slab);
+            --m_slab_count;
+            free(slab);
+        }
+    }
+    kak_assert(m_slab_count == 0);
+}
+
+void* SlabAllocator::allocate(size_t size)
+{
+    if (size > max_block_size)
+        return ::operator new(size);
+
+    const uint32_t size_class = (uint32_t)((size - 1) / granularity);
+    Slab* slab = m_partial[size_class];
+    if (slab == nullptr)
+        slab = new_slab(size_class);
+
+    void* res;
+    if (slab->free_list)
+    {
+        res = slab->free_list;
+        slab->free_list = *reinterpret_cast<void**>(res);
+    }
+    else
+    {
+        res = slab->bump;
+        slab->bump += slab->block();
+    }
+    ++slab->used;
+    if (slab->full())
+        unlink(slab);
+    return res;
+}
+
+void SlabAllocator::deallocate(void* ptr, size_t size)
+{
+    if (size > max_block_size)
+        return ::operator delete(ptr);
+
+    Slab* slab = reinterpret_cast<Slab*>((uintptr_t)ptr & ~(uintptr_t)(slab_size - 1));
+    kak_assert(slab->size_class == (size - 1) / granularity);
+    kak_assert(slab->used > 0);
+
+    *reinterpret_cast<void**>(ptr) = slab->free_list;
+    slab->free_list = ptr;
+    --slab->used;
+
+    SlabAllocator& owner = *slab->owner;
+    if (not slab->partial)
+        owner.link(slab);
+    // keep the last slab of a size class around to avoid thrashing
+    else if (slab->used == 0 and
+             (slab->next or owner.m_partial[slab->size_class] != slab))
+    {
+        owner.unlink(slab);
+        --owner.m_slab_count;
+        free(slab);
+    }
+}
+
+SlabAllocator::Slab* SlabAllocator::new_slab(uint32_t size_class)
+{
+    constexpr size_t header_size = block_size(sizeof(Slab));
+
+    void* memory;
+    if (posix_memalign(&memory, slab_size, slab_size) != 0)
+        throw std::bad_alloc{};
+
+    Slab* slab = reinterpret_cast<Slab*>(memory);
+    slab->owner = this;
+    slab->free_list = nullptr;
+    slab->bump = reinterpret_cast<char*>(memory) + header_size;
+    slab->used = 0;
+    slab->size_class = size_class;
+    slab->partial = false;
+    link(slab);
+    ++m_slab_count;
+    return slab;
+}
+
+void SlabAllocator::link(Slab* slab)
+{
+    Slab*& head = m_partial[slab->size_class];
+    slab->prev = nullptr;
+    slab->next = head;
+    if (head)
+        head->prev = slab;
+    head = slab;
+    slab->partial = true;
+}
+
+void SlabAllocator::unlink(Slab* slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        m_partial[slab->size_class] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->partial = false;
+}
+
+}
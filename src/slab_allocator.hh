@@ -0,0 +1,58 @@
+#ifndef slab_allocator_hh_INCLUDED
+#define slab_allocator_hh_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Kakoune
+{
+
+// Allocator for many small blocks, such as buffer lines, carving them
+// from 64KB slabs holding blocks of a single size class. This avoids the
+// per allocation overhead of malloc. A slab is released once all its blocks
+// are freed, as slabs are shared by all buffers and interned strings, the
+// memory of a deleted buffer is only given back for slabs holding no other
+// block. Bigger blocks are forwarded to operator new. An allocator is not
+// thread safe.
+class SlabAllocator
+{
+public:
+    static constexpr size_t granularity = 16;
+    static constexpr size_t max_block_size = 512;
+    static constexpr size_t slab_size = 64 * 1024;
+
+    // actual memory used by a size bytes allocation
+    static constexpr size_t block_size(size_t size)
+    {
+        return size > max_block_size ? size
+             : (size + granularity - 1) & ~(granularity - 1);
+    }
+
+    SlabAllocator() = default;
+    ~SlabAllocator();
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    void* allocate(size_t size);
+    // size must be the one given to allocate
+    static void deallocate(void* ptr, size_t size);
+
+    size_t slab_count() const { return m_slab_count; }
+
+private:
+    struct Slab;
+
+    static constexpr size_t class_count = max_block_size / granularity;
+
+    Slab* new_slab(uint32_t size_class);
+    void link(Slab* slab);
+    void unlink(Slab* slab);
+
+    // slabs with free blocks, per size class
+    Slab* m_partial[class_count] = {};
+    size_t m_slab_count = 0;
+};
+
+}
+
+#endif // slab_allocator_hh_INCLUDED
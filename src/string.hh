@@ -99,7 +99,7 @@ public:
     CharCount char_length() const { return utf8::distance(begin(), end()); }
 
     [[gnu::always_inline]]
-    bool empty() { return m_length == 0_byte; }
+    bool empty() const { return m_length == 0_byte; }
 
     ByteCount byte_count_to(CharCount count) const;
     CharCount char_count_to(ByteCount count) const;
@@ -1,12 +1,27 @@
 #include "assert.hh"
 #include "buffer.hh"
+#include "buffer_utils.hh"
+#include "compression.hh"
+#include "diff.hh"
+#include "file.hh"
+#include "file_watcher.hh"
+#include "journal.hh"
 #include "keys.hh"
+#include "regex.hh"
+#include "selection.hh"
 #include "selectors.hh"
+#include "shared_string.hh"
+#include "slab_allocator.hh"
 #include "word_db.hh"
 #include "line_modification.hh"
 
+#include <string>
+#include <thread>
 #include <tuple>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 using namespace Kakoune;
 
 void test_buffer()
@@ -16,6 +31,11 @@ void test_buffer()
     Buffer buffer("test", Buffer::Flags::None, { "allo ?\n"_ss, "mais que fais la police\n"_ss,  " hein ?\n"_ss, " youpi\n"_ss });
     kak_assert(buffer.line_count() == 4);
 
+    kak_assert(buffer.offset_of({1, 2}) == 9);
+    kak_assert(buffer.coord_at(9) == ByteCoord{1 COMMA 2});
+    kak_assert(buffer.advance({0, 3}, 30) == ByteCoord{2 COMMA 2});
+    kak_assert(buffer.distance({2, 2}, {0, 3}) == -30);
+
     BufferIterator pos = buffer.begin();
     kak_assert(*pos == 'a');
     pos += 6;
@@ -52,6 +72,135 @@ void test_buffer()
     kak_assert(buffer.string(buffer.advance(buffer.end_coord(), -7), buffer.end_coord()) == StringView{"kanaky\n"});
     buffer.redo();
     kak_assert(buffer.string(buffer.advance(buffer.end_coord(), -6), buffer.end_coord()) == StringView{"mutch\n"});
+
+    // changes are kept until every selection list was updated past them
+    const size_t timestamp = buffer.timestamp();
+    SelectionList sels{buffer, Selection{{1, 0}, {2, 3}}};
+    for (int i = 0; i < 20000; ++i)
+        buffer.insert(buffer.begin(), "x\n");
+    {
+        SelectionList copy = sels;
+        sels.update();
+        kak_assert(sels[0].max() == ByteCoord{20002 COMMA 3});
+        buffer.compact_changes();
+        kak_assert(buffer.changes_available_since(timestamp));
+        copy = SelectionList{buffer, Selection{{0, 0}}};
+    }
+    buffer.compact_changes();
+    kak_assert(not buffer.changes_available_since(timestamp));
+    kak_assert(buffer.changes_available_since(buffer.timestamp()));
+    buffer.insert(buffer.begin(), "x\n");
+    sels.update();
+    kak_assert(sels.timestamp() == buffer.timestamp() and sels[0].max() == ByteCoord{20003 COMMA 3});
+
+    struct StringData : LineData { String content; };
+    ref_ptr<LineData> data = new StringData{};
+    String& content = static_cast<StringData&>(*data).content;
+    content = "tail";
+    for (int i = 0; i < 1000; ++i)
+        content += "\n" + to_string(i);
+    Buffer packed("packed", Buffer::Flags::NoUndo, { "head\n"_ss });
+    Buffer copied("copied", Buffer::Flags::None, { "head\n"_ss });
+    SelectionList packed_sels{packed, Selection{{0, 4}}};
+    packed.append(data, content);
+    copied.append(data, content);
+    kak_assert(packed.line_count() == 1001 and packed[0] == "headtail\n" and packed[1000] == "999\n");
+    kak_assert(packed.string({0,0}, packed.end_coord()) == copied.string({0,0}, copied.end_coord()));
+    kak_assert(packed.lines().lazy_byte_count() != 0 and copied.lines().lazy_byte_count() == 0);
+    packed_sels.update();
+    kak_assert(packed_sels[0].cursor() == ByteCoord{1000 COMMA 3});
+}
+
+void test_trim_fifo_lines()
+{
+    // fifo buffers end with an empty line, content gets appended before it
+    BufferLines lines;
+    for (int i = 0; i < 100; ++i)
+        lines.push_back(StringStorage::create(to_string(i), '\n'));
+    lines.push_back("\n"_ss);
+    Buffer buffer("fifo", Buffer::Flags::NoUndo, std::move(lines));
+    SelectionList sels{buffer, Selection{{60, 0}, {60, 1}}};
+
+    trim_fifo_lines(buffer, 0);
+    kak_assert(buffer.line_count() == 101);
+    trim_fifo_lines(buffer, 50);
+    kak_assert(buffer.line_count() == 50);
+    kak_assert(buffer[0] == "51\n" and buffer[48] == "99\n" and buffer[49] == "\n");
+    sels.update();
+    kak_assert(sels[0].min() == ByteCoord{9 COMMA 0} and sels[0].max() == ByteCoord{9 COMMA 1});
+    kak_assert(buffer.string(sels[0].min(), buffer.char_next(sels[0].max())) == "60");
+
+    // appended as packed lines, as fifo content is
+    struct StringData : LineData { String content; };
+    for (int i = 100; i < 1000; i += 300)
+    {
+        ref_ptr<LineData> data = new StringData{};
+        String& content = static_cast<StringData&>(*data).content;
+        for (int j = i; j < i + 300; ++j)
+            content += to_string(j) + "\n";
+        buffer.append(data, content);
+        trim_fifo_lines(buffer, 50);
+        kak_assert(buffer.line_count() == 50);
+        kak_assert(buffer[0] == to_string(i + 251) + "\n" and
+                   buffer[48] == to_string(i + 299) + "\n" and buffer[49] == "\n");
+    }
+    // the line the selection was on got dropped
+    sels.update();
+    kak_assert(sels[0].max() == ByteCoord{0 COMMA 0});
+}
+
+void test_apply_batch()
+{
+    Buffer buffer("test", Buffer::Flags::None, { "allo ?\n"_ss, "mais que fais la police\n"_ss,  " hein ?\n"_ss, " youpi\n"_ss });
+    const size_t timestamp = buffer.timestamp();
+    SelectionList sels{buffer, Selection{{1, 5}, {1, 7}}};
+    Vector<Buffer::Edit> edits = {
+        { {0, 0}, {0, 0}, "[" },
+        { {0, 4}, {1, 4}, "\n" },
+        { {1, 5}, {1, 8}, "rien" },
+        { {2, 1}, {2, 5}, {} },
+        { {3, 6}, {4, 0}, "!\nyop" },
+    };
+    auto inserted = buffer.apply_batch(edits);
+    kak_assert(buffer.string({0,0}, buffer.end_coord()) ==
+               StringView{"[allo\n rien fais la police\n  ?\n youpi!\nyop\n"});
+    kak_assert(inserted[2].first == ByteCoord{1 COMMA 1} and inserted[2].second == ByteCoord{1 COMMA 5});
+    kak_assert(inserted[4].first == ByteCoord{3 COMMA 6} and inserted[4].second == ByteCoord{4 COMMA 3});
+    kak_assert(buffer.changes_since(timestamp).size() == 7);
+    sels.update();
+    kak_assert(sels[0].min() == ByteCoord{1 COMMA 5} and sels[0].max() == ByteCoord{1 COMMA 5});
+
+    buffer.commit_undo_group();
+    buffer.undo();
+    kak_assert(buffer.string({0,0}, buffer.end_coord()) ==
+               StringView{"allo ?\nmais que fais la police\n hein ?\n youpi\n"});
+
+    // edits far enough apart are applied in separate clusters, on lines
+    // moved by the previous ones
+    BufferLines lines;
+    String expected;
+    for (int i = 0; i < 200; ++i)
+    {
+        String line = (i >= 10 and i <= 20) ? String('b', 60)
+                    : (i == 100 ? String('x', 50) + "ZZ" + to_string(i) : to_string(i));
+        lines.push_back(StringStorage::create(line, '\n'));
+        if (i < 10 or i > 20)
+            expected += (i == 100 ? String('x', 50) + to_string(i) : i == 150 ? String{"[150"} : line) + "\n";
+    }
+    Buffer far("far", Buffer::Flags::None, std::move(lines));
+    Vector<Buffer::Edit> far_edits = {
+        { {10, 0}, {21, 0}, {} },
+        { {100, 50}, {100, 52}, {} },
+        { {150, 0}, {150, 0}, "[" },
+    };
+    inserted = far.apply_batch(far_edits);
+    kak_assert(far.line_count() == 189);
+    kak_assert(far.string({0,0}, far.end_coord()) == expected);
+    kak_assert(inserted[1].first == ByteCoord{89 COMMA 50} and inserted[2].second == ByteCoord{139 COMMA 1});
+    far.commit_undo_group();
+    far.undo();
+    kak_assert(far.line_count() == 200 and far[10] == String('b', 60) + "\n" and
+               far[100] == String('x', 50) + "ZZ100\n");
 }
 
 void test_undo_group_optimizer()
@@ -74,6 +223,213 @@ void test_undo_group_optimizer()
         kak_assert(SharedString{lines[i]} == buffer[LineCount((int)i)]);
 }
 
+void test_line_list()
+{
+    auto make_lines = [](int first, int count) {
+        BufferLines lines;
+        for (int i = 0; i < count; ++i)
+            lines.push_back(StringStorage::create(to_string(first + i), '\n'));
+        return lines;
+    };
+
+    Vector<int> expected;
+    for (int i = 0; i < 5000; ++i)
+        expected.push_back(i);
+    LineList lines{make_lines(0, 5000)};
+
+    auto check = [&]() {
+        lines.check_invariant();
+        kak_assert(lines.size() == expected.size());
+        size_t offset = 0;
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            const LineCount line = (int)i;
+            kak_assert(lines[line] == to_string(expected[i]) + "\n");
+            kak_assert(lines.offset_of(line) == offset);
+            size_t line_offset = 0;
+            kak_assert(lines.line_at(offset + 1, line_offset) == line and
+                       line_offset == offset);
+            offset += (int)lines[line].length();
+        }
+        kak_assert(lines.byte_count() == offset);
+    };
+    check();
+
+    auto replace = [&](int first, int last, int value, int count) {
+        lines.replace(first, last, make_lines(value, count));
+        expected.erase(expected.begin() + first, expected.begin() + last);
+        for (int i = 0; i < count; ++i)
+            expected.insert(expected.begin() + first + i, value + i);
+    };
+
+    replace(10, 10, 10000, 3000);
+    check();
+    replace(100, 4000, 20000, 1);
+    check();
+    for (int i = 0; i < 600; ++i)
+        replace(2000, 2001, 30000 + i, 0);
+    check();
+    replace(0, (int)expected.size(), 40000, 1);
+    check();
+    replace(1, 1, 50000, 2);
+    check();
+
+    // repeated block splits at the same place and at the end move the
+    // blocks around them to free slots
+    for (int i = 0; i < 4000; ++i)
+        replace(1, 1, 80000 + 2 * i, 2);
+    check();
+    for (int i = 0; i < 4000; ++i)
+        replace((int)expected.size(), (int)expected.size(), 90000 + 3 * i, 3);
+    check();
+    // slots are given back once most lines are removed
+    replace(100, (int)expected.size() - 100, 100000, 0);
+    check();
+
+    struct StringData : LineData { String content; };
+    ref_ptr<LineData> data = new StringData{};
+    String& content = static_cast<StringData&>(*data).content;
+    expected.clear();
+    for (int i = 0; i < 3000; ++i)
+    {
+        content += to_string(i) + "\n";
+        expected.push_back(i);
+    }
+    lines = LineList{};
+    lines.append_packed(data, content);
+    kak_assert(lines.lazy_byte_count() == (int)content.length());
+    check();
+
+    replace(1500, 1502, 60000, 3);
+    check();
+    kak_assert(lines.lazy_byte_count() < (int)content.length());
+    kak_assert(lines.get_storage(10)->strview() == "10\n");
+    lines.load_all();
+    kak_assert(lines.lazy_byte_count() == 0);
+    check();
+
+    // first pack call only marks modified blocks as cold
+    auto& shared_string_bytes = domain_allocated_bytes[(int)MemoryDomain::SharedString];
+    const size_t unpacked_bytes = shared_string_bytes;
+    lines.pack();
+    check();
+    lines.pack();
+    kak_assert(shared_string_bytes < unpacked_bytes);
+    check();
+    {
+        // loading a block keeps views into its packed data valid
+        const StringView view = lines[1000];
+        const String line = to_string(expected[1000]) + "\n";
+        lines.get_storage(1000);
+        kak_assert(lines[1000].data() != view.data() and view == line);
+    }
+    {
+        const String line = to_string(expected[1600]) + "\n";
+        auto storage = lines.get_storage(1600);
+        replace(1700, 1701, 70000, 2);
+        lines.pack();
+        lines.pack();
+        kak_assert(storage->strview() == line);
+    }
+    check();
+}
+
+void test_pack_lines()
+{
+    String data;
+    for (int i = 0; i < 500; ++i)
+        data += "line " + to_string(i) + (i % 3 == 0 ? "\r\n" : (i % 11 == 0 ? "\r" : "\n"));
+    data += "no end of line";
+
+    // lone '\r's end lines as well
+    String expected;
+    for (auto it = data.begin(); it != data.end(); ++it)
+    {
+        if (*it == '\r' and it+1 != data.end() and *(it+1) == '\n')
+            continue;
+        expected += *it == '\r' ? '\n' : *it;
+    }
+    expected += '\n';
+
+    for (auto part : { std::make_pair(1024, 1), std::make_pair(64, 4),
+                       std::make_pair(1000, 8), std::make_pair(10, 3) })
+    {
+        StringView content;
+        bool crlf = false;
+        auto packed = pack_lines(data, content, crlf, part.first, part.second);
+        kak_assert(crlf);
+        kak_assert(content == expected);
+    }
+
+    StringView content;
+    bool crlf = false;
+    auto packed = pack_lines("a\nb\nc", content, crlf, 1, 4);
+    kak_assert(not crlf and content == "a\nb\nc\n");
+}
+
+void test_write_lines()
+{
+    String expected;
+    for (int i = 0; i < 6000; ++i)
+        expected += "line " + to_string(i) + "\n";
+
+    // packed lines get merged into single iovecs, between the lines of
+    // blocks unpacked by a modification
+    StringView content;
+    bool crlf = false;
+    LineList lines;
+    lines.append_packed(pack_lines(expected, content, crlf), content);
+    for (int i = 100; i < 6000; i += 1000)
+        lines.set(i, StringStorage::create("line " + to_string(i), '\n'));
+    kak_assert(lines.byte_count() == (size_t)(int)expected.length());
+
+    // a non blocking pipe smaller than the data makes writes partial, ending
+    // in the middle of iovecs, and then fail with EAGAIN until it is read.
+    auto write_through_pipe = [&](StringView eoldata, bool bom) {
+        int fds[2];
+        const int piped = pipe(fds);
+        kak_assert(piped == 0);
+        #ifdef F_SETPIPE_SZ
+        fcntl(fds[1], F_SETPIPE_SZ, 4096);
+        #endif
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        std::string received;
+        std::thread reader{[&] {
+            char buffer[1000];
+            ssize_t count;
+            while ((count = read(fds[0], buffer, sizeof(buffer))) > 0)
+                received.append(buffer, count);
+        }};
+        const int error = write_lines(fds[1], lines, eoldata, bom);
+        close(fds[1]);
+        reader.join();
+        close(fds[0]);
+        kak_assert(error == 0);
+        return String{received.data(), received.data() + received.size()};
+    };
+
+    String crlf_expected;
+    for (auto c : expected)
+    {
+        if (c == '\n')
+            crlf_expected += '\r';
+        crlf_expected += c;
+    }
+
+    kak_assert(write_through_pipe("\n", false) == expected);
+    const String crlf_written = write_through_pipe("\r\n", false);
+    kak_assert(crlf_written == crlf_expected);
+    const String bom_written = write_through_pipe("\n", true);
+    kak_assert(bom_written == "\xEF\xBB\xBF" + expected);
+
+    // reading back gives the original lines and end of line format
+    auto packed = pack_lines(crlf_written, content, crlf);
+    kak_assert(crlf and content == expected);
+    crlf = false;
+    packed = pack_lines(bom_written.substr(3_byte), content, crlf);
+    kak_assert(not crlf and content == expected);
+}
+
 void test_word_db()
 {
     Buffer buffer("test", Buffer::Flags::None,
@@ -96,6 +452,28 @@ void test_word_db()
     res = word_db.find_matching("", subsequence_match);
     std::sort(res.begin(), res.end());
     kak_assert(res == WordDB::WordList{ "allo" COMMA "mutch" COMMA "retchou" COMMA "tchou" });
+
+    // lines are referenced in place, blocks of the buffer can still be
+    // packed, and get referenced once they are.
+    BufferLines lines;
+    for (int i = 0; i < 2000; ++i)
+        lines.push_back(StringStorage::create("word" + to_string(i % 50) + " other\n"));
+    Buffer packed_buffer("packed", Buffer::Flags::None, std::move(lines));
+    WordDB packed_db(packed_buffer);
+    auto& shared_string_bytes = domain_allocated_bytes[(int)MemoryDomain::SharedString];
+    const size_t unpacked_bytes = shared_string_bytes;
+    packed_buffer.compact_lines();
+    packed_buffer.compact_lines();
+    kak_assert(shared_string_bytes + 2000 * 12 < unpacked_bytes);
+    for (int i = 0; i < 600; ++i)
+    {
+        packed_buffer.insert(packed_buffer.iterator_at({i * 3, 0}), "new ");
+        packed_db.find_matching("", prefix_match);
+        packed_buffer.compact_lines();
+    }
+    kak_assert(packed_db.get_word_occurences("new") == 600);
+    kak_assert(packed_db.get_word_occurences("other") == 2000);
+    kak_assert(packed_db.get_word_occurences("word7") == 40);
 }
 
 void test_utf8()
@@ -226,6 +604,604 @@ void test_line_modifications()
         auto modifs = compute_line_modifications(buffer, ts);
         kak_assert(modifs.size() == 1 && modifs[0] == LineModification{ 0 COMMA 0 COMMA 1 COMMA 1 });
     }
+
+    {
+        Buffer buffer("test", Buffer::Flags::None,
+                      { "line 1\n"_ss, "line 2\n"_ss, "line 3\n"_ss, "line 4\n"_ss });
+        auto ts = buffer.timestamp();
+        buffer.reload({ "line 1\n"_ss, "new line\n"_ss, "line 3\n"_ss, "line 4\n"_ss, "line 5\n"_ss });
+        auto modifs = compute_line_modifications(buffer, ts);
+        kak_assert(modifs.size() == 2 &&
+                   modifs[0] == LineModification{ 1 COMMA 1 COMMA 1 COMMA 1 } &&
+                   modifs[1] == LineModification{ 4 COMMA 4 COMMA 0 COMMA 1 });
+
+        buffer.undo();
+        kak_assert(buffer.line_count() == 4 and buffer[1] == "line 2\n" and
+                   buffer[3] == "line 4\n");
+    }
+}
+
+void test_diff()
+{
+    auto check = [](StringView a, StringView b, int max_cost, int expected_cost) {
+        auto diffs = find_diff(a.begin(), (int)a.length(), b.begin(), (int)b.length(), max_cost);
+        String res;
+        int pos = 0, cost = 0;
+        for (auto& diff : diffs)
+        {
+            if (diff.mode == Diff::Keep)
+                res += a.substr(ByteCount{pos}, ByteCount{diff.len});
+            else if (diff.mode == Diff::Add)
+                res += b.substr(ByteCount{diff.posB}, ByteCount{diff.len});
+            if (diff.mode != Diff::Add)
+                pos += diff.len;
+            if (diff.mode != Diff::Keep)
+                cost += diff.len;
+        }
+        kak_assert(res == b and pos == (int)a.length() and cost == expected_cost);
+    };
+
+    check("ABCABBA", "CBABAC", 100, 5);
+    check("ABCABBA", "CBABAC", 1, 13);
+    check("kakoune", "kakoune", 100, 0);
+    check("", "abc", 100, 3);
+    check("the quick brown fox", "the slow brown dog", 100, 13);
+}
+
+void test_compression()
+{
+    auto check = [](StringView data) {
+        String compressed = compress(data);
+        kak_assert(decompress(compressed) == data);
+        return compressed.length();
+    };
+    check("");
+    check("abc");
+    check("abcabcabcabcabcabcabcabcabcabcabcabcabcabcabc");
+
+    auto is_invalid = [](StringView data) {
+        try { decompress(data); }
+        catch (runtime_error&) { return true; }
+        return false;
+    };
+    // lengths are checked against the available data
+    kak_assert(is_invalid("\xff\xff\xff\xff\x0f\x03" "abc"));
+    kak_assert(is_invalid("\x10\x03" "abc\x03\xff\xff\xff\xff\x0f"));
+    kak_assert(is_invalid("\x06\x03" "abc"));
+    String repeated;
+    for (int i = 0; i < 1000; ++i)
+        repeated += "line " + to_string(i % 37) + "\n";
+    kak_assert(check(repeated) < repeated.length() / 4);
+}
+
+void test_slab_allocator()
+{
+    SlabAllocator allocator;
+    Vector<char*> blocks;
+    for (int i = 0; i < 10000; ++i)
+    {
+        char* block = (char*)allocator.allocate(24);
+        kak_assert(blocks.empty() or block != blocks.back());
+        memset(block, i, 24);
+        blocks.push_back(block);
+    }
+    kak_assert(allocator.slab_count() > 1);
+
+    for (int i = 0; i < blocks.size(); ++i)
+        kak_assert(blocks[i][23] == (char)i);
+    for (auto block : blocks)
+        SlabAllocator::deallocate(block, 24);
+    kak_assert(allocator.slab_count() == 1);
+
+    void* big = allocator.allocate(4096);
+    SlabAllocator::deallocate(big, 4096);
+    kak_assert(allocator.slab_count() == 1);
+}
+
+void test_string_registry()
+{
+    auto& registry = StringRegistry::instance();
+    registry.purge_unused(1 << 20);
+    const size_t initial_size = registry.size();
+    {
+        Vector<SharedString> strings;
+        for (int i = 0; i < 5000; ++i)
+            strings.push_back(intern("interned " + to_string(i)));
+        kak_assert(registry.size() == initial_size + 5000);
+        for (int i = 0; i < 5000; i += 7)
+        {
+            SharedString str = intern("interned " + to_string(i));
+            kak_assert(str.data() == strings[i].data());
+        }
+        kak_assert(intern("").empty());
+
+        strings.erase(strings.begin(), strings.begin() + 2500);
+        registry.purge_unused(1 << 20);
+        kak_assert(registry.size() == initial_size + 2500);
+        for (int i = 2500; i < 5000; ++i)
+            kak_assert(intern("interned " + to_string(i)).data() == strings[i - 2500].data());
+    }
+    registry.purge_unused(1 << 20);
+    kak_assert(registry.size() == initial_size);
+}
+
+void test_undo_history()
+{
+    Buffer buffer("test", Buffer::Flags::None, { "allo ?\n"_ss, "mais que fais la police\n"_ss });
+    const String initial = buffer.string({0,0}, buffer.end_coord());
+    for (int i = 0; i < 50; ++i)
+    {
+        buffer.insert(buffer.iterator_at({1, 5}), "tchou " + to_string(i) + "\n");
+        buffer.erase(buffer.iterator_at({0, 0}), buffer.iterator_at({0, 1}));
+        buffer.commit_undo_group();
+    }
+    const String modified = buffer.string({0,0}, buffer.end_coord());
+    const ByteCoord last_coord = buffer.last_modification_coord();
+
+    // pack all groups away from the cursor, and spill them to a file
+    buffer.compact_history(1);
+    for (int i = 0; i < 25; ++i)
+    {
+        const bool undone = buffer.undo();
+        kak_assert(undone);
+    }
+    buffer.compact_history(0);
+    kak_assert(buffer.last_modification_coord() == last_coord);
+    while (buffer.undo())
+        buffer.compact_history(1);
+    kak_assert(buffer.string({0,0}, buffer.end_coord()) == initial);
+    buffer.compact_history(1);
+    while (buffer.redo())
+        buffer.compact_history(0);
+    kak_assert(buffer.string({0,0}, buffer.end_coord()) == modified);
+
+    for (int i = 0; i < 10; ++i)
+        buffer.undo();
+    const String serialized = buffer.serialize_history();
+    Buffer mismatching("mismatching", Buffer::Flags::None, { "allo ?\n"_ss });
+    const bool mismatching_restored = mismatching.restore_history({}, serialized);
+    kak_assert(not mismatching_restored);
+
+    auto buffer_lines = [](const Buffer& buffer) {
+        BufferLines lines;
+        for (auto line = 0_line; line < buffer.line_count(); ++line)
+            lines.push_back(buffer.line_storage(line));
+        return lines;
+    };
+    Buffer restored("restored", Buffer::Flags::None, buffer_lines(buffer));
+    const bool restored_history = restored.restore_history({}, serialized);
+    kak_assert(restored_history);
+    kak_assert(not restored.is_modified());
+    while (restored.redo()) {}
+    kak_assert(restored.string({0,0}, restored.end_coord()) == modified);
+    while (restored.undo()) {}
+    kak_assert(restored.string({0,0}, restored.end_coord()) == initial);
+
+    // a redo branch can start in the restored groups, the ones kept are
+    // serialized again along with the new ones
+    for (int i = 0; i < 20; ++i)
+    {
+        const bool redone = restored.redo();
+        kak_assert(redone);
+    }
+    restored.insert(restored.iterator_at({0, 0}), "branch\n");
+    restored.commit_undo_group();
+    const bool redone = restored.redo();
+    kak_assert(not redone);
+    const String branch = restored.string({0,0}, restored.end_coord());
+    Buffer reloaded("reloaded", Buffer::Flags::None, buffer_lines(restored));
+    const String reserialized = restored.serialize_history();
+    const bool reloaded_history = reloaded.restore_history({}, reserialized);
+    kak_assert(reloaded_history);
+    kak_assert(reloaded.last_modification_coord() == restored.last_modification_coord());
+    while (reloaded.undo()) {}
+    kak_assert(reloaded.string({0,0}, reloaded.end_coord()) == initial);
+    while (reloaded.redo()) {}
+    kak_assert(reloaded.string({0,0}, reloaded.end_coord()) == branch);
+
+    // undo files can be corrupted, replace the group before the cursor
+    auto check_corrupted = [&](StringView uncompressed, bool compressed) {
+        String corrupted = serialized;
+        uint64_t count, cursor;
+        memcpy(&count, corrupted.data() + 16, sizeof(count));
+        memcpy(&cursor, corrupted.data() + 24, sizeof(cursor));
+        const String group = compressed ? compress(uncompressed) : String{uncompressed};
+        const uint64_t index[] = { corrupted.stdstr().size() - 32 - count * 16,
+                                   group.stdstr().size() };
+        memcpy(&corrupted.stdstr()[32 + (cursor - 1) * 16], index, sizeof(index));
+        corrupted += group;
+
+        Buffer buf("corrupted", Buffer::Flags::None, buffer_lines(buffer));
+        const String content = buf.string({0,0}, buf.end_coord());
+        const bool restored_corrupted = buf.restore_history({}, corrupted);
+        kak_assert(restored_corrupted);
+        bool discarded = false;
+        try { buf.undo(); }
+        catch (runtime_error&) { discarded = true; }
+        kak_assert(discarded);
+        kak_assert(buf.string({0,0}, buf.end_coord()) == content);
+        const bool undone = buf.undo();
+        kak_assert(not undone);
+    };
+    check_corrupted("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", false);
+    // huge modification count
+    check_corrupted("\xff\xff\xff\xff\x0f\0\0\0\0", true);
+    // unknown modification type
+    check_corrupted({"\x01\x05\0\0\x01z", 6}, true);
+    // erasing content not in the buffer
+    check_corrupted({"\x01\0\0\0\x03zzz", 8}, true);
+    // erasing past the buffer end
+    check_corrupted({"\x01\0\xfe\xff\x03\0\x01z", 8}, true);
+
+    // dropping the redo branch leaves its spilled groups unused, the
+    // spill file gets compacted once they take most of it
+    while (buffer.redo()) {}
+    for (int i = 0; i < 30; ++i)
+        buffer.undo();
+    buffer.compact_history(1);
+    const size_t spill_file_size = buffer.spill_file_size();
+    buffer.insert(buffer.iterator_at({0, 0}), "new ");
+    buffer.commit_undo_group();
+    buffer.compact_history(1);
+    kak_assert(buffer.spill_file_size() < spill_file_size);
+    while (buffer.undo())
+        buffer.compact_history(1);
+    kak_assert(buffer.string({0,0}, buffer.end_coord()) == initial);
+}
+
+void test_journal()
+{
+    char filename[] = "/tmp/kak-journal-test-XXXXXX";
+    close(mkstemp(filename));
+    auto remove_file = on_scope_end([&]{ unlink(filename); });
+
+    Journal journal;
+    journal.enable(filename);
+    kak_assert(journal.recording() and not journal.stale());
+    journal.insert({0, 0}, "foo\n");
+    const size_t position = journal.position();
+    journal.erase({1, 2}, 3);
+    journal.insert({2, 0}, "bar");
+    journal.flush();
+
+    // another session finds the journal, and does not overwrite it
+    auto read_records = [&](String& data) {
+        Journal other;
+        other.enable(filename);
+        kak_assert(other.stale() and not other.recording());
+        return other.read_stale(data);
+    };
+    {
+        String data;
+        auto records = read_records(data);
+        kak_assert(records.size() == 3);
+        kak_assert(records[0].type == Journal::Record::Insert and
+                   (records[0].coord == ByteCoord{0, 0}) and records[0].content == "foo\n");
+        kak_assert(records[1].type == Journal::Record::Erase and
+                   (records[1].coord == ByteCoord{1, 2}) and records[1].length == 3);
+        kak_assert(records[2].content == "bar" and records[2].end == data.stdstr().size());
+    }
+
+    // saving the state at position only keeps the following edits
+    journal.saved(position);
+    {
+        String data;
+        auto records = read_records(data);
+        kak_assert(records.size() == 2 and records[0].type == Journal::Record::Erase);
+    }
+
+    // the journal does not apply once the file changed
+    {
+        Journal other;
+        other.enable(filename);
+        int fd = open(filename, O_WRONLY | O_APPEND);
+        ssize_t written = write(fd, "changed", 7);
+        kak_assert(written == 7);
+        close(fd);
+        String data;
+        bool thrown = false;
+        try { other.read_stale(data); } catch (runtime_error&) { thrown = true; }
+        kak_assert(thrown);
+    }
+
+    journal.saved(journal.position());
+    Journal other;
+    other.enable(filename);
+    kak_assert(not other.stale());
+
+    // saving a buffer with a stale journal keeps it aside, and resumes
+    // journaling
+    journal.insert({0, 0}, "baz\n");
+    journal.flush();
+    const String journal_data = read_file(hidden_file_path(filename, ".kak.journal"));
+    {
+        Journal stale;
+        stale.enable(filename);
+        kak_assert(stale.stale() and not stale.recording());
+        stale.saved(stale.position());
+        kak_assert(not stale.stale() and stale.recording());
+        auto remove_stale = on_scope_end([&]{ unlink(stale.stale_path().c_str()); });
+        kak_assert(stale.stale_path() == hidden_file_path(filename, ".kak.journal.orig"));
+        kak_assert(read_file(stale.stale_path()) == journal_data);
+    }
+}
+
+void test_regex()
+{
+#ifndef KAK_USE_STDREGEX
+    kak_assert(Regex{"foo"}.literal_prefix() == "foo");
+    kak_assert(Regex{R"(^\bfoo\.bar)"}.literal_prefix() == "foo.bar");
+    kak_assert(Regex{"foob?"}.literal_prefix() == "foo");
+    kak_assert(Regex{"foo(bar|baz)"}.literal_prefix() == "foo");
+    kak_assert(Regex{"foo|bar"}.literal_prefix() == "");
+    kak_assert(Regex{R"(foo[|(]\(|bar)"}.literal_prefix() == "");
+    kak_assert(Regex{R"(foo\d)"}.literal_prefix() == "foo");
+    kak_assert((Regex{"foo", Regex::icase}.literal_prefix() == ""));
+    kak_assert(Regex{".foo"}.literal_prefix() == "");
+    kak_assert(Regex{"(?<!')\""}.literal_prefix() == "\"");
+    kak_assert(Regex{R"(a\nb+c)"}.literal_prefix() == "a\nb");
+    kak_assert(Regex{R"(\<foo\>)"}.literal_prefix() == "foo");
+    kak_assert(Regex{R"(\bfoo)"}.literal_prefix() == "foo");
+    kak_assert(Regex{R"(foo\>)"}.literal_prefix() == "foo");
+    kak_assert(Regex{R"(foo\')"}.literal_prefix() == "foo");
+    kak_assert(Regex{R"(\')"}.literal_prefix() == "");
+
+    kak_assert(required_bytes(Regex{R"((?<!\\)(\\\\)*")"}) == "\"");
+    kak_assert(required_bytes(Regex{R"(^\h*?#\h*if\h+(0|FALSE)\b)"}) == "#if");
+    kak_assert(required_bytes(Regex{R"(x\d+y?z)"}) == "xz");
+    kak_assert(required_bytes(Regex{R"(\<foo\>)"}) == "fo");
+    kak_assert(required_bytes(Regex{R"(\`#\h*if\>)"}) == "#if");
+    kak_assert(required_bytes(Regex{R"(\<)"}) == "");
+    kak_assert(required_bytes(Regex{"$"}) == "");
+    kak_assert(required_bytes(Regex{"a|b"}) == "");
+    kak_assert(required_bytes(Regex{"(?i)foo"}) == "");
+#endif
+
+    BufferLines lines = { "foo bar\n"_ss, "  foofoo barbar\n"_ss, "foo\n"_ss, "\n"_ss,
+                          "foo bar foo>\n"_ss, "xfoo\n"_ss, "bar foo\n"_ss };
+    Buffer buffer("test", Buffer::Flags::None, lines);
+    auto check_matches = [&] {
+        for (auto pattern : { "foo", "^foo", R"(\bfoo)", "bar$", "o+", "foo ?", "(?<=o)foo", "a*", R"(foo\n\n?bar)",
+                              R"(\<foo\>)", R"(foo\>)", R"(foo\n\')", R"(foo\n\nfoo)", "f.*o", R"((?<=r\n)foo)" })
+        {
+            Regex re{pattern};
+            Vector<std::pair<ByteCoord, ByteCoord>> expected, found;
+            using BoostIt = regex_ns::regex_iterator<BufferIterator>;
+            for (BoostIt it{buffer.begin(), buffer.end(), re}, end; it != end; ++it)
+                expected.emplace_back((*it)[0].first.coord(), (*it)[0].second.coord());
+            ChunkedBufferRange content{buffer, {0, 0}, buffer.end_coord()};
+            using RangeIt = RegexIterator<ChunkedBufferRange::iterator>;
+            for (RangeIt it{content.begin(), content.end(), re}, end; it != end; ++it)
+            {
+                kak_assert(content.iterator_at(content.coord((*it)[0].first)) == (*it)[0].first);
+                found.emplace_back(content.coord((*it)[0].first), content.coord((*it)[0].second));
+            }
+            kak_assert(not expected.empty() and found == expected);
+        }
+    };
+    check_matches();
+    // packed lines are viewed in place
+    buffer.compact_lines();
+    buffer.compact_lines();
+    check_matches();
+}
+
+void test_regex_cache()
+{
+    auto& cache = RegexCache::instance();
+    const size_t hits = cache.hits();
+    const size_t misses = cache.misses();
+    const size_t bytes = domain_allocated_bytes[(int)MemoryDomain::Regex];
+    auto pattern = [](int i) { return "cache test " + to_string(i); };
+
+    Regex first = cache.get(pattern(0));
+    kak_assert(cache.misses() == misses + 1 and cache.hits() == hits);
+    kak_assert(cache.get(pattern(0)) == first and cache.hits() == hits + 1);
+    // flags are part of the key
+    kak_assert(cache.get(pattern(0), Regex::icase).flags() & Regex::icase);
+    kak_assert(cache.misses() == misses + 2);
+    kak_assert(not (cache.get(pattern(0)).flags() & Regex::icase));
+    kak_assert(cache.hits() == hits + 2);
+
+    // least recently used entries are evicted first
+    for (int i = 1; i < (int)RegexCache::max_entries; ++i)
+        cache.get(pattern(i));
+    cache.get(pattern(0));
+    kak_assert(cache.hits() == hits + 3);
+    kak_assert(cache.misses() == misses + 1 + (int)RegexCache::max_entries);
+    cache.get(pattern(1));
+    kak_assert(cache.hits() == hits + 4);
+    cache.get(pattern(2));
+    kak_assert(cache.hits() == hits + 5);
+    kak_assert(cache.misses() == misses + 1 + (int)RegexCache::max_entries);
+    cache.get(pattern(0), Regex::icase);
+    kak_assert(cache.misses() == misses + 2 + (int)RegexCache::max_entries);
+    cache.get(pattern(3));
+    kak_assert(cache.misses() == misses + 3 + (int)RegexCache::max_entries);
+    kak_assert(domain_allocated_bytes[(int)MemoryDomain::Regex] > bytes);
+}
+
+void test_find_all_matches()
+{
+    BufferLines lines;
+    for (int i = 0; i < 3000; ++i)
+        lines.push_back(StringStorage::create((i % 7 ? "foo bar " : "baz ") + to_string(i) + "\n"));
+    Buffer buffer("test", Buffer::Flags::None, std::move(lines));
+    // packed blocks, with some unpacked lines in between
+    buffer.compact_lines();
+    buffer.compact_lines();
+    buffer.insert(buffer.iterator_at(1200_line), "foo 12\nbaz 13\n");
+    ChunkedBufferRange content{buffer, {3, 2}, {2900, 4}};
+
+    for (auto pattern : { "foo", "o*", R"(\d+\n\w+)", R"([a-z]+ \d+\n[a-z]+ \d+\n)",
+                          "(?<=\n)ba|r", "[^z]{37}", "foo(?=[^z]*9$)", R"(^baz \d+$)",
+                          R"(\<\d+\>)", R"((?<![a-z])ba)", R"(\`o|\d\')", "(foo)|(\\d+)", "x*$" })
+    {
+        Regex re{pattern};
+        RegexMatchList expected;
+        using RangeIt = RegexIterator<ChunkedBufferRange::iterator>;
+        for (RangeIt it{content.begin(), content.end(), re}, end; it != end; ++it)
+            expected.push_back(*it);
+        for (size_t chunk_size : { 997, 4096, 20000 })
+        {
+            auto matches = find_all_matches(content, re, chunk_size, 4);
+            kak_assert(matches.size() != 0 and matches.subs == expected.subs);
+        }
+    }
+}
+
+void test_find_match_in_buffer()
+{
+    kak_assert(not matches_can_span_lines(Regex{R"(^\bfoo[a-z\d]+ ?bar$)"}));
+    kak_assert(matches_can_span_lines(Regex{"foo.*bar"}));
+    kak_assert(matches_can_span_lines(Regex{R"(foo\sbar)"}));
+    kak_assert(matches_can_span_lines(Regex{"[^a]"}));
+    kak_assert(matches_can_span_lines(Regex{R"([\t-z])"}));
+    kak_assert(matches_can_span_lines(Regex{R"(foo\Z)"}));
+    kak_assert(matches_can_span_lines(Regex{R"(\Gfoo)"}));
+
+    BufferLines lines;
+    for (int i = 0; i < 3000; ++i)
+        lines.push_back(StringStorage::create((i % 7 ? "foo bar " : "baz ") + to_string(i) + "\n"));
+    Buffer buffer("test", Buffer::Flags::None, std::move(lines));
+    buffer.compact_lines();
+    buffer.insert(buffer.iterator_at(1500_line), "foo 12\n");
+    buffer.insert(buffer.iterator_at(2999_line), "zzz\n");
+
+    // same results as searching the whole buffer at once
+    ChunkedBufferRange content{buffer, {0, 0}, buffer.end_coord()};
+    using RangeIterator = ChunkedBufferRange::iterator;
+    auto expected_match = [&](ByteCoord pos, Direction direction, const Regex& re) {
+        MatchResults<RangeIterator> res;
+        auto find_last = [&](RangeIterator end) {
+            MatchResults<RangeIterator> matches;
+            for (RangeIterator begin = content.begin();
+                 regex_find(begin, end, matches, re) and begin != matches[0].second;
+                 begin = matches[0].second)
+                res = matches;
+            return not res.empty();
+        };
+        RangeIterator p = content.iterator_at(pos);
+        const bool found = direction == Forward
+            ? regex_find(p, content.end(), res, re) or
+              regex_find(content.begin(), content.end(), res, re)
+            : find_last(p) or find_last(content.end());
+        if (not found)
+            res = MatchResults<RangeIterator>{};
+        return res.empty() ? std::make_pair(ByteCoord{-1, 0}, ByteCoord{-1, 0})
+                           : std::make_pair(content.coord(res[0].first), content.coord(res[0].second));
+    };
+
+    for (auto pattern : { "foo", R"(^baz \d+$)", "zzz", R"(\<12\>)", R"(\Afoo)",
+                          R"(\d\n)", R"((?<!1)2\b)", "o*" })
+    {
+        Regex re{pattern};
+        for (LineCount line : { 0_line, 5_line, 1499_line, 1500_line, 2000_line, 3001_line })
+        {
+            for (auto direction : { Forward, Backward })
+            {
+                const ByteCoord pos{line, 2};
+                BufferIterator begin, end;
+                CaptureList captures;
+                const bool found = find_match_in_buffer(buffer, pos, direction, re,
+                                                        begin, end, captures);
+                const auto expected = expected_match(pos, direction, re);
+                kak_assert(found == (expected.first.line >= 0));
+                kak_assert(not found or (begin.coord() == expected.first and
+                                         end.coord() == expected.second));
+            }
+        }
+    }
+}
+
+void test_evict_buffer()
+{
+    Buffer buffer("test", Buffer::Flags::None, { "allo ?\n"_ss, "mais que fais la police\n"_ss });
+    buffer.insert(buffer.begin(), "hein ?\n");
+    buffer.commit_undo_group();
+    const String content = buffer.string({0,0}, buffer.end_coord());
+    evict_buffer(buffer);
+    kak_assert(buffer.lines_evicted());
+    kak_assert(buffer.string({0,0}, buffer.end_coord()) == content);
+    kak_assert(buffer.lines().lazy_byte_count() == 0);
+    buffer.undo();
+    kak_assert(not buffer.lines_evicted() and buffer.line_count() == 2);
+
+    // file buffers do not depend on their file once evicted
+    char filename[] = "/tmp/kak-evict-test-XXXXXX";
+    int fd = mkstemp(filename);
+    auto remove_file = on_scope_end([&]{ unlink(filename); });
+    const ssize_t written = write(fd, content.data(), (int)content.length());
+    kak_assert(written == (int)content.length());
+    Buffer file_buffer(filename, Buffer::Flags::File,
+                       { "hein ?\n"_ss, "allo ?\n"_ss, "mais que fais la police\n"_ss },
+                       get_fs_timestamp(filename));
+    bool evicted = evict_buffer(file_buffer);
+    kak_assert(evicted and file_buffer.lines_evicted());
+    // evicting again releases nothing more
+    evicted = evict_buffer(file_buffer);
+    kak_assert(not evicted);
+    const bool changed = pwrite(fd, "changed", 7, 0) == 7 and ftruncate(fd, 10) == 0;
+    close(fd);
+    kak_assert(changed);
+    kak_assert(file_buffer.lines().lazy_byte_count() == 0);
+    kak_assert(file_buffer.string({0,0}, file_buffer.end_coord()) == content);
+}
+
+void test_file_watcher()
+{
+    auto& watcher = FileWatcher::instance();
+    if (not watcher.active())
+        return;
+
+    char dirname[] = "/tmp/kak-watcher-test-XXXXXX";
+    if (mkdtemp(dirname) == nullptr)
+        return;
+    const String watched = String{dirname} + "/watched";
+    const String other = String{dirname} + "/other";
+    auto write_file = [](const String& filename, StringView content) {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        const ssize_t written = write(fd, content.data(), (int)content.length());
+        close(fd);
+        kak_assert(written == (int)content.length());
+    };
+    auto remove_files = on_scope_end([&]{
+        unlink(watched.c_str());
+        unlink(other.c_str());
+        rmdir(dirname);
+    });
+    write_file(watched, "before\n");
+    write_file(other, "other\n");
+
+    // inotify events are queued by the time the writes return
+    watcher.read_changes();
+    const size_t directory_count = watcher.directory_count();
+    watcher.watch(watched);
+    watcher.watch(watched);
+    kak_assert(watcher.directory_count() == directory_count + 1);
+
+    write_file(other, "changed\n");
+    kak_assert(watcher.read_changes().empty());
+
+    write_file(watched, "after\n");
+    kak_assert(watcher.read_changes() == Vector<String>{watched});
+
+    // replaced by a rename, the new file is still followed
+    write_file(other, "renamed\n");
+    const int renamed = rename(other.c_str(), watched.c_str());
+    kak_assert(renamed == 0);
+    kak_assert(watcher.read_changes() == Vector<String>{watched});
+    write_file(watched, "again\n");
+    kak_assert(watcher.read_changes() == Vector<String>{watched});
+
+    // watches are counted, the file is followed until the last unwatch
+    watcher.unwatch(watched);
+    write_file(watched, "still\n");
+    kak_assert(watcher.read_changes() == Vector<String>{watched});
+    watcher.unwatch(watched);
+    kak_assert(watcher.directory_count() == directory_count);
+    write_file(watched, "unwatched\n");
+    kak_assert(watcher.read_changes().empty());
 }
 
 void run_unit_tests()
@@ -234,7 +1210,24 @@ void run_unit_tests()
     test_string();
     test_keys();
     test_buffer();
+    test_apply_batch();
+    test_trim_fifo_lines();
     test_undo_group_optimizer();
+    test_line_list();
+    test_pack_lines();
+    test_write_lines();
     test_word_db();
     test_line_modifications();
+    test_diff();
+    test_compression();
+    test_slab_allocator();
+    test_string_registry();
+    test_undo_history();
+    test_journal();
+    test_evict_buffer();
+    test_file_watcher();
+    test_regex();
+    test_regex_cache();
+    test_find_all_matches();
+    test_find_match_in_buffer();
 }
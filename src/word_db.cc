@@ -26,7 +26,7 @@ UsedLetters used_letters(StringView str)
     return res;
 }
 
-static WordDB::WordList get_words(const SharedString& content)
+static WordDB::WordList get_words(StringView content)
 {
     WordDB::WordList res;
     using Iterator = utf8::iterator<const char*, utf8::InvalidPolicy::Pass>;
@@ -43,9 +43,7 @@ static WordDB::WordList get_words(const SharedString& content)
         }
         else if (in_word and not word)
         {
-            const ByteCount start = word_start - content.begin();
-            const ByteCount length = it.base() - word_start;
-            res.push_back(content.acquire_substr(start, length));
+            res.push_back({word_start, it.base()});
             in_word = false;
         }
     }
@@ -75,20 +73,90 @@ void WordDB::remove_words(const WordList& words)
 }
 
 WordDB::WordDB(const Buffer& buffer)
-    : m_buffer{&buffer}, m_timestamp{buffer.timestamp()}
+    : m_buffer{&buffer}, m_timestamp{buffer, buffer.timestamp()}
 {
-    m_lines.reserve((int)buffer.line_count());
-    for (auto line = 0_line, end = buffer.line_count(); line < end; ++line)
+    rebuild_db();
+}
+
+// Lines out of owned packed data are copied, consecutive ones together,
+// so that the buffer can still pack their block, or drop the mapped file
+// they point into.
+void WordDB::add_lines(Lines& lines, LineDataList& data, LineCount first, LineCount last) const
+{
+    auto& buffer_lines = m_buffer->lines();
+    for (auto line = first; line < last;)
     {
-        m_lines.push_back(buffer.line_storage(line));
-        add_words(get_words(SharedString{m_lines.back()}));
+        auto ref = buffer_lines.line_ref(line);
+        if (ref.data)
+        {
+            // consecutive lines of a packed block share their data
+            if (data.empty() or data.back() != ref.data)
+                data.push_back(std::move(ref.data));
+            lines.push_back(ref.content);
+            ++line;
+            continue;
+        }
+
+        auto end = line + 1;
+        size_t size = (int)ref.content.length();
+        for (; end < last; ++end)
+        {
+            auto next = buffer_lines.line_ref(end);
+            if (next.data)
+                break;
+            size += (int)next.content.length();
+        }
+        PackedLines* copy = new PackedLines{size};
+        data.push_back(copy);
+        char* pos = copy->data;
+        for (; line < end; ++line)
+        {
+            const StringView content = buffer_lines[line];
+            memcpy(pos, content.data(), (int)content.length());
+            lines.push_back({pos, content.length()});
+            pos += (int)content.length();
+        }
     }
 }
 
+void WordDB::rebuild_db()
+{
+    auto& buffer = *m_buffer;
+
+    m_words.clear();
+    m_lines.clear();
+    m_line_data.clear();
+    m_lines.reserve((int)buffer.line_count());
+    add_lines(m_lines, m_line_data, 0, buffer.line_count());
+    for (auto& line : m_lines)
+        add_words(get_words(line));
+    m_refreshed_data_count = m_line_data.size();
+    m_timestamp = buffer.timestamp();
+}
+
+// point the lines into the current buffer data, their content is the
+// same so words are unchanged.
+void WordDB::refresh_lines()
+{
+    auto& buffer = *m_buffer;
+    kak_assert(m_lines.size() == (int)buffer.line_count());
+
+    Lines lines;
+    LineDataList data;
+    lines.reserve(m_lines.size());
+    add_lines(lines, data, 0, buffer.line_count());
+    m_lines = std::move(lines);
+    m_line_data = std::move(data);
+    m_refreshed_data_count = m_line_data.size();
+}
+
 void WordDB::update_db()
 {
     auto& buffer = *m_buffer;
 
+    if (not buffer.changes_available_since(m_timestamp))
+        return rebuild_db();
+
     auto modifs = compute_line_modifications(buffer, m_timestamp);
     m_timestamp = buffer.timestamp();
 
@@ -105,26 +173,27 @@ void WordDB::update_db()
         kak_assert(modif.new_line < buffer.line_count() or modif.num_added == 0);
         kak_assert(old_line <= modif.old_line);
         while (old_line < modif.old_line)
-            new_lines.push_back(std::move(m_lines[(int)old_line++]));
+            new_lines.push_back(m_lines[(int)old_line++]);
 
         kak_assert((int)new_lines.size() == (int)modif.new_line);
 
         while (old_line < modif.old_line + modif.num_removed)
         {
             kak_assert(old_line < m_lines.size());
-            remove_words(get_words(SharedString{m_lines[(int)old_line++]}));
+            remove_words(get_words(m_lines[(int)old_line++]));
         }
 
-        for (auto l = 0_line; l < modif.num_added; ++l)
-        {
-            new_lines.push_back(buffer.line_storage(modif.new_line + l));
-            add_words(get_words(SharedString{new_lines.back()}));
-        }
+        add_lines(new_lines, m_line_data, modif.new_line, modif.new_line + modif.num_added);
+        for (auto l = modif.new_line; l < modif.new_line + modif.num_added; ++l)
+            add_words(get_words(new_lines[(int)l]));
     }
     while (old_line != (int)m_lines.size())
-        new_lines.push_back(std::move(m_lines[(int)old_line++]));
+        new_lines.push_back(m_lines[(int)old_line++]);
 
     m_lines = std::move(new_lines);
+
+    if (m_line_data.size() > 2 * m_refreshed_data_count + 64)
+        refresh_lines();
 }
 
 int WordDB::get_word_occurences(StringView word) const
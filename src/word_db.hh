@@ -41,6 +41,8 @@ public:
     int get_word_occurences(StringView word) const;
 private:
     void update_db();
+    void rebuild_db();
+    void refresh_lines();
     void add_words(const WordList& words);
     void remove_words(const WordList& words);
 
@@ -50,12 +52,21 @@ private:
         int refcount;
     };
     using WordToInfo = UnorderedMap<SharedString, WordInfo, MemoryDomain::WordDB>;
-    using Lines = Vector<ref_ptr<StringStorage>, MemoryDomain::WordDB>;
+    // views of the lines the words were taken from, needed to remove them
+    // once lines change, and the data they point into. Packed lines are
+    // referenced in place, so the buffer does not need to unpack them.
+    using Lines = Vector<StringView, MemoryDomain::WordDB>;
+    using LineDataList = Vector<ref_ptr<LineData>, MemoryDomain::WordDB>;
+    void add_lines(Lines& lines, LineDataList& data, LineCount first, LineCount last) const;
 
     safe_ptr<const Buffer> m_buffer;
-    size_t m_timestamp;
+    ChangeTimestamp m_timestamp;
     WordToInfo m_words;
     Lines m_lines;
+    // data of removed lines is only released when lines get refreshed,
+    // once that list doubled in size.
+    LineDataList m_line_data;
+    size_t m_refreshed_data_count = 0;
 };
 
 }